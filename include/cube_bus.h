@@ -0,0 +1,239 @@
+/**
+ *  \file       cube_bus.h
+ *
+ *  \brief      Bus owner thread for the QB cube serial line.
+ *
+ *  \details
+ *
+ *  A CubeBus opens the serial port and hands it to a dedicated I/O thread,
+ *  which is the only one touching its comm_settings afterwards. Requests from
+ *  any thread are pushed on lock-free queues and completed through futures:
+ *  callers never block on the serial line themselves and the bus thread
+ *  issues transactions back to back while work is pending. A caller only
+ *  takes a lock to wake the bus thread when it has gone to sleep.
+ *
+ *  There is a queue per traffic class: control writes, measurement polls and
+ *  diagnostics (pings, parameter and info reads, jobs). Between transactions
+ *  the bus thread serves the highest class with work that is within its
+ *  bandwidth budget, the share of bus time it may take while others wait;
+ *  only if none is, the highest class with work. Control writes therefore go
+ *  out right after the transaction in progress, ahead of any queued poll or
+ *  diagnostic, and a busy class cannot starve the ones below it for longer
+ *  than their budgets allow. The time requests wait is kept per class.
+ *
+ *  Opened with a CubeBusRealtime profile, the bus thread runs under
+ *  SCHED_FIFO, optionally pinned to a core and with the process memory
+ *  locked. Requests are recycled through a preallocated pool, so the bus
+ *  thread does not go through the allocator while serving them.
+ *
+ *  Position setpoints are coalesced, last writer wins: when a setInputs
+ *  request reaches the head of the queue it sends the newest inputs given
+ *  for that cube so far, and the requests still queued behind it for the
+ *  same cube complete without touching the line. A setpoint never jumps
+ *  ahead of a batch, sync or broadcast write submitted before it for the
+ *  same cube, so the cube ends on the inputs written last.
+**/
+
+#ifndef CUBE_BUS_H_INCLUDED
+#define CUBE_BUS_H_INCLUDED
+
+#include <qb_cube_lib.h>
+
+#include <string>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/lockfree/queue.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/future.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+/** Outcome of a bus transaction. */
+struct CubeReply
+{
+  int status;                                 ///< 0 if ok, -1 on bus error
+  short int currents[NUM_OF_MOTORS];          ///< filled by getCurrAndMeas
+  short int measurements[NUM_OF_SENSORS];     ///< filled by get* requests
+  long long stamp_us;                         ///< get* requests: CLOCK_MONOTONIC halfway through the transaction
+  long wire_time_us;                          ///< filled by setInputsBatch
+  long skew_us;                               ///< filled by setInputsSync
+  bool coalesced;                             ///< setInputs: a newer setpoint went out instead
+};
+
+/** Traffic classes, highest priority first. */
+enum CubeBusClass
+{
+  BUS_CLASS_CONTROL,          ///< setInputs, batches, activation
+  BUS_CLASS_POLL,             ///< getMeasurements, getCurrAndMeas
+  BUS_CLASS_DIAGNOSTIC,       ///< ping, jobs
+  BUS_CLASSES
+};
+
+/** Traffic of a bus since it was created or its stats reset. */
+struct CubeBusCounters
+{
+  unsigned long setpoints_sent;               ///< setInputs that reached the line
+  unsigned long setpoints_coalesced;          ///< setInputs superseded while queued
+  unsigned long busy_us[BUS_CLASSES];         ///< bus time spent serving each class
+  comm_histogram queue_delay[BUS_CLASSES];    ///< time requests waited in their queue
+};
+
+/** Most devices a single setInputsBatch request carries. */
+#define BUS_MAX_BATCH 16
+
+typedef boost::shared_future<CubeReply> CubeFuture;
+
+/** Work run on the bus thread with exclusive access to the port; its return
+ *  value becomes the reply status. */
+typedef boost::function<int (comm_settings *)> CubeJob;
+
+/** Scheduling of the bus thread, the defaults leave it as a normal thread. */
+struct CubeBusRealtime
+{
+  CubeBusRealtime() : priority(0), cpu(-1), lock_memory(false) {}
+
+  int priority;       ///< SCHED_FIFO priority (1-99), 0 keeps SCHED_OTHER
+  int cpu;            ///< core the thread is pinned to, -1 for any
+  bool lock_memory;   ///< mlockall the process and prefault the thread stack
+};
+
+class CubeBus
+{
+public:
+  CubeBus();
+  virtual ~CubeBus();
+
+  /** Opens the port and starts the bus thread. Returns false on failure.
+   *  Real-time settings that cannot be applied (usually for lack of
+   *  privileges) do not fail the call, see realtimeError(). */
+  bool open(const std::string &port, int baud_rate = DEFAULT_BAUD_RATE,
+            const CubeBusRealtime &realtime = CubeBusRealtime());
+
+  /** Stops the bus thread, failing pending requests, and closes the port. */
+  void close();
+
+  bool isOpen() const { return running_; }
+
+  /** What open() could not apply of the real-time profile, empty if all. */
+  const std::string &realtimeError() const { return realtime_error_; }
+
+  /** Link statistics, read without stopping the bus thread. Any thread may
+   *  reset them; a read meanwhile sees either the old baseline or the new. */
+  void stats(comm_stats *snapshot) { commStatsSnapshot(&comm_, snapshot); }
+  void resetStats();
+
+  CubeBusCounters counters() const;
+
+  /** Turns setpoint coalescing on (the default) or off. */
+  void setCoalescing(bool coalesce) { coalesce_ = coalesce; }
+
+  /** Share of bus time (0-1) a class may take while lower ones have work
+   *  waiting; 1 never holds it back. Defaults: control 1, polls 0.8,
+   *  diagnostics 0.2. */
+  void setBudget(CubeBusClass traffic_class, double share);
+
+  // asynchronous requests, completed by the bus thread
+  CubeFuture ping(int id);
+  CubeFuture activate(int id, bool activate);
+  CubeFuture setInputs(int id, short int inputs[NUM_OF_MOTORS]);
+
+  /** Inputs for up to BUS_MAX_BATCH devices, sent with a single write. The
+   *  reply completes once the frames have left the port and carries the
+   *  time they took in wire_time_us. */
+  CubeFuture setInputsBatch(int num_of_devices, const int *ids,
+                            short int inputs[][NUM_OF_MOTORS]);
+
+  /** Inputs for up to BUS_MAX_BATCH devices with as little skew as possible,
+   *  see commSetInputsSync(). The reply status is 1 if they were broadcast,
+   *  0 or 2 if batched, and skew_us holds the estimated skew. */
+  CubeFuture setInputsSync(int num_of_devices, const int *ids,
+                           short int inputs[][NUM_OF_MOTORS], bool whole_bus);
+  CubeFuture getMeasurements(int id);
+  CubeFuture getCurrAndMeas(int id);
+  CubeFuture submitJob(const CubeJob &job, CubeBusClass traffic_class = BUS_CLASS_DIAGNOSTIC);
+
+private:
+  enum RequestType
+  {
+    REQ_PING,
+    REQ_ACTIVATE,
+    REQ_SET_INPUTS,
+    REQ_SET_INPUTS_BATCH,
+    REQ_SET_INPUTS_SYNC,
+    REQ_GET_MEASUREMENTS,
+    REQ_GET_CURR_AND_MEAS,
+    REQ_JOB
+  };
+
+  struct Request
+  {
+    RequestType type;
+    int id;
+    short int inputs[NUM_OF_MOTORS];
+    int num_of_devices;                           ///< batch requests only
+    int batch_ids[BUS_MAX_BATCH];
+    short int batch_inputs[BUS_MAX_BATCH][NUM_OF_MOTORS];
+    bool whole_bus;                               ///< sync requests only
+    unsigned int sequence;                        ///< coalesced setInputs only, else 0
+    CubeBusClass traffic_class;
+    long long submitted_us;
+    CubeJob job;
+    boost::promise<CubeReply> promise;
+  };
+
+  Request *allocate();
+  void release(Request *request);
+  CubeFuture submit(Request *request);
+  static CubeBusClass classOf(const Request *request);
+  bool pending() const;
+  Request *next();
+  static void fillBatch(Request *request, int num_of_devices, const int *ids,
+                        short int inputs[][NUM_OF_MOTORS]);
+  void markWritten(int id);
+  bool coalesce(Request *request, short int inputs[NUM_OF_MOTORS]);
+  void applyRealtime();
+  void run();
+  void execute(Request *request);
+
+  comm_settings comm_;
+  boost::scoped_ptr<boost::lockfree::queue<Request*> > queues_[BUS_CLASSES];
+  boost::lockfree::queue<Request*> pool_;
+  boost::atomic<bool> running_;
+  boost::atomic<int> producers_;                  ///< submit() calls pushing now
+  boost::atomic<bool> sleeping_;                  ///< bus thread waiting for work
+  boost::mutex wake_mutex_;
+  boost::condition_variable wake_cond_;
+  boost::thread thread_;
+  CubeBusRealtime realtime_;
+  std::string realtime_error_;
+
+  /** Newest setpoint of a cube and the last other write to it, by sequence. */
+  struct Setpoint
+  {
+    boost::atomic<boost::uint64_t> latest;        ///< sequence << 32 | inputs
+    boost::atomic<unsigned int> written;
+  };
+
+  boost::atomic<bool> coalesce_;
+  boost::atomic<unsigned int> sequence_;
+  Setpoint setpoints_[256];                       ///< by cube id
+  boost::atomic<unsigned int> broadcast_written_;
+  unsigned int sent_[256];                        ///< bus thread only
+  boost::atomic<unsigned long> setpoints_sent_;
+  boost::atomic<unsigned long> setpoints_coalesced_;
+
+  // bandwidth budgets as token buckets of bus time, bus thread only
+  boost::atomic<double> budgets_[BUS_CLASSES];
+  double tokens_us_[BUS_CLASSES];
+  long long refilled_us_;
+
+  boost::atomic<unsigned long> busy_us_[BUS_CLASSES];
+  comm_histogram queue_delay_[BUS_CLASSES];       ///< written by the bus thread
+  CubeBusCounters baseline_;                      ///< at the last resetStats
+  boost::atomic<unsigned int> baseline_sequence_; ///< odd while it is rewritten
+};
+
+#endif
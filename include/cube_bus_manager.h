@@ -0,0 +1,85 @@
+/**
+ *  \file       cube_bus_manager.h
+ *
+ *  \brief      One CubeBus per serial port, with requests routed by device name.
+ *
+ *  \details
+ *
+ *  Rigs with several USB-RS485 adapters get one bus thread per port in a
+ *  single process, each with its own real-time profile (typically pinned to
+ *  its own core), so the ports are served in parallel and throughput grows
+ *  with the number of adapters. Devices are registered under a name with the
+ *  port and id they answer on; requests addressed by name go to the bus of
+ *  that port.
+ *
+ *  Ports and devices are configured before use: once requests are issued,
+ *  the routing tables are only read and can be used from any thread.
+**/
+
+#ifndef CUBE_BUS_MANAGER_H_INCLUDED
+#define CUBE_BUS_MANAGER_H_INCLUDED
+
+#include <cube_bus.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+/** Where a named device lives. */
+struct CubeRoute
+{
+  std::string port;
+  int id;
+  CubeBus *bus;
+};
+
+class CubeBusManager
+{
+public:
+  CubeBusManager();
+  virtual ~CubeBusManager();
+
+  /** Opens port with its own bus thread. The bus is kept even if opening
+   *  fails, so that requests to its devices fail instead of going astray;
+   *  the return value tells whether it is running. */
+  bool addPort(const std::string &port, int baud_rate = DEFAULT_BAUD_RATE,
+               const CubeBusRealtime &realtime = CubeBusRealtime());
+
+  /** Bus of port, NULL if the port was not added. */
+  CubeBus *bus(const std::string &port) const;
+
+  /** Ports in the order they were added. */
+  const std::vector<std::string> &ports() const { return ports_; }
+
+  /** Registers device name as id on port. Returns false if the port was not
+   *  added or the name is already taken. */
+  bool addDevice(const std::string &name, const std::string &port, int id);
+
+  /** Route of a device, NULL if the name is unknown. */
+  const CubeRoute *route(const std::string &name) const;
+
+  /** Device names in the order they were added. */
+  const std::vector<std::string> &devices() const { return devices_; }
+
+  /** Stops every bus thread and closes the ports. */
+  void close();
+
+  // requests routed by device name, unknown names fail at once
+  CubeFuture ping(const std::string &name);
+  CubeFuture activate(const std::string &name, bool activate);
+  CubeFuture setInputs(const std::string &name, short int inputs[NUM_OF_MOTORS]);
+  CubeFuture getMeasurements(const std::string &name);
+  CubeFuture getCurrAndMeas(const std::string &name);
+
+private:
+  static CubeFuture failed();
+
+  std::vector<std::string> ports_;
+  std::map<std::string, boost::shared_ptr<CubeBus> > buses_;
+  std::vector<std::string> devices_;
+  std::map<std::string, CubeRoute> routes_;
+};
+
+#endif
@@ -0,0 +1,156 @@
+/**
+ *  \file       cube_controller.h
+ *
+ *  \brief      Fixed-rate position reference streaming for one cube.
+ *
+ *  \details
+ *
+ *  Writing a far target straight into the cube's position reference makes
+ *  the firmware loop slew as fast as it can, overshoot and ring. A
+ *  CubeController instead follows a CubeTrajectory on the host and streams
+ *  the intermediate references through the CubeBus at a fixed control rate,
+ *  so the cube only ever sees references it can track. Between moves the
+ *  thread sleeps and the bus carries nothing.
+ *
+ *  Setpoints can also be streamed as they come from a planner, at whatever
+ *  irregular rate: the controller renders the stream a fixed delay behind
+ *  real time, interpolating linearly between the points received so the
+ *  cube gets a steady reference every period. When the stream runs dry the
+ *  reference carries on at the last velocity, decaying to a stop, and the
+ *  stream ends once no point has come for the timeout.
+ *
+ *  A spin ramps the reference velocity to a constant rate and keeps the
+ *  reference running for as long as the spin lasts.
+ *
+ *  References are in ticks and clamped to the 16 bit range of the inputs, a
+ *  spin braking in time to stop at its end. With setWrap they are sent
+ *  modulo 2^16 instead, for cubes that turn endlessly and close their loop
+ *  on the wrapped error.
+**/
+
+#ifndef CUBE_CONTROLLER_H_INCLUDED
+#define CUBE_CONTROLLER_H_INCLUDED
+
+#include <cube_bus.h>
+#include <cube_trajectory.h>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <deque>
+
+class CubeController
+{
+public:
+  CubeController(CubeBus &bus, int id);
+  virtual ~CubeController();
+
+  /** Starts the control thread at rate_hz. */
+  bool start(double rate_hz);
+
+  /** Stops the control thread, leaving the last reference in the cube. */
+  void stop();
+
+  bool isRunning() const { return running_; }
+
+  /** Stream timing, in seconds: points are rendered delay behind their
+   *  arrival (at least the longest gap expected between them), the velocity
+   *  held past the last point decays with time constant decay (0 holds the
+   *  last point at once) and the stream ends after timeout without a point.
+   *  Defaults 0.05, 0.1 and 0.5. */
+  void setStreamTiming(double delay, double decay, double timeout);
+
+  /** Sends references modulo 2^16 rather than clamped. Off by default. */
+  void setWrap(bool wrap);
+
+  /** Moves to target along a time-optimal profile within limits. The move
+   *  starts from the last reference sent, or from `from` (usually the
+   *  measured position) if none was sent yet. A move, stream or spin still in
+   *  progress is replaced, braking to rest within the limits before heading
+   *  for target. */
+  void moveTo(double target, const CubeMotionLimits &limits, double from);
+
+  /** Adds a point received at stamp_us (monotonic clock) to the stream,
+   *  replacing any move. A new stream starts from the last reference sent,
+   *  or from `from` if none was. */
+  void stream(double position, long long stamp_us, double from);
+
+  /** Ramps the reference velocity to velocity (ticks/s) at acceleration
+   *  (ticks/s^2, 0 for a jump) and holds it, replacing any move; a spin to 0
+   *  stops once the ramp is done. A new spin starts from the last reference
+   *  sent and the velocity of a move or stream in progress, or at rest from
+   *  `from` if no reference was sent. */
+  void spin(double velocity, double acceleration, double from);
+
+  /** Sends position once as the reference and stops any move. */
+  void hold(double position);
+
+  /** Stops any move without sending anything, for references written to
+   *  the cube by other means. The next move starts from `from`. */
+  void release();
+
+  /** True while a move is being streamed. */
+  bool isMoving() const;
+
+  /** True while stream points are being followed. */
+  bool isStreaming() const;
+
+  /** True while spinning, ramps included. */
+  bool isSpinning() const;
+
+  /** Velocity of the reference while spinning, ticks/s. */
+  double spinVelocity() const;
+
+  /** True if the last spin had to stop at the end of the 16 bit range. */
+  bool isLimited() const;
+
+  /** Last reference sent, or the one about to be. */
+  double reference() const;
+
+private:
+  void run();
+  void send(double reference, bool wrap);
+  double streamReference(long long now, double *velocity, double *acceleration);
+  double spinReference(long long now, double *acceleration);
+
+  /** A streamed setpoint and the velocity from the one before it. */
+  struct StreamPoint
+  {
+    long long stamp_us;
+    double position;
+    double velocity;
+  };
+
+  CubeBus &bus_;
+  int id_;
+  long period_us_;
+  CubeTrajectory trajectory_;
+  long long move_start_us_;
+  bool moving_;                     ///< streaming trajectory_
+  bool pending_;                    ///< a hold reference is waiting to be sent
+  bool streaming_;                  ///< following points_
+  std::deque<StreamPoint> points_;
+  long stream_delay_us_;
+  double stream_decay_;             ///< seconds
+  long stream_timeout_us_;
+  bool spinning_;                   ///< ramping or holding spin_velocity_
+  bool limited_;
+  double spin_velocity_;
+  double spin_target_;
+  double spin_acceleration_;
+  long long spin_last_us_;
+  bool wrap_;
+  bool has_reference_;
+  double reference_;
+  double velocity_;                 ///< of the reference, ticks/s
+  double acceleration_;             ///< of the reference, ticks/s^2
+  long long reference_us_;          ///< when reference_ was worked out
+  mutable boost::mutex mutex_;      ///< guards the move state above
+  boost::condition_variable wake_;
+  boost::atomic<bool> running_;
+  boost::thread thread_;
+};
+
+#endif
@@ -0,0 +1,94 @@
+/**
+ *  \file       cube_poller.h
+ *
+ *  \brief      Round-robin measurement polling of the cubes on one bus.
+ *
+ *  \details
+ *
+ *  A CubePoller reads the currents and measurements of a list of cubes
+ *  (CMD_GET_CURR_AND_MEAS) through a CubeBus, one device per slot, in a fixed
+ *  rotation: every device gets the same share of the bus whatever the others
+ *  do, and a device that times out only costs its own slot. Slots are paced
+ *  so that each device is sampled at the requested rate, or as fast as the
+ *  line allows if the rate is out of reach. Other bus requests (setpoints,
+ *  services) interleave between the slots.
+ *
+ *  The latest sample of each device and the sample rate it actually got are
+ *  available at any time from other threads, and an optional callback sees
+ *  every good sample as it arrives, on the polling thread. Samples are
+ *  published through a sequence lock: readers never block the polling
+ *  thread, they retry in the rare case they overlap with an update.
+**/
+
+#ifndef CUBE_POLLER_H_INCLUDED
+#define CUBE_POLLER_H_INCLUDED
+
+#include <cube_bus.h>
+
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread/thread.hpp>
+
+/** Latest reading of a device. */
+struct CubeSample
+{
+  int status;                                 ///< 0 if the last poll answered
+  short int currents[NUM_OF_MOTORS];          ///< last good currents
+  short int measurements[NUM_OF_SENSORS];     ///< last good measurements
+  double velocity;                            ///< of measurements[0], ticks per second
+  long long stamp_us;                         ///< CLOCK_MONOTONIC of the last good poll, 0 if none
+  unsigned long samples;                      ///< good polls since start()
+  unsigned long failures;                     ///< polls without an answer
+  double rate;                                ///< good polls per second, last window
+};
+
+/** Called on the polling thread with each good sample of device id. */
+typedef boost::function<void (int id, const CubeSample &sample)> CubeSampleCallback;
+
+class CubePoller
+{
+public:
+  explicit CubePoller(CubeBus &bus);
+  virtual ~CubePoller();
+
+  /** Sets the callback run for every good sample, before start(). */
+  void setCallback(const CubeSampleCallback &callback) { callback_ = callback; }
+
+  /** Starts polling ids, each at rate_hz. Returns false if already running
+   *  or if there is nothing to poll. */
+  bool start(const std::vector<int> &ids, double rate_hz);
+
+  /** Stops the polling thread. */
+  void stop();
+
+  bool isRunning() const { return running_; }
+
+  /** Copies the latest sample of id, false if id is not polled. Lock-free,
+   *  but must not race with start(). */
+  bool latest(int id, CubeSample *sample) const;
+
+private:
+  /** A published sample and its sequence number, odd while it is written. */
+  struct Slot
+  {
+    boost::atomic<unsigned int> sequence;
+    CubeSample sample;
+  };
+
+  void run();
+  void publish(size_t index);
+
+  CubeBus &bus_;
+  std::vector<int> ids_;
+  std::vector<CubeSample> samples_;         ///< polling thread's copies
+  boost::scoped_array<Slot> published_;     ///< what latest() reads
+  long period_us_;                  ///< one slot
+  CubeSampleCallback callback_;
+  boost::atomic<bool> running_;
+  boost::thread thread_;
+};
+
+#endif
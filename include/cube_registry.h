@@ -0,0 +1,78 @@
+/**
+ *  \file       cube_registry.h
+ *
+ *  \brief      Persistent registry of the cubes found on each serial port.
+ *
+ *  \details
+ *
+ *  The registry keeps, per serial port, the ids of the cubes found there and
+ *  a snapshot of their stored parameters, in a plain text file. At start-up
+ *  sync() checks the cached devices with a single ping each and only scans
+ *  the bus (and reads the parameters again) when one of them does not
+ *  answer, or when nothing is known about the port yet. A port found empty
+ *  is recorded as such and only scanned again once a cube it is expected to
+ *  have answers a ping.
+ *
+ *  File format, one entry per line:
+ *
+ *      <port> empty
+ *      <port> <id> found
+ *      <port> <id> param <qbmove_parameter> <value bytes in hex>
+**/
+
+#ifndef CUBE_REGISTRY_H_INCLUDED
+#define CUBE_REGISTRY_H_INCLUDED
+
+#include <qb_cube_lib.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+/** What is known about a cube. */
+struct CubeRecord
+{
+  int id;
+  std::map<int, std::vector<unsigned char> > params;  ///< commGetParam values
+};
+
+class CubeRegistry
+{
+public:
+  explicit CubeRegistry(const std::string &path);
+
+  /** Reads the file, returns false if it does not exist or is unreadable. */
+  bool load();
+
+  /** Writes the file, creating its directories if needed. The new contents
+   *  replace the old ones only once fully written. */
+  bool save() const;
+
+  /** Ids recorded for port, in the order they were found. */
+  std::vector<int> ids(const std::string &port) const;
+
+  /** Record of a cube, NULL if unknown. */
+  const CubeRecord *find(const std::string &port, int id) const;
+
+  void update(const std::string &port, const CubeRecord &record);
+  void forget(const std::string &port);
+
+  /** Validates the devices cached for port, scanning the bus and refreshing
+   *  the records (and the file) only if something does not match. On a port
+   *  recorded empty only the expected ids are pinged.
+   *  Returns the number of devices on the bus. */
+  int sync(comm_settings *comm, const std::string &port,
+           const std::vector<int> &expected = std::vector<int>());
+
+  /** Number of full scans sync() had to run since construction. */
+  int scans() const { return scans_; }
+
+private:
+  std::string path_;
+  std::map<std::string, std::vector<CubeRecord> > ports_;
+  int scans_;
+
+  static CubeRecord query(comm_settings *comm, int id);
+};
+
+#endif
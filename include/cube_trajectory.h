@@ -0,0 +1,93 @@
+/**
+ *  \file       cube_trajectory.h
+ *
+ *  \brief      Time-optimal rest-to-rest motion profiles.
+ *
+ *  \details
+ *
+ *  A CubeTrajectory plans the fastest move between two positions, starting
+ *  and ending at rest, within velocity, acceleration and jerk limits. With a
+ *  jerk limit the profile is the usual seven segment S-curve (jerk +J, 0,
+ *  -J, cruise, -J, 0, +J), segments dropping out when a limit cannot be
+ *  reached over the distance; without one it is a trapezoid. Units are up to
+ *  the caller as long as they are consistent (ticks, ticks/s, ...).
+ *
+ *  A move can also start from a moving state, to replace one in progress:
+ *  the profile then first brakes to rest within the same limits (easing the
+ *  acceleration in and out under the jerk limit) and carries on to the
+ *  target from where the brake leaves off, so position, velocity and
+ *  acceleration stay continuous across the switch.
+ *
+ *  \code
+
+    CubeMotionLimits limits(20000, 100000, 2000000);   // ticks/s, /s^2, /s^3
+    CubeTrajectory trajectory;
+
+    trajectory.plan(0, 8192, limits);
+    for (double t = 0; t < trajectory.duration(); t += 0.002)
+        reference = trajectory.position(t);
+
+ *  \endcode
+**/
+
+#ifndef CUBE_TRAJECTORY_H_INCLUDED
+#define CUBE_TRAJECTORY_H_INCLUDED
+
+/** Motion limits, all positive. A jerk of 0 gives a trapezoidal profile. */
+struct CubeMotionLimits
+{
+  CubeMotionLimits(double v = 0, double a = 0, double j = 0) :
+    velocity(v), acceleration(a), jerk(j) {}
+
+  double velocity;
+  double acceleration;
+  double jerk;
+};
+
+class CubeTrajectory
+{
+public:
+  CubeTrajectory();
+
+  /** Plans the move from start to target. Returns false, and plans a step
+   *  to target, if the velocity or acceleration limit is not positive. */
+  bool plan(double start, double target, const CubeMotionLimits &limits);
+
+  /** Plans the move to target from start, moving at velocity and
+   *  acceleration, braking to rest first if either is not 0. */
+  bool plan(double start, double velocity, double acceleration, double target,
+            const CubeMotionLimits &limits);
+
+  /** Time the move takes, in seconds. */
+  double duration() const { return duration_; }
+
+  double target() const { return target_; }
+
+  /** State at t seconds from the start, clamped to the ends of the move. */
+  void sample(double t, double *position, double *velocity, double *acceleration) const;
+  double position(double t) const;
+
+private:
+  /** Up to four segments bring the starting state to rest (easing off an
+   *  overshooting deceleration, then a jerk, hold, jerk brake), the usual
+   *  seven make the move. */
+  enum { STOP_SEGMENTS = 4, MOVE_SEGMENTS = 7, SEGMENTS = STOP_SEGMENTS + MOVE_SEGMENTS };
+
+  /** A stretch of constant jerk, with the state it starts from. */
+  struct Segment
+  {
+    double duration;
+    double jerk;
+    double position, velocity, acceleration;
+  };
+
+  static void brake(double velocity, double acceleration, const CubeMotionLimits &limits,
+                    double *durations, double *jerks, double *accelerations);
+
+  Segment segments_[SEGMENTS];
+  double start_;
+  double target_;
+  double duration_;
+};
+
+#endif
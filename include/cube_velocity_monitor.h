@@ -0,0 +1,80 @@
+/**
+ *  \file       cube_velocity_monitor.h
+ *
+ *  \brief      Tracking error of a cube spinning at a commanded velocity.
+ *
+ *  \details
+ *
+ *  A CubeVelocityMonitor is fed the position samples of one cube and
+ *  measures its velocity as the least-squares slope over a sliding window,
+ *  long enough to average the tick quantization out (one tick over 2 ms is
+ *  already 5 deg/s) and the jitter of the sample stamps. The window is
+ *  unwrapped across the 16 bit range, so endless rotation is fine.
+ *
+ *  The monitor locks once the measured velocity has stayed within the
+ *  tolerance of the commanded one for a whole window, after the ramp and the
+ *  ringing it leaves; from then on it keeps the largest and the RMS error,
+ *  which is the bound the spin was held to. Samples come from the polling
+ *  thread, the statistics can be read from any other.
+**/
+
+#ifndef CUBE_VELOCITY_MONITOR_H_INCLUDED
+#define CUBE_VELOCITY_MONITOR_H_INCLUDED
+
+#include <deque>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** Velocities in ticks per second. */
+struct CubeVelocityStats
+{
+  bool active;                ///< a commanded velocity is being tracked
+  double commanded;
+  double measured;            ///< over the window, 0 until it is full
+  double error;               ///< measured - commanded
+  bool locked;                ///< stayed within the tolerance for a window since the reset
+  double max_error;           ///< largest |error| since locked
+  double rms_error;           ///< since locked
+  unsigned long samples;      ///< windows judged since locked
+};
+
+class CubeVelocityMonitor
+{
+public:
+  /** window in seconds, tolerance in ticks/s. */
+  CubeVelocityMonitor(double window = 0.2, double tolerance = 0);
+
+  void setWindow(double window);
+  void setTolerance(double tolerance);
+  double tolerance() const;
+
+  /** Starts tracking a new commanded velocity, forgetting the lock. */
+  void reset(double commanded);
+
+  /** Stops tracking; samples are ignored until the next reset. */
+  void stop();
+
+  /** Adds a position sample taken at stamp_us. */
+  void add(long long stamp_us, short int position);
+
+  CubeVelocityStats stats() const;
+
+private:
+  struct Sample
+  {
+    long long stamp_us;
+    short int reading;        ///< as read, to take the next difference from
+    double position;          ///< unwrapped, ticks
+  };
+
+  long window_us_;
+  double tolerance_;
+  std::deque<Sample> samples_;
+  CubeVelocityStats stats_;
+  double square_sum_;
+  long long within_since_us_;   ///< within the tolerance since, while not locked
+  mutable boost::mutex mutex_;
+};
+
+#endif
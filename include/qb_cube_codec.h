@@ -0,0 +1,263 @@
+/**
+ *  \file       qb_cube_codec.h
+ *
+ *  \brief      Compile-time description of the QB Move packages.
+ *
+ *  \details
+ *
+ *  Each command is described once as a Message type giving its request and
+ *  reply layouts. encode() and decode() are generated from it: frame sizes,
+ *  offsets and the checksum loop are constants, fields are written big-endian
+ *  with shifts whatever the host byte order (and read with a byte swap on
+ *  little-endian GCC hosts), and nothing is zeroed or copied through an
+ *  intermediate buffer.
+ *
+ *  \code
+
+    char frame[qbcodec::GetMeasurements::FRAME_SIZE];
+    qbcodec::GetMeasurements::Reply reply;
+
+    qbcodec::encode<qbcodec::GetMeasurements>(frame, id, qbcodec::Empty());
+    // ... send frame, read package_in ...
+    if (qbcodec::decode<qbcodec::GetMeasurements>(package_in, size, reply))
+        position = reply.values[0];
+
+ *  \endcode
+**/
+
+#ifndef QB_CUBE_CODEC_H_INCLUDED
+#define QB_CUBE_CODEC_H_INCLUDED
+
+#include <commands.h>
+#include <definitions.h>
+
+#include <string.h>
+
+namespace qbcodec
+{
+
+//==============================================================================
+//                                                                    primitives
+//==============================================================================
+
+inline void putShort(char *out, short int value)
+{
+  out[0] = (char)((unsigned short int)value >> 8);
+  out[1] = (char)value;
+}
+
+inline short int getShort(const char *in)
+{
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  // one load and a swap, which vectorizes into a single shuffle where the
+  // shifts below take three operations
+  unsigned short int value;
+  memcpy(&value, in, sizeof(value));
+  return (short int)__builtin_bswap16(value);
+#else
+  return (short int)(((unsigned char)in[0] << 8) | (unsigned char)in[1]);
+#endif
+}
+
+/** Copies num values of size bytes each, reversing the bytes of every value
+ *  (host order to wire order and back on little-endian hosts, as the
+ *  parameter commands expect). */
+inline void putReversed(char *out, const void *values, int num, int size)
+{
+  const char *in = (const char *)values;
+  for (int h = 0; h < num; ++h)
+    for (int i = 0; i < size; ++i)
+      out[h * size + i] = in[h * size + size - i - 1];
+}
+
+/** XOR of N bytes, unrolled at compile time. */
+template <int N>
+struct Checksum
+{
+  static char of(const char *data) { return data[N - 1] ^ Checksum<N - 1>::of(data); }
+};
+
+template <>
+struct Checksum<0>
+{
+  static char of(const char *) { return 0; }
+};
+
+/** Largest payload after the command: the size byte also counts the command
+ *  and the checksum. */
+enum { MAX_PAYLOAD = 255 - 2 };
+
+/** Writes the ':' ':' id size command header of a package with a payload of
+ *  payload_size bytes after the command. Returns false, writing nothing, if
+ *  the size byte cannot hold it. */
+inline bool putHeader(char *frame, int id, unsigned char command, int payload_size)
+{
+  if (payload_size < 0 || payload_size > MAX_PAYLOAD)
+    return false;
+
+  frame[0] = ':';
+  frame[1] = ':';
+  frame[2] = (char)(unsigned char)id;
+  frame[3] = (char)(payload_size + 2);
+  frame[4] = (char)command;
+  return true;
+}
+
+//==============================================================================
+//                                                                        fields
+//==============================================================================
+
+/** No data. */
+struct Empty
+{
+  enum { SIZE = 0 };
+  static void put(char *, const Empty &) {}
+  static void get(const char *, Empty &) {}
+};
+
+/** A single byte. */
+struct Byte
+{
+  enum { SIZE = 1 };
+  unsigned char value;
+
+  Byte(unsigned char v = 0) : value(v) {}
+  static void put(char *out, const Byte &field) { out[0] = (char)field.value; }
+  static void get(const char *in, Byte &field) { field.value = (unsigned char)in[0]; }
+};
+
+/** N big-endian 16 bit values. */
+template <int N>
+struct Shorts
+{
+  enum { SIZE = 2 * N };
+  short int values[N];
+
+  static void put(char *out, const Shorts &field)
+  {
+    for (int i = 0; i < N; ++i)
+      putShort(out + 2 * i, field.values[i]);
+  }
+
+  static void get(const char *in, Shorts &field)
+  {
+    for (int i = 0; i < N; ++i)
+      field.values[i] = getShort(in + 2 * i);
+  }
+};
+
+/** A 16 bit selector followed by a page byte, as CMD_GET_INFO takes. */
+struct InfoPage
+{
+  enum { SIZE = 3 };
+  unsigned short int type;
+  unsigned char page;
+
+  InfoPage(unsigned short int t = 0, unsigned char p = 0) : type(t), page(p) {}
+  static void put(char *out, const InfoPage &field)
+  {
+    putShort(out, (short int)field.type);
+    out[2] = (char)field.page;
+  }
+};
+
+//==============================================================================
+//                                                                      messages
+//==============================================================================
+
+/** A command with its request and reply payloads, both excluding the command
+ *  byte and the checksum. Commands answered with an acknowledge whose
+ *  content is not used take Empty as reply. */
+template <unsigned char Command, class RequestT, class ReplyT, bool HasReply = true>
+struct Message
+{
+  typedef RequestT Request;
+  typedef ReplyT Reply;
+
+  enum
+  {
+    COMMAND = Command,
+    HAS_REPLY = HasReply,
+    FRAME_SIZE = 6 + RequestT::SIZE,        ///< request bytes on the wire
+    REPLY_SIZE = 2 + ReplyT::SIZE           ///< reply payload, as RS485read returns it
+  };
+
+  // a request too big for the size byte does not compile
+  typedef char request_must_fit[(int)RequestT::SIZE <= (int)MAX_PAYLOAD ? 1 : -1];
+};
+
+typedef Message<CMD_PING, Empty, Empty>                                Ping;
+typedef Message<CMD_ACTIVATE, Byte, Empty, false>                      Activate;
+typedef Message<CMD_GET_ACTIVATE, Empty, Byte>                         GetActivate;
+typedef Message<CMD_SET_INPUTS, Shorts<NUM_OF_MOTORS>, Empty, false>   SetInputs;
+typedef Message<CMD_GET_INPUTS, Empty, Shorts<NUM_OF_MOTORS> >         GetInputs;
+typedef Message<CMD_GET_MEASUREMENTS, Empty, Shorts<NUM_OF_SENSORS> >  GetMeasurements;
+typedef Message<CMD_GET_CURRENTS, Empty, Shorts<NUM_OF_MOTORS> >       GetCurrents;
+typedef Message<CMD_GET_CURR_AND_MEAS, Empty,
+                Shorts<NUM_OF_MOTORS + NUM_OF_SENSORS> >               GetCurrAndMeas;
+typedef Message<CMD_GET_INFO, InfoPage, Empty>                         GetInfo;
+typedef Message<CMD_STORE_PARAMS, Empty, Empty>                        StoreParams;
+typedef Message<CMD_STORE_DEFAULT_PARAMS, Empty, Empty>                StoreDefaultParams;
+typedef Message<CMD_RESTORE_PARAMS, Empty, Empty>                      RestoreParams;
+typedef Message<CMD_INIT_MEM, Empty, Empty>                            InitMem;
+typedef Message<CMD_BOOTLOADER, Empty, Empty>                          Bootloader;
+
+//==============================================================================
+//                                                                 encode/decode
+//==============================================================================
+
+/** Writes the request package of M for device id into frame, which must hold
+ *  M::FRAME_SIZE bytes. Returns M::FRAME_SIZE. */
+template <class M>
+inline int encode(char *frame, int id, const typename M::Request &request)
+{
+  putHeader(frame, id, M::COMMAND, M::Request::SIZE);
+  M::Request::put(frame + 5, request);
+  frame[5 + M::Request::SIZE] = Checksum<1 + M::Request::SIZE>::of(frame + 4);
+  return M::FRAME_SIZE;
+}
+
+/** Request package of a command without arguments, as constant data. Only
+ *  the id byte (ID_OFFSET) differs between devices: the checksum covers the
+ *  command alone, so the frame can be sent from the table with the id
+ *  spliced in (writev) or copied and patched with a single store. */
+template <class M>
+struct FixedFrame
+{
+  enum { SIZE = M::FRAME_SIZE, ID_OFFSET = 2 };
+  static const char bytes[6];
+
+  // only messages whose request is Empty have a fixed frame
+  typedef char request_must_be_empty[M::Request::SIZE == 0 ? 1 : -1];
+};
+
+template <class M>
+const char FixedFrame<M>::bytes[6] =
+{
+  ':', ':', 0, 2, (char)M::COMMAND, (char)M::COMMAND
+};
+
+/** Copies the fixed frame of M and patches in the id. */
+template <class M>
+inline int encodeFixed(char *frame, int id)
+{
+  for (int i = 0; i < FixedFrame<M>::SIZE; ++i)
+    frame[i] = FixedFrame<M>::bytes[i];
+  frame[FixedFrame<M>::ID_OFFSET] = (char)(unsigned char)id;
+  return FixedFrame<M>::SIZE;
+}
+
+/** Reads the reply of M from a package as returned by RS485read (command,
+ *  data, checksum). Returns false if the package is too short to hold it. */
+template <class M>
+inline bool decode(const char *package, int package_size, typename M::Reply &reply)
+{
+  if (package_size < (int)M::REPLY_SIZE)
+    return false;
+  M::Reply::get(package + 1, reply);
+  return true;
+}
+
+} // namespace qbcodec
+
+#endif
@@ -62,11 +62,76 @@
 //                                                              structures/enums
 //==============================================================================
 
+#define RX_BUFFER_SIZE 1024        ///< Read-ahead ring size, a power of 2
+#define DEFAULT_BAUD_RATE 460800    ///< Baud rate of the QB cube firmware
+
+#define COMM_HIST_BUCKETS 240    ///< Latency buckets, 8 per power of 2 us
+#define COMM_STATS_COMMANDS 19   ///< Histogram slots, see commStatsLatency
+
+/** Latency distribution of a command type, in log-linear buckets: values
+ *  below 8 us are exact, above that each power of 2 is split into 8 buckets,
+ *  so a bucket is at most 12.5% wide. */
+typedef struct comm_histogram comm_histogram;
+
+struct comm_histogram
+{
+    unsigned long count;                        ///< Transactions recorded
+    unsigned long sum_us;                       ///< Their total duration
+    unsigned int buckets[COMM_HIST_BUCKETS];
+};
+
+/** Instrumentation kept by the library on every transaction. The bus owner
+ *  is the only writer, other threads read it through commStatsSnapshot. */
+typedef struct comm_stats comm_stats;
+
+struct comm_stats
+{
+    unsigned long timeouts;             ///< Replies that did not arrive in time
+    unsigned long id_mismatches;        ///< Packages skipped as from another id
+    unsigned long checksum_failures;    ///< Packages rejected by their checksum
+    unsigned long bytes_drained;        ///< Bytes dropped as stale or garbled
+    unsigned long resyncs;              ///< Times the parser had to realign
+    unsigned long syscalls;             ///< poll, read and write calls
+
+    /** Request to reply time per command, or the write time for commands
+     *  without a reply. */
+    comm_histogram latency[COMM_STATS_COMMANDS];
+};
+
 typedef struct comm_settings comm_settings;
 
 struct comm_settings
 {
     HANDLE file_handle;
+    int baud_rate;                  ///< Set by openRS485
+
+    unsigned char rx_buffer[RX_BUFFER_SIZE];    ///< Read-ahead ring buffer
+    unsigned int rx_head;                       ///< Next byte to parse
+    unsigned int rx_tail;                       ///< Next byte to fill
+    char rx_skipping;                           ///< Parser is out of sync
+
+    comm_stats stats;               ///< Running totals, see commStatsSnapshot
+    comm_stats stats_baseline;      ///< Totals at the last commStatsReset
+    unsigned int stats_generation;  ///< Odd while commStatsReset rewrites the baseline
+    int stats_command;              ///< Command being timed, -1 if none
+    long long stats_start;          ///< When it was sent, in us
+};
+
+#define COMM_PAYLOAD_SIZE 64        ///< Max request data size in a transaction
+#define COMM_PACKAGE_SIZE 256       ///< Max reply package size
+
+/** A request and its reply, as exchanged by commPipeline. */
+typedef struct comm_transaction comm_transaction;
+
+struct comm_transaction
+{
+    int id;                                 ///< Device's id number
+    unsigned char command;                  ///< One of qbmove_command
+    char payload[COMM_PAYLOAD_SIZE];        ///< Request data after the command
+    int payload_size;                       ///< Request data size
+    char package_in[COMM_PACKAGE_SIZE];     ///< Reply: command, data, checksum
+    int package_in_size;                    ///< Reply size, -1 if unanswered
+    long latency_us;                        ///< Round trip time, -1 if unanswered
 };
 
 
@@ -111,6 +176,8 @@ int RS485listPorts( char list_of_ports[10][255] );
 /** This function is used to open a serial port for using with the QB Move.
  *
  *  \param port_s The string to the serial port path.
+ *  \param baud_rate The line speed in bits per second. Rates without a
+ *                   termios constant are set through termios2 on Linux.
  *
  *  \return Returns the file descriptor associated to the serial port.
  *
@@ -128,7 +195,8 @@ int RS485listPorts( char list_of_ports[10][255] );
  *  \endcode
 **/
 
-void openRS485( comm_settings *comm_settings_t, const char *port_s );
+void openRS485( comm_settings *comm_settings_t, const char *port_s,
+                int baud_rate = DEFAULT_BAUD_RATE );
 
 //===============================================================     closeRS485
 
@@ -151,6 +219,121 @@ void openRS485( comm_settings *comm_settings_t, const char *port_s );
 
 void closeRS485( comm_settings *comm_settings_t );
 
+//========================================================     commStatsSnapshot
+
+/** This function copies the statistics gathered since the port was opened,
+ *  or since the last commStatsReset. It only reads the counters, so any
+ *  thread may call it while the bus owner keeps running transactions.
+ *
+ *  \param  comm_settings_t     A _comm_settings_ structure containing info about the
+ *                              communication settings.
+ *
+ *  \param  snapshot            Where the statistics are copied.
+ *
+ *  \par Example
+ *  \code
+
+    comm_stats snapshot;
+    const comm_histogram *latency;
+
+    commStatsSnapshot(&comm_settings_t, &snapshot);
+    latency = commStatsLatency(&snapshot, CMD_GET_MEASUREMENTS);
+    printf("%lu timeouts, p99 %.0f us\n", snapshot.timeouts,
+           commStatsPercentile(latency, 0.99));
+    commStatsReset(&comm_settings_t);
+
+ *  \endcode
+**/
+
+void commStatsSnapshot( comm_settings *comm_settings_t, comm_stats *snapshot );
+
+//===========================================================     commStatsReset
+
+/** This function restarts the statistics from zero. Like commStatsSnapshot it
+ *  does not touch the counters the bus owner writes, only the baseline they
+ *  are reported against; any thread may call it, and a snapshot taken
+ *  meanwhile reports against either the old baseline or the new one.
+ *
+ *  \param  comm_settings_t     A _comm_settings_ structure containing info about the
+ *                              communication settings.
+**/
+
+void commStatsReset( comm_settings *comm_settings_t );
+
+//=============================================================     commStatsAdd
+
+/** This function adds a snapshot to a running total, counters and histograms
+ *  alike, to report several ports together.
+ *
+ *  \param  total       The total, zeroed before the first call.
+ *  \param  stats       A snapshot taken with commStatsSnapshot.
+**/
+
+void commStatsAdd( comm_stats *total, const comm_stats *stats );
+
+//=========================================================     commStatsLatency
+
+/** This function returns the latency histogram of a command type.
+ *
+ *  \param  stats       A snapshot taken with commStatsSnapshot.
+ *  \param  command     One of qbmove_command.
+ *
+ *  \return The histogram, commands outside qbmove_command share a slot.
+**/
+
+const comm_histogram *commStatsLatency( const comm_stats *stats,
+                                        unsigned char command );
+
+//======================================================     commStatsPercentile
+
+/** This function estimates a latency percentile from a histogram.
+ *
+ *  \param  histogram   A histogram from commStatsLatency.
+ *  \param  fraction    The percentile, between 0 and 1.
+ *
+ *  \return The latency in microseconds, within the bucket width, 0 if the
+ *          histogram is empty.
+**/
+
+float commStatsPercentile( const comm_histogram *histogram, float fraction );
+
+//=========================================================     commHistogramAdd
+
+/** This function records a duration in a histogram the way the library
+ *  records its transactions, for callers timing things of their own (such as
+ *  the time requests wait in a queue). The counters are updated atomically,
+ *  so another thread may take a snapshot meanwhile.
+ *
+ *  \param  histogram   The histogram, zeroed before the first call.
+ *  \param  usec        The duration in microseconds.
+**/
+
+void commHistogramAdd( comm_histogram *histogram, long long usec );
+
+//====================================================     commHistogramSnapshot
+
+/** This function copies a histogram being written by another thread,
+ *  minus a baseline copied earlier, as commStatsSnapshot does.
+ *
+ *  \param  histogram   The histogram written with commHistogramAdd.
+ *  \param  base        The baseline to subtract, or NULL.
+ *  \param  snapshot    Where the difference is copied.
+**/
+
+void commHistogramSnapshot( const comm_histogram *histogram, const comm_histogram *base,
+                            comm_histogram *snapshot );
+
+//========================================================     commHistogramMerge
+
+/** This function adds the counts of one histogram into another, to report
+ *  several as one.
+ *
+ *  \param  total       The histogram added into.
+ *  \param  histogram   The histogram added.
+**/
+
+void commHistogramMerge( comm_histogram *total, const comm_histogram *histogram );
+
 /** \} */
 
 
@@ -195,10 +378,157 @@ int RS485read(  comm_settings *comm_settings_t,
                 int id, 
                 char *package );
 
+//=============================================================     commPipeline
+
+/** This function sends several requests on the bus without waiting for each
+ *  reply before the next write. Up to window requests are kept in flight and
+ *  replies are matched back to them by device id and command byte, so several
+ *  cubes can be polled in one cycle without idling on every turnaround.
+ *  Requests that are not answered in time get a package_in_size of -1, as
+ *  do requests with a payload_size outside 0 to COMM_PAYLOAD_SIZE, which are
+ *  not sent.
+ *
+ *  With window equal to 1 this is the usual one-request-at-a-time exchange.
+ *
+ *  \param  comm_settings_t     A _comm_settings_ structure containing info about the
+ *                              communication settings.
+ *
+ *  \param  transactions    Requests to send (id, command, payload) and their replies.
+ *  \param  num_of_transactions Size of the transactions array.
+ *  \param  window          Maximum number of requests in flight.
+ *
+ *  \return Returns the number of answered requests.
+ *
+ *  \par Example
+ *  \code
+
+    comm_transaction t[2];
+
+    t[0].id = 1; t[0].command = CMD_GET_MEASUREMENTS; t[0].payload_size = 0;
+    t[1].id = 2; t[1].command = CMD_GET_MEASUREMENTS; t[1].payload_size = 0;
+
+    if (commPipeline(&comm_settings_t, t, 2, 2) == 2)
+        puts("Both cubes answered.");
+
+ *  \endcode
+**/
+
+int commPipeline(   comm_settings *comm_settings_t,
+                    comm_transaction *transactions,
+                    int num_of_transactions,
+                    int window );
+
+//==============================================   commPipelineGetMeasurements
+
+/** This function gets measurements from several QB Moves in one pipelined
+ *  cycle (see commPipeline).
+ *
+ *  \param  ids             Devices' id numbers.
+ *  \param  num_of_devices  Size of the ids array.
+ *  \param  measurements    Measurements, one row per device.
+ *  \param  status          0 if the device answered, -1 otherwise.
+ *  \param  window          Maximum number of requests in flight.
+ *
+ *  \return Returns the number of devices that answered.
+**/
+
+int commPipelineGetMeasurements(    comm_settings *comm_settings_t,
+                                    const int *ids,
+                                    int num_of_devices,
+                                    short int measurements[][NUM_OF_SENSORS],
+                                    int *status,
+                                    int window );
+
 //=========================================================     RS485ListDevices
 
+/** This function scans the bus for QB Moves, pinging every id from 1 to 254
+ *  one at a time (see RS485DiscoverDevices).
+ *
+ *  \param  comm_settings_t     A _comm_settings_ structure containing info about the
+ *                              communication settings.
+ *
+ *  \param  list_of_ids     The ids found are stored here.
+ *
+ *  \return Returns the number of devices found.
+**/
+
 int RS485ListDevices( comm_settings *comm_settings_t, char list_of_ids[255] );
 
+//=====================================================     RS485DiscoverDevices
+
+/** This function scans the bus for QB Moves. Pings are sent in windows of
+ *  back-to-back requests and each window waits for replies only as long as
+ *  the round trip times measured so far justify, instead of a fixed sleep
+ *  per id. Known ids, if any, are probed first and listed first.
+ *
+ *  A window larger than 1 lets a cube answer while the following requests
+ *  are still being sent: use it on full-duplex links or with the emulator.
+ *  Ids whose window saw garbled traffic are pinged again one at a time.
+ *
+ *  \param  comm_settings_t     A _comm_settings_ structure containing info about the
+ *                              communication settings.
+ *
+ *  \param  list_of_ids     The ids found are stored here.
+ *  \param  known_ids       Ids to probe first, may be NULL.
+ *  \param  num_of_known    Size of the known_ids array.
+ *  \param  window          Number of pings sent back to back.
+ *
+ *  \return Returns the number of devices found.
+ *
+ *  \par Example
+ *  \code
+
+    char list_of_ids[255];
+    char last_seen[1] = {1};
+    int  i, num_of_devices;
+
+    num_of_devices = RS485DiscoverDevices(&comm_settings_t, list_of_ids,
+                                          last_seen, 1, 1);
+    for(i = 0; i < num_of_devices; ++i)
+        printf("Device %d\n", list_of_ids[i]);
+
+ *  \endcode
+**/
+
+int RS485DiscoverDevices(   comm_settings *comm_settings_t,
+                            char list_of_ids[255],
+                            const char *known_ids,
+                            int num_of_known,
+                            int window );
+
+//====================================================     RS485ProbeThroughput
+
+/** This function measures what the line actually delivers at the current
+ *  baud rate, by running back to back measurement round trips with a device.
+ *
+ *  \param  comm_settings_t     A _comm_settings_ structure containing info about the
+ *                              communication settings.
+ *
+ *  \param  id                  The device's id number.
+ *  \param  num_of_round_trips  Number of requests to send.
+ *  \param  bytes_per_second    Request and reply bytes moved per second.
+ *  \param  round_trips_per_second  Answered requests per second.
+ *
+ *  \return Returns the number of answered requests, -1 if none was.
+ *
+ *  \par Example
+ *  \code
+
+    float bytes_per_second, round_trips_per_second;
+
+    openRS485(&comm_settings_t, "/dev/ttyUSB0", 1000000);
+    RS485ProbeThroughput(&comm_settings_t, 1, 1000,
+                         &bytes_per_second, &round_trips_per_second);
+
+ *  \endcode
+**/
+
+int RS485ProbeThroughput(   comm_settings *comm_settings_t,
+                            int id,
+                            int num_of_round_trips,
+                            float *bytes_per_second,
+                            float *round_trips_per_second );
+
 //=============================================================     RS485GetInfo
 
 /** This function is used to ping the serial port for a QB Move and 
@@ -211,6 +541,9 @@ int RS485ListDevices( comm_settings *comm_settings_t, char list_of_ids[255] );
  *  \param  buffer          Buffer that stores a string with information about 
  *                          the device. BUFFER SIZE MUST BE AT LEAST 500.
  *
+ *  \return     The length of the string, or -1 if the device did not answer.
+ *              It returns as soon as the string is complete; the wait is
+ *              bounded by a 500 ms safety deadline.
  *
  *  \par Example
  *  \code
@@ -226,7 +559,7 @@ int RS485ListDevices( comm_settings *comm_settings_t, char list_of_ids[255] );
  *  \endcode 
 **/
 
-void RS485GetInfo( comm_settings *comm_settings_t, char *buffer );
+int RS485GetInfo( comm_settings *comm_settings_t, char *buffer );
 
 //================================================================     commPing
 
@@ -323,6 +656,90 @@ void commSetInputs( comm_settings *comm_settings_t,
                     int id, 
                     short int inputs[2] );
 
+//=======================================================     commSetInputsBatch
+
+/** This function sends reference inputs to several QB Moves at once: all the
+ *  frames are built into one buffer and go out with a single write, back to
+ *  back on the line.
+ *
+ *  \param  comm_settings_t     A _comm_settings_ structure containing info about the
+ *                              communication settings.
+ *
+ *  \param  num_of_devices  Number of (id, inputs) pairs, at most 255.
+ *  \param  ids             The devices' id numbers.
+ *  \param  inputs          Input references, one pair per device.
+ *  \param  wire_time_us    If not NULL, waits until the batch has left the
+ *                          port (tcdrain) and stores the time from the start
+ *                          of the write, in microseconds.
+ *
+ *  \return Returns the number of bytes written, -1 on error.
+ *
+ *  \par Example
+ *  \code
+
+    int       ids[2] = {1, 2};
+    short int inputs[2][NUM_OF_MOTORS] = {{1000, 1000}, {-500, -500}};
+    long      wire_time_us;
+
+    commSetInputsBatch(&comm_settings_t, 2, ids, inputs, &wire_time_us);
+
+ *  \endcode
+**/
+
+int commSetInputsBatch( comm_settings *comm_settings_t,
+                        int num_of_devices,
+                        const int *ids,
+                        short int inputs[][NUM_OF_MOTORS],
+                        long *wire_time_us );
+
+//========================================================     commSetInputsSync
+
+/** This function sets the inputs of several QB Moves with as little skew
+ *  between them as possible. When every device gets the same inputs and the
+ *  list covers the whole bus, a single frame is sent to BROADCAST_ID and all
+ *  devices latch it together; otherwise the frames go out back to back with
+ *  commSetInputsBatch().
+ *
+ *  \param  comm_settings_t     A _comm_settings_ structure containing info about the
+ *                              communication settings.
+ *
+ *  \param  num_of_devices  Number of (id, inputs) pairs, at most 255.
+ *  \param  ids             The devices' id numbers.
+ *  \param  inputs          Input references, one pair per device.
+ *  \param  whole_bus       Non-zero if ids lists every device on the line, so
+ *                          that a broadcast reaches nobody else.
+ *  \param  skew_us         If not NULL, stores an estimated upper bound on the
+ *                          time between the first and the last device
+ *                          receiving its frame, in microseconds (0 for a
+ *                          broadcast). The frames are not timed one by one:
+ *                          the bound comes from the time the batch took to
+ *                          leave the port, which it waits for, and is never
+ *                          below the spacing the baud rate gives.
+ *
+ *  \return Returns 1 if the inputs were broadcast, 0 if they were sent as a
+ *          batch, 2 if they were sent as a batch but the port took too long
+ *          to drain for the bound to mean anything (skew_us then holds just
+ *          the nominal spacing), -1 on error.
+ *
+ *  \par Example
+ *  \code
+
+    int       ids[2] = {1, 2};
+    short int inputs[2][NUM_OF_MOTORS] = {{1000, 1000}, {1000, 1000}};
+    long      skew_us;
+
+    commSetInputsSync(&comm_settings_t, 2, ids, inputs, 1, &skew_us);
+
+ *  \endcode
+**/
+
+int commSetInputsSync( comm_settings *comm_settings_t,
+                       int num_of_devices,
+                       const int *ids,
+                       short int inputs[][NUM_OF_MOTORS],
+                       int whole_bus,
+                       long *skew_us );
+
 //============================================================     commGetInputs
 
 /** This function gets input references from a QB Move connected to the serial 
@@ -534,6 +951,9 @@ int commGetInfo(    comm_settings *comm_settings_t,
  *  \param  values              An array with the parameter values.
  *  \param  num_of_values       The size of the values array. 
  *
+ *  \return Returns 0 on success, -1 on error or if the values take more than
+ *          the 253 bytes a package can carry.
+ *
  *  \par Example
  *  \code
 
@@ -0,0 +1,577 @@
+#include "cube_bus.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+#define BUS_QUEUE_CAPACITY 128
+#define BUS_STACK_PREFAULT (64 * 1024)
+#define BUS_BUDGET_WINDOW_US 100000     ///< span a class can save up or owe bus time over
+
+// sequence numbers wrap, compare them by difference
+static bool isAfter(unsigned int a, unsigned int b)
+{
+  return (int)(a - b) > 0;
+}
+
+static long long monotonicUsec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+CubeBus::CubeBus() :
+  pool_(BUS_QUEUE_CAPACITY),
+  running_(false),
+  producers_(0),
+  sleeping_(false),
+  coalesce_(true),
+  sequence_(0),
+  broadcast_written_(0),
+  setpoints_sent_(0),
+  setpoints_coalesced_(0),
+  refilled_us_(0),
+  baseline_sequence_(0)
+{
+  memset(&comm_, 0, sizeof(comm_));
+  comm_.file_handle = INVALID_HANDLE_VALUE;
+  comm_.stats_command = -1;
+
+  for (int i = 0; i < 256; ++i)
+  {
+    setpoints_[i].latest = 0;
+    setpoints_[i].written = 0;
+    sent_[i] = 0;
+  }
+
+  for (int i = 0; i < BUS_QUEUE_CAPACITY; ++i)
+    pool_.push(new Request);
+
+  static const double default_budgets[BUS_CLASSES] = { 1.0, 0.8, 0.2 };
+  for (int i = 0; i < BUS_CLASSES; ++i)
+  {
+    queues_[i].reset(new boost::lockfree::queue<Request*>(BUS_QUEUE_CAPACITY));
+    budgets_[i] = default_budgets[i];
+    tokens_us_[i] = default_budgets[i] * BUS_BUDGET_WINDOW_US;
+    busy_us_[i] = 0;
+  }
+  memset(queue_delay_, 0, sizeof(queue_delay_));
+  memset(&baseline_, 0, sizeof(baseline_));
+}
+
+CubeBus::~CubeBus()
+{
+  close();
+
+  Request *request;
+  while (pool_.pop(request))
+    delete request;
+}
+
+bool CubeBus::open(const std::string &port, int baud_rate,
+                   const CubeBusRealtime &realtime)
+{
+  if (running_)
+    return true;
+
+  openRS485(&comm_, port.c_str(), baud_rate);
+  if (comm_.file_handle == INVALID_HANDLE_VALUE)
+    return false;
+
+  realtime_ = realtime;
+  realtime_error_.clear();
+
+  running_ = true;
+  thread_ = boost::thread(&CubeBus::run, this);
+  applyRealtime();
+  return true;
+}
+
+void CubeBus::applyRealtime()
+{
+#if defined(__linux__)
+  pthread_t handle = thread_.native_handle();
+
+  if (realtime_.lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE))
+    realtime_error_ += std::string("mlockall: ") + strerror(errno) + "; ";
+
+  if (realtime_.cpu >= 0)
+  {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(realtime_.cpu, &cpus);
+    int ret = pthread_setaffinity_np(handle, sizeof(cpus), &cpus);
+    if (ret)
+      realtime_error_ += std::string("affinity: ") + strerror(ret) + "; ";
+  }
+
+  if (realtime_.priority > 0)
+  {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = realtime_.priority;
+    int ret = pthread_setschedparam(handle, SCHED_FIFO, &param);
+    if (ret)
+      realtime_error_ += std::string("SCHED_FIFO: ") + strerror(ret) + "; ";
+  }
+#else
+  if (realtime_.lock_memory || realtime_.cpu >= 0 || realtime_.priority > 0)
+    realtime_error_ = "real-time profile only supported on Linux; ";
+#endif
+
+  if (!realtime_error_.empty())
+    realtime_error_.erase(realtime_error_.size() - 2);
+}
+
+void CubeBus::close()
+{
+  if (!running_)
+    return;
+
+  {
+    boost::lock_guard<boost::mutex> lock(wake_mutex_);
+    running_ = false;
+  }
+  wake_cond_.notify_all();
+  thread_.join();
+
+  // a submit() that saw running_ still set finishes its push before leaving;
+  // once none is left, every later one sees running_ false and fails itself
+  while (producers_ != 0)
+    boost::this_thread::yield();
+
+  // fail whatever was queued after the thread left
+  Request *request;
+  for (int i = 0; i < BUS_CLASSES; ++i)
+  {
+    while (queues_[i]->pop(request))
+    {
+      CubeReply reply;
+      memset(&reply, 0, sizeof(reply));
+      reply.status = -1;
+      request->promise.set_value(reply);
+      release(request);
+    }
+  }
+
+  closeRS485(&comm_);
+  comm_.file_handle = INVALID_HANDLE_VALUE;
+}
+
+void CubeBus::resetStats()
+{
+  commStatsReset(&comm_);
+
+  // like the library stats, only the baseline is written, under a sequence
+  // that is odd meanwhile and turns away a second reset
+  unsigned int sequence;
+  do
+    sequence = baseline_sequence_.load(boost::memory_order_relaxed) & ~1u;
+  while (!baseline_sequence_.compare_exchange_weak(sequence, sequence + 1,
+                                                   boost::memory_order_relaxed));
+  boost::atomic_thread_fence(boost::memory_order_release);
+
+  baseline_.setpoints_sent = setpoints_sent_;
+  baseline_.setpoints_coalesced = setpoints_coalesced_;
+  for (int i = 0; i < BUS_CLASSES; ++i)
+  {
+    baseline_.busy_us[i] = busy_us_[i];
+    commHistogramSnapshot(&queue_delay_[i], NULL, &baseline_.queue_delay[i]);
+  }
+  baseline_sequence_.store(sequence + 2, boost::memory_order_release);
+}
+
+CubeBusCounters CubeBus::counters() const
+{
+  CubeBusCounters baseline;
+  unsigned int before, after;
+  do
+  {
+    before = baseline_sequence_.load(boost::memory_order_acquire);
+    baseline = baseline_;
+    boost::atomic_thread_fence(boost::memory_order_acquire);
+    after = baseline_sequence_.load(boost::memory_order_relaxed);
+  }
+  while ((before & 1) || before != after);
+
+  CubeBusCounters counters;
+  counters.setpoints_sent = setpoints_sent_ - baseline.setpoints_sent;
+  counters.setpoints_coalesced = setpoints_coalesced_ - baseline.setpoints_coalesced;
+  for (int i = 0; i < BUS_CLASSES; ++i)
+  {
+    counters.busy_us[i] = busy_us_[i] - baseline.busy_us[i];
+    commHistogramSnapshot(&queue_delay_[i], &baseline.queue_delay[i], &counters.queue_delay[i]);
+  }
+  return counters;
+}
+
+void CubeBus::setBudget(CubeBusClass traffic_class, double share)
+{
+  if (traffic_class >= 0 && traffic_class < BUS_CLASSES)
+    budgets_[traffic_class] = share > 0 ? share : 0;
+}
+
+void CubeBus::markWritten(int id)
+{
+  unsigned int sequence = ++sequence_;
+  if (id == BROADCAST_ID)
+    broadcast_written_ = sequence;
+  else
+    setpoints_[id & 0xFF].written = sequence;
+}
+
+CubeFuture CubeBus::ping(int id)
+{
+  Request *request = allocate();
+  request->type = REQ_PING;
+  request->id = id;
+  return submit(request);
+}
+
+CubeFuture CubeBus::activate(int id, bool activate)
+{
+  Request *request = allocate();
+  request->type = REQ_ACTIVATE;
+  request->id = id;
+  request->inputs[0] = activate;
+  return submit(request);
+}
+
+CubeFuture CubeBus::setInputs(int id, short int inputs[NUM_OF_MOTORS])
+{
+  Request *request = allocate();
+  request->type = REQ_SET_INPUTS;
+  request->id = id;
+  memcpy(request->inputs, inputs, sizeof(request->inputs));
+  request->sequence = 0;
+
+  if (id == BROADCAST_ID || !coalesce_)
+    markWritten(id);
+  else
+  {
+    // publish as the newest setpoint unless a later one got there first
+    unsigned int sequence = ++sequence_;
+    boost::uint64_t packed = (boost::uint64_t)sequence << 32 |
+                             (boost::uint64_t)(unsigned short int)inputs[0] << 16 |
+                             (unsigned short int)inputs[1];
+    Setpoint &setpoint = setpoints_[id & 0xFF];
+    boost::uint64_t latest = setpoint.latest.load(boost::memory_order_relaxed);
+    while (isAfter(sequence, (unsigned int)(latest >> 32)) &&
+           !setpoint.latest.compare_exchange_weak(latest, packed, boost::memory_order_release,
+                                                  boost::memory_order_relaxed))
+      ;
+    request->sequence = sequence;
+  }
+  return submit(request);
+}
+
+CubeFuture CubeBus::setInputsBatch(int num_of_devices, const int *ids,
+                                   short int inputs[][NUM_OF_MOTORS])
+{
+  Request *request = allocate();
+  request->type = REQ_SET_INPUTS_BATCH;
+  fillBatch(request, num_of_devices, ids, inputs);
+  for (int i = 0; i < request->num_of_devices; ++i)
+    markWritten(ids[i]);
+  return submit(request);
+}
+
+CubeFuture CubeBus::setInputsSync(int num_of_devices, const int *ids,
+                                  short int inputs[][NUM_OF_MOTORS], bool whole_bus)
+{
+  Request *request = allocate();
+  request->type = REQ_SET_INPUTS_SYNC;
+  request->whole_bus = whole_bus;
+  fillBatch(request, num_of_devices, ids, inputs);
+  for (int i = 0; i < request->num_of_devices; ++i)
+    markWritten(ids[i]);
+  return submit(request);
+}
+
+void CubeBus::fillBatch(Request *request, int num_of_devices, const int *ids,
+                        short int inputs[][NUM_OF_MOTORS])
+{
+  request->id = BROADCAST_ID;
+  request->num_of_devices = num_of_devices;
+
+  if (num_of_devices > 0 && num_of_devices <= BUS_MAX_BATCH)
+  {
+    memcpy(request->batch_ids, ids, num_of_devices * sizeof(ids[0]));
+    memcpy(request->batch_inputs, inputs, num_of_devices * sizeof(inputs[0]));
+  }
+  else
+    request->num_of_devices = 0;    // fails on the bus thread
+}
+
+CubeFuture CubeBus::getMeasurements(int id)
+{
+  Request *request = allocate();
+  request->type = REQ_GET_MEASUREMENTS;
+  request->id = id;
+  return submit(request);
+}
+
+CubeFuture CubeBus::getCurrAndMeas(int id)
+{
+  Request *request = allocate();
+  request->type = REQ_GET_CURR_AND_MEAS;
+  request->id = id;
+  return submit(request);
+}
+
+CubeFuture CubeBus::submitJob(const CubeJob &job, CubeBusClass traffic_class)
+{
+  Request *request = allocate();
+  request->type = REQ_JOB;
+  request->id = BROADCAST_ID;
+  request->job = job;
+  request->traffic_class = traffic_class;
+  return submit(request);
+}
+
+CubeBus::Request *CubeBus::allocate()
+{
+  Request *request;
+  if (!pool_.pop(request))
+    request = new Request;
+
+  // a fresh promise, allocated here rather than on the bus thread
+  boost::promise<CubeReply>().swap(request->promise);
+  return request;
+}
+
+void CubeBus::release(Request *request)
+{
+  request->job.clear();
+  if (!pool_.bounded_push(request))
+    delete request;
+}
+
+CubeBusClass CubeBus::classOf(const Request *request)
+{
+  switch (request->type)
+  {
+    case REQ_ACTIVATE:
+    case REQ_SET_INPUTS:
+    case REQ_SET_INPUTS_BATCH:
+    case REQ_SET_INPUTS_SYNC:
+      return BUS_CLASS_CONTROL;
+    case REQ_GET_MEASUREMENTS:
+    case REQ_GET_CURR_AND_MEAS:
+      return BUS_CLASS_POLL;
+    case REQ_JOB:
+      if (request->traffic_class >= 0 && request->traffic_class < BUS_CLASSES)
+        return request->traffic_class;
+      break;
+    default:
+      break;
+  }
+  return BUS_CLASS_DIAGNOSTIC;
+}
+
+CubeFuture CubeBus::submit(Request *request)
+{
+  CubeFuture future(request->promise.get_future());
+
+  request->traffic_class = classOf(request);
+  request->submitted_us = monotonicUsec();
+
+  // counted in flight while it checks running_ and pushes, so that close()
+  // drains the queues only after the push
+  ++producers_;
+  bool queued = running_ && queues_[request->traffic_class]->push(request);
+  --producers_;
+  if (!queued)
+  {
+    CubeReply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.status = -1;
+    request->promise.set_value(reply);
+    release(request);
+    return future;
+  }
+
+  // the push is ordered before the check of sleeping_, and the bus thread
+  // sets it before its last look at the queues: either it sees the request
+  // or the request sees it asleep and wakes it. The lock is only taken then.
+  boost::atomic_thread_fence(boost::memory_order_seq_cst);
+  if (sleeping_)
+  {
+    boost::lock_guard<boost::mutex> lock(wake_mutex_);
+    wake_cond_.notify_one();
+  }
+  return future;
+}
+
+void CubeBus::run()
+{
+  Request *request;
+
+  if (realtime_.lock_memory)
+  {
+    // touch the stack once so that page faults do not hit the first requests
+    volatile unsigned char stack[BUS_STACK_PREFAULT];
+    for (int i = 0; i < BUS_STACK_PREFAULT; i += 4096)
+      stack[i] = 0;
+    (void) stack[0];
+  }
+
+  while (running_)
+  {
+    request = next();
+    if (request)
+    {
+      CubeBusClass traffic_class = request->traffic_class;
+      long long start = monotonicUsec();
+      execute(request);
+      long long busy = monotonicUsec() - start;
+      release(request);
+
+      busy_us_[traffic_class] += busy;
+      tokens_us_[traffic_class] -= busy;
+      if (tokens_us_[traffic_class] < -BUS_BUDGET_WINDOW_US)
+        tokens_us_[traffic_class] = -BUS_BUDGET_WINDOW_US;
+      continue;
+    }
+
+    boost::unique_lock<boost::mutex> lock(wake_mutex_);
+    sleeping_ = true;
+    boost::atomic_thread_fence(boost::memory_order_seq_cst);
+    while (running_ && !pending())
+      wake_cond_.wait(lock);
+    sleeping_ = false;
+  }
+}
+
+bool CubeBus::pending() const
+{
+  for (int i = 0; i < BUS_CLASSES; ++i)
+    if (!queues_[i]->empty())
+      return true;
+  return false;
+}
+
+CubeBus::Request *CubeBus::next()
+{
+  long long now = monotonicUsec();
+
+  // each class earns its share of the time gone by, up to a window's worth
+  for (int i = 0; i < BUS_CLASSES; ++i)
+  {
+    double budget = budgets_[i];
+    if (refilled_us_)
+      tokens_us_[i] += (now - refilled_us_) * budget;
+    if (tokens_us_[i] > budget * BUS_BUDGET_WINDOW_US)
+      tokens_us_[i] = budget * BUS_BUDGET_WINDOW_US;
+  }
+  refilled_us_ = now;
+
+  // the highest class within its budget, else the highest with work at all
+  Request *request = NULL;
+  bool found = false;
+  for (int i = 0; i < BUS_CLASSES && !found; ++i)
+    found = (budgets_[i] >= 1.0 || tokens_us_[i] > 0) && queues_[i]->pop(request);
+  for (int i = 0; i < BUS_CLASSES && !found; ++i)
+    found = queues_[i]->pop(request);
+
+  if (found)
+    commHistogramAdd(&queue_delay_[request->traffic_class], now - request->submitted_us);
+  return found ? request : NULL;
+}
+
+bool CubeBus::coalesce(Request *request, short int inputs[NUM_OF_MOTORS])
+{
+  int id = request->id & 0xFF;
+  if (!isAfter(request->sequence, sent_[id]))
+    return false;                   // something as new went out already
+
+  // the newest setpoint, unless another write to the cube was submitted
+  // after this request and must not be overtaken
+  Setpoint &setpoint = setpoints_[id];
+  boost::uint64_t latest = setpoint.latest.load(boost::memory_order_acquire);
+  if (isAfter(setpoint.written, request->sequence) || isAfter(broadcast_written_, request->sequence))
+  {
+    memcpy(inputs, request->inputs, sizeof(request->inputs));
+    sent_[id] = request->sequence;
+  }
+  else
+  {
+    inputs[0] = (short int)(unsigned short int)(latest >> 16);
+    inputs[1] = (short int)(unsigned short int)latest;
+    sent_[id] = (unsigned int)(latest >> 32);
+  }
+  return true;
+}
+
+void CubeBus::execute(Request *request)
+{
+  CubeReply reply;
+  memset(&reply, 0, sizeof(reply));
+
+  switch (request->type)
+  {
+    case REQ_PING:
+      reply.status = commPing(&comm_, request->id);
+      break;
+    case REQ_ACTIVATE:
+      commActivate(&comm_, request->id, request->inputs[0]);
+      break;
+    case REQ_SET_INPUTS:
+      if (!request->sequence)
+        commSetInputs(&comm_, request->id, request->inputs);
+      else
+      {
+        short int inputs[NUM_OF_MOTORS];
+        reply.coalesced = !coalesce(request, inputs);
+        if (reply.coalesced)
+        {
+          setpoints_coalesced_++;
+          break;
+        }
+        commSetInputs(&comm_, request->id, inputs);
+      }
+      setpoints_sent_++;
+      break;
+    case REQ_SET_INPUTS_BATCH:
+      reply.status = commSetInputsBatch(&comm_, request->num_of_devices,
+                                        request->batch_ids, request->batch_inputs,
+                                        &reply.wire_time_us) < 0 ? -1 : 0;
+      break;
+    case REQ_SET_INPUTS_SYNC:
+      reply.status = commSetInputsSync(&comm_, request->num_of_devices,
+                                       request->batch_ids, request->batch_inputs,
+                                       request->whole_bus, &reply.skew_us);
+      break;
+    case REQ_GET_MEASUREMENTS:
+    {
+      // the cube samples somewhere between request and reply, the middle
+      // is the best guess
+      long long start = monotonicUsec();
+      reply.status = commGetMeasurements(&comm_, request->id, reply.measurements);
+      reply.stamp_us = (start + monotonicUsec()) / 2;
+      break;
+    }
+    case REQ_GET_CURR_AND_MEAS:
+    {
+      short int values[NUM_OF_MOTORS + NUM_OF_SENSORS];
+      long long start = monotonicUsec();
+      reply.status = commGetCurrAndMeas(&comm_, request->id, values);
+      reply.stamp_us = (start + monotonicUsec()) / 2;
+      memcpy(reply.currents, values, sizeof(reply.currents));
+      memcpy(reply.measurements, values + NUM_OF_MOTORS, sizeof(reply.measurements));
+      break;
+    }
+    case REQ_JOB:
+      reply.status = request->job(&comm_);
+      break;
+  }
+
+  request->promise.set_value(reply);
+}
@@ -0,0 +1,98 @@
+#include "cube_bus_manager.h"
+
+#include <string.h>
+
+CubeBusManager::CubeBusManager()
+{
+}
+
+CubeBusManager::~CubeBusManager()
+{
+  close();
+}
+
+bool CubeBusManager::addPort(const std::string &port, int baud_rate,
+                             const CubeBusRealtime &realtime)
+{
+  boost::shared_ptr<CubeBus> &bus = buses_[port];
+  if (!bus)
+  {
+    bus.reset(new CubeBus);
+    ports_.push_back(port);
+  }
+  return bus->open(port, baud_rate, realtime);
+}
+
+CubeBus *CubeBusManager::bus(const std::string &port) const
+{
+  std::map<std::string, boost::shared_ptr<CubeBus> >::const_iterator it = buses_.find(port);
+  return it == buses_.end() ? NULL : it->second.get();
+}
+
+bool CubeBusManager::addDevice(const std::string &name, const std::string &port, int id)
+{
+  CubeBus *port_bus = bus(port);
+  if (!port_bus || routes_.count(name))
+    return false;
+
+  CubeRoute &route = routes_[name];
+  route.port = port;
+  route.id = id;
+  route.bus = port_bus;
+  devices_.push_back(name);
+  return true;
+}
+
+const CubeRoute *CubeBusManager::route(const std::string &name) const
+{
+  std::map<std::string, CubeRoute>::const_iterator it = routes_.find(name);
+  return it == routes_.end() ? NULL : &it->second;
+}
+
+void CubeBusManager::close()
+{
+  // buses are independent, stopping them in turn is enough
+  std::map<std::string, boost::shared_ptr<CubeBus> >::iterator it;
+  for (it = buses_.begin(); it != buses_.end(); ++it)
+    it->second->close();
+}
+
+CubeFuture CubeBusManager::ping(const std::string &name)
+{
+  const CubeRoute *to = route(name);
+  return to ? to->bus->ping(to->id) : failed();
+}
+
+CubeFuture CubeBusManager::activate(const std::string &name, bool activate)
+{
+  const CubeRoute *to = route(name);
+  return to ? to->bus->activate(to->id, activate) : failed();
+}
+
+CubeFuture CubeBusManager::setInputs(const std::string &name, short int inputs[NUM_OF_MOTORS])
+{
+  const CubeRoute *to = route(name);
+  return to ? to->bus->setInputs(to->id, inputs) : failed();
+}
+
+CubeFuture CubeBusManager::getMeasurements(const std::string &name)
+{
+  const CubeRoute *to = route(name);
+  return to ? to->bus->getMeasurements(to->id) : failed();
+}
+
+CubeFuture CubeBusManager::getCurrAndMeas(const std::string &name)
+{
+  const CubeRoute *to = route(name);
+  return to ? to->bus->getCurrAndMeas(to->id) : failed();
+}
+
+CubeFuture CubeBusManager::failed()
+{
+  boost::promise<CubeReply> promise;
+  CubeReply reply;
+  memset(&reply, 0, sizeof(reply));
+  reply.status = -1;
+  promise.set_value(reply);
+  return CubeFuture(promise.get_future());
+}
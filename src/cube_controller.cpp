@@ -0,0 +1,392 @@
+#include "cube_controller.h"
+
+#include <math.h>
+#include <time.h>
+
+#define STREAM_MAX_POINTS 64
+#define REFERENCE_RANGE 65536.0
+
+static long long monotonicUsec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+CubeController::CubeController(CubeBus &bus, int id) :
+  bus_(bus),
+  id_(id),
+  period_us_(0),
+  move_start_us_(0),
+  moving_(false),
+  pending_(false),
+  streaming_(false),
+  stream_delay_us_(50000),
+  stream_decay_(0.1),
+  stream_timeout_us_(500000),
+  spinning_(false),
+  limited_(false),
+  spin_velocity_(0),
+  spin_target_(0),
+  spin_acceleration_(0),
+  spin_last_us_(0),
+  wrap_(false),
+  has_reference_(false),
+  reference_(0),
+  velocity_(0),
+  acceleration_(0),
+  reference_us_(0),
+  running_(false)
+{
+}
+
+CubeController::~CubeController()
+{
+  stop();
+}
+
+bool CubeController::start(double rate_hz)
+{
+  if (running_ || rate_hz <= 0)
+    return false;
+
+  period_us_ = (long)(1e6 / rate_hz);
+  running_ = true;
+  thread_ = boost::thread(&CubeController::run, this);
+  return true;
+}
+
+void CubeController::stop()
+{
+  if (!running_)
+    return;
+
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    running_ = false;
+  }
+  wake_.notify_all();
+  thread_.interrupt();
+  thread_.join();
+}
+
+void CubeController::setStreamTiming(double delay, double decay, double timeout)
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  stream_delay_us_ = (long)(delay * 1e6);
+  stream_decay_ = decay;
+  stream_timeout_us_ = (long)(timeout * 1e6);
+}
+
+void CubeController::setWrap(bool wrap)
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  wrap_ = wrap;
+}
+
+void CubeController::moveTo(double target, const CubeMotionLimits &limits, double from)
+{
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (has_reference_ && (moving_ || streaming_ || spinning_))
+    {
+      // pick up from the state the last reference was sent with, at the
+      // time it was, so the motion carries on without a jolt
+      trajectory_.plan(reference_, velocity_, acceleration_, target, limits);
+      move_start_us_ = reference_us_;
+    }
+    else
+    {
+      trajectory_.plan(has_reference_ ? reference_ : from, target, limits);
+      move_start_us_ = monotonicUsec();
+    }
+    moving_ = true;
+    streaming_ = false;
+    spinning_ = false;
+  }
+  wake_.notify_all();
+}
+
+void CubeController::stream(double position, long long stamp_us, double from)
+{
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    StreamPoint point;
+    point.stamp_us = stamp_us;
+    point.position = position;
+    point.velocity = 0;
+
+    if (!streaming_)
+    {
+      // lead in from where the reference is, reaching the first point one
+      // delay later like any other
+      StreamPoint first;
+      first.stamp_us = stamp_us - stream_delay_us_;
+      first.position = has_reference_ ? reference_ : from;
+      first.velocity = 0;
+      points_.assign(1, first);
+      streaming_ = true;
+      moving_ = false;
+      spinning_ = false;
+    }
+    else if (stamp_us <= points_.back().stamp_us)
+      return;                       // out of order, or a duplicate
+    else if (stamp_us - stream_delay_us_ > points_.back().stamp_us)
+    {
+      // it was coasting past the last point, go on from where it got to
+      StreamPoint coasted;
+      coasted.stamp_us = stamp_us - stream_delay_us_;
+      coasted.position = reference_;
+      coasted.velocity = 0;
+      points_.assign(1, coasted);
+    }
+
+    const StreamPoint &last = points_.back();
+    point.velocity = (position - last.position) * 1e6 / (stamp_us - last.stamp_us);
+    if (points_.size() == STREAM_MAX_POINTS)
+      points_.pop_front();
+    points_.push_back(point);
+  }
+  wake_.notify_all();
+}
+
+void CubeController::spin(double velocity, double acceleration, double from)
+{
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (!spinning_)
+    {
+      if (!has_reference_)
+        reference_ = from;
+      // a move or stream in progress hands its velocity over
+      spin_velocity_ = has_reference_ && (moving_ || streaming_) ? velocity_ : 0;
+      has_reference_ = true;
+      spin_last_us_ = monotonicUsec();
+      spinning_ = true;
+      moving_ = streaming_ = false;
+    }
+    spin_target_ = velocity;
+    spin_acceleration_ = acceleration;
+    limited_ = false;
+  }
+  wake_.notify_all();
+}
+
+void CubeController::hold(double position)
+{
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    reference_ = position;
+    has_reference_ = true;
+    velocity_ = acceleration_ = 0;
+    moving_ = false;
+    streaming_ = false;
+    spinning_ = false;
+    pending_ = true;
+  }
+  wake_.notify_all();
+}
+
+void CubeController::release()
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  has_reference_ = false;
+  velocity_ = acceleration_ = 0;
+  moving_ = false;
+  streaming_ = false;
+  spinning_ = false;
+  pending_ = false;
+}
+
+bool CubeController::isMoving() const
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return moving_;
+}
+
+bool CubeController::isStreaming() const
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return streaming_;
+}
+
+bool CubeController::isSpinning() const
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return spinning_;
+}
+
+double CubeController::spinVelocity() const
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return spinning_ ? spin_velocity_ : 0;
+}
+
+bool CubeController::isLimited() const
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return limited_;
+}
+
+double CubeController::reference() const
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return reference_;
+}
+
+void CubeController::send(double reference, bool wrap)
+{
+  short int inputs[NUM_OF_MOTORS];
+  if (wrap)
+    inputs[0] = (short int)(unsigned short int)(long)floor(reference + 0.5);
+  else
+  {
+    if (reference > 32767)
+      reference = 32767;
+    else if (reference < -32768)
+      reference = -32768;
+    inputs[0] = (short int)(reference >= 0 ? reference + 0.5 : reference - 0.5);
+  }
+
+  inputs[1] = inputs[0];
+  bus_.setInputs(id_, inputs);      // no reply to wait for
+}
+
+double CubeController::streamReference(long long now, double *velocity, double *acceleration)
+{
+  long long rendered = now - stream_delay_us_;
+
+  // the points behind the rendered instant are done with, but the one just
+  // before it
+  while (points_.size() > 1 && points_[1].stamp_us <= rendered)
+    points_.pop_front();
+
+  const StreamPoint &first = points_.front();
+  *velocity = *acceleration = 0;
+  if (rendered < first.stamp_us)
+    return first.position;
+  if (points_.size() > 1)
+  {
+    const StreamPoint &next = points_[1];
+    *velocity = next.velocity;
+    return first.position + (next.position - first.position) *
+           (rendered - first.stamp_us) / (next.stamp_us - first.stamp_us);
+  }
+
+  // past the last point: coast on its velocity, decaying to a stop
+  if (now - first.stamp_us > stream_timeout_us_)
+    streaming_ = false;
+  if (stream_decay_ <= 0)
+    return first.position;
+  double t = (rendered - first.stamp_us) / 1e6;
+  *velocity = first.velocity * exp(-t / stream_decay_);
+  *acceleration = -*velocity / stream_decay_;
+  return first.position + first.velocity * stream_decay_ * (1 - exp(-t / stream_decay_));
+}
+
+double CubeController::spinReference(long long now, double *acceleration)
+{
+  double dt = (now - spin_last_us_) / 1e6;
+  double target = spin_target_;
+  spin_last_us_ = now;
+
+  // clamped, brake early enough to stop at the end of the range
+  if (!wrap_ && spin_velocity_ != 0)
+  {
+    double room = spin_velocity_ > 0 ? 32767 - reference_ : reference_ + 32768;
+    double braking = spin_acceleration_ > 0 ?
+                     spin_velocity_ * spin_velocity_ / (2 * spin_acceleration_) : 0;
+    if (room <= braking + fabs(spin_velocity_) * dt && target * spin_velocity_ > 0)
+    {
+      spin_target_ = target = 0;
+      limited_ = true;
+    }
+  }
+
+  double change = target - spin_velocity_;
+  double step = spin_acceleration_ * dt;
+  if (spin_acceleration_ > 0 && change > step)
+    change = step;
+  else if (spin_acceleration_ > 0 && change < -step)
+    change = -step;
+  double velocity = spin_velocity_ + change;
+  *acceleration = dt > 0 ? change / dt : 0;
+
+  double reference = reference_ + (spin_velocity_ + velocity) / 2 * dt;
+  spin_velocity_ = velocity;
+  if (wrap_)
+    reference = remainder(reference, REFERENCE_RANGE);
+  else if (reference > 32767 || reference < -32768)
+  {
+    reference = reference > 0 ? 32767 : -32768;
+    spin_velocity_ = spin_target_ = 0;
+    *acceleration = 0;
+    limited_ = true;
+  }
+
+  if (spin_velocity_ == 0 && spin_target_ == 0)
+    spinning_ = false;
+  return reference;
+}
+
+void CubeController::run()
+{
+  long long next_tick = monotonicUsec();
+
+  try
+  {
+    while (running_)
+    {
+      double reference;
+      bool wrap;
+      {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        if (!moving_ && !streaming_ && !spinning_ && !pending_)
+        {
+          while (running_ && !moving_ && !streaming_ && !spinning_ && !pending_)
+            wake_.wait(lock);
+          next_tick = monotonicUsec();    // idle time does not count as late
+        }
+        if (!running_)
+          break;
+
+        long long now = monotonicUsec();
+        if (moving_)
+        {
+          double t = (now - move_start_us_) / 1e6;
+          trajectory_.sample(t, &reference_, &velocity_, &acceleration_);
+          has_reference_ = true;
+          moving_ = t < trajectory_.duration();
+        }
+        else if (streaming_)
+        {
+          reference_ = streamReference(now, &velocity_, &acceleration_);
+          has_reference_ = true;
+        }
+        else if (spinning_)
+        {
+          reference_ = spinReference(now, &acceleration_);
+          velocity_ = spin_velocity_;
+        }
+        else
+          velocity_ = acceleration_ = 0;
+        reference_us_ = now;
+        pending_ = false;
+        reference = reference_;
+        wrap = wrap_;
+      }
+
+      send(reference, wrap);
+
+      next_tick += period_us_;
+      long long now = monotonicUsec();
+      if (next_tick < now)
+        next_tick = now;
+      else
+        boost::this_thread::sleep(boost::posix_time::microseconds(next_tick - now));
+    }
+  }
+  catch (boost::thread_interrupted &)
+  {
+  }
+}
@@ -0,0 +1,154 @@
+#include "cube_poller.h"
+
+#include <string.h>
+#include <time.h>
+
+#define POLL_RATE_WINDOW_US 1000000LL
+
+static long long monotonicUsec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+CubePoller::CubePoller(CubeBus &bus) :
+  bus_(bus),
+  period_us_(0),
+  running_(false)
+{
+}
+
+CubePoller::~CubePoller()
+{
+  stop();
+}
+
+bool CubePoller::start(const std::vector<int> &ids, double rate_hz)
+{
+  if (running_ || ids.empty() || rate_hz <= 0)
+    return false;
+
+  CubeSample empty;
+  memset(&empty, 0, sizeof(empty));
+  empty.status = -1;
+
+  ids_ = ids;
+  samples_.assign(ids.size(), empty);
+  published_.reset(new Slot[ids.size()]);
+  for (size_t i = 0; i < ids.size(); ++i)
+  {
+    published_[i].sequence = 0;
+    published_[i].sample = empty;
+  }
+  period_us_ = (long)(1e6 / (rate_hz * ids.size()));
+
+  running_ = true;
+  thread_ = boost::thread(&CubePoller::run, this);
+  return true;
+}
+
+void CubePoller::stop()
+{
+  if (!running_)
+    return;
+
+  running_ = false;
+  thread_.interrupt();
+  thread_.join();
+}
+
+bool CubePoller::latest(int id, CubeSample *sample) const
+{
+  for (size_t i = 0; i < ids_.size(); ++i)
+  {
+    if (ids_[i] != id)
+      continue;
+
+    const Slot &slot = published_[i];
+    unsigned int before, after;
+    do
+    {
+      before = slot.sequence.load(boost::memory_order_acquire);
+      *sample = slot.sample;
+      boost::atomic_thread_fence(boost::memory_order_acquire);
+      after = slot.sequence.load(boost::memory_order_relaxed);
+    }
+    while ((before & 1) || before != after);
+    return true;
+  }
+  return false;
+}
+
+void CubePoller::publish(size_t index)
+{
+  Slot &slot = published_[index];
+  unsigned int sequence = slot.sequence.load(boost::memory_order_relaxed);
+
+  slot.sequence.store(sequence + 1, boost::memory_order_relaxed);
+  boost::atomic_thread_fence(boost::memory_order_release);
+  slot.sample = samples_[index];
+  slot.sequence.store(sequence + 2, boost::memory_order_release);
+}
+
+void CubePoller::run()
+{
+  std::vector<unsigned long> window_start_samples(ids_.size(), 0);
+  long long window_start = monotonicUsec();
+  long long next_slot = window_start;
+  size_t slot = 0;
+
+  try
+  {
+    while (running_)
+    {
+      CubeReply reply = bus_.getCurrAndMeas(ids_[slot]).get();
+      long long now = monotonicUsec();
+
+      CubeSample &sample = samples_[slot];
+      sample.status = reply.status;
+      if (reply.status)
+        sample.failures++;
+      else
+      {
+        // the difference of 16 bit readings is right across a wrap
+        if (sample.stamp_us && reply.stamp_us > sample.stamp_us)
+          sample.velocity = (short int)(reply.measurements[0] - sample.measurements[0]) * 1e6 /
+                            (reply.stamp_us - sample.stamp_us);
+        memcpy(sample.currents, reply.currents, sizeof(sample.currents));
+        memcpy(sample.measurements, reply.measurements, sizeof(sample.measurements));
+        sample.stamp_us = reply.stamp_us;
+        sample.samples++;
+      }
+
+      if (now - window_start >= POLL_RATE_WINDOW_US)
+      {
+        for (size_t i = 0; i < samples_.size(); ++i)
+        {
+          samples_[i].rate = (samples_[i].samples - window_start_samples[i]) * 1e6 /
+                             (now - window_start);
+          window_start_samples[i] = samples_[i].samples;
+          publish(i);
+        }
+        window_start = now;
+      }
+      else
+        publish(slot);
+
+      if (!reply.status && callback_)
+        callback_(ids_[slot], sample);
+
+      slot = (slot + 1) % ids_.size();
+
+      // a late slot is not made up by bursting, the rotation just shifts
+      next_slot += period_us_;
+      if (next_slot < now)
+        next_slot = now;
+      else
+        boost::this_thread::sleep(boost::posix_time::microseconds(next_slot - now));
+    }
+  }
+  catch (boost::thread_interrupted &)
+  {
+  }
+}
@@ -0,0 +1,248 @@
+#include "cube_registry.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fstream>
+#include <sstream>
+
+// parameters saved in the snapshot, with the layout commGetParam expects
+struct ParamLayout
+{
+  qbmove_parameter type;
+  unsigned short num_of_values;
+  unsigned short value_size;
+};
+
+static const ParamLayout PARAM_LAYOUTS[] =
+{
+  { PARAM_ID,                     1, 1 },
+  { PARAM_PID_CONTROL,            3, 4 },
+  { PARAM_STARTUP_ACTIVATION,     1, 1 },
+  { PARAM_INPUT_MODE,             1, 1 },
+  { PARAM_POS_RESOLUTION,         3, 1 },
+  { PARAM_MEASUREMENT_OFFSET,     3, 2 },
+  { PARAM_MEASUREMENT_MULTIPLIER, 3, 4 },
+  { PARAM_POS_LIMIT_FLAG,         1, 1 },
+  { PARAM_POS_LIMIT,              4, 4 }
+};
+
+CubeRegistry::CubeRegistry(const std::string &path) :
+  path_(path),
+  scans_(0)
+{
+}
+
+bool CubeRegistry::load()
+{
+  std::ifstream file(path_.c_str());
+  if (!file)
+    return false;
+
+  ports_.clear();
+
+  std::string line;
+  while (std::getline(file, line))
+  {
+    std::istringstream fields(line);
+    std::string port, kind;
+    int id;
+
+    if (line.empty() || line[0] == '#' || !(fields >> port >> kind))
+      continue;
+    if (kind == "empty")
+    {
+      ports_[port];                 // scanned, nothing answered
+      continue;
+    }
+    if (!(std::istringstream(kind) >> id) || !(fields >> kind))
+      continue;
+
+    std::vector<CubeRecord> &records = ports_[port];
+    CubeRecord *record = NULL;
+    for (size_t i = 0; i < records.size(); ++i)
+      if (records[i].id == id)
+        record = &records[i];
+    if (!record)
+    {
+      records.push_back(CubeRecord());
+      record = &records.back();
+      record->id = id;
+    }
+
+    if (kind == "param")
+    {
+      int type;
+      std::string hex;
+      if (!(fields >> type >> hex))
+        continue;
+
+      std::vector<unsigned char> value;
+      for (size_t i = 0; i + 1 < hex.size(); i += 2)
+        value.push_back((unsigned char)strtol(hex.substr(i, 2).c_str(), NULL, 16));
+      record->params[type] = value;
+    }
+  }
+
+  return true;
+}
+
+bool CubeRegistry::save() const
+{
+  // create the missing parent directories, outermost first
+  for (size_t slash = path_.find('/', 1); slash != std::string::npos;
+       slash = path_.find('/', slash + 1))
+  {
+    if (mkdir(path_.substr(0, slash).c_str(), 0755) && errno != EEXIST)
+      return false;
+  }
+
+  // written next to the file and renamed over it, so a crash or a full disk
+  // midway leaves the previous registry intact
+  std::string temporary = path_ + ".tmp";
+  std::ofstream file(temporary.c_str());
+  if (!file)
+    return false;
+
+  file << "# turn_table_interface device registry\n";
+
+  std::map<std::string, std::vector<CubeRecord> >::const_iterator port;
+  for (port = ports_.begin(); port != ports_.end(); ++port)
+  {
+    if (port->second.empty())
+      file << port->first << " empty\n";
+
+    for (size_t i = 0; i < port->second.size(); ++i)
+    {
+      const CubeRecord &record = port->second[i];
+
+      file << port->first << " " << record.id << " found\n";
+
+      std::map<int, std::vector<unsigned char> >::const_iterator param;
+      for (param = record.params.begin(); param != record.params.end(); ++param)
+      {
+        file << port->first << " " << record.id << " param " << param->first << " ";
+        for (size_t j = 0; j < param->second.size(); ++j)
+        {
+          char hex[3];
+          snprintf(hex, sizeof(hex), "%02x", param->second[j]);
+          file << hex;
+        }
+        file << "\n";
+      }
+    }
+  }
+
+  file.close();
+  if (!file || rename(temporary.c_str(), path_.c_str()))
+  {
+    remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::vector<int> CubeRegistry::ids(const std::string &port) const
+{
+  std::vector<int> result;
+  std::map<std::string, std::vector<CubeRecord> >::const_iterator it = ports_.find(port);
+  if (it != ports_.end())
+  {
+    for (size_t i = 0; i < it->second.size(); ++i)
+      result.push_back(it->second[i].id);
+  }
+  return result;
+}
+
+const CubeRecord *CubeRegistry::find(const std::string &port, int id) const
+{
+  std::map<std::string, std::vector<CubeRecord> >::const_iterator it = ports_.find(port);
+  if (it == ports_.end())
+    return NULL;
+
+  for (size_t i = 0; i < it->second.size(); ++i)
+    if (it->second[i].id == id)
+      return &it->second[i];
+  return NULL;
+}
+
+void CubeRegistry::update(const std::string &port, const CubeRecord &record)
+{
+  std::vector<CubeRecord> &records = ports_[port];
+  for (size_t i = 0; i < records.size(); ++i)
+  {
+    if (records[i].id == record.id)
+    {
+      records[i] = record;
+      return;
+    }
+  }
+  records.push_back(record);
+}
+
+void CubeRegistry::forget(const std::string &port)
+{
+  ports_.erase(port);
+}
+
+int CubeRegistry::sync(comm_settings *comm, const std::string &port,
+                       const std::vector<int> &expected)
+{
+  std::vector<int> known = ids(port);
+
+  // a port last found empty stays so until one of the expected cubes answers
+  if (known.empty() && ports_.count(port))
+  {
+    size_t silent = 0;
+    while (silent < expected.size() && commPing(comm, expected[silent]) != 0)
+      silent++;
+    if (silent == expected.size())
+      return 0;
+  }
+
+  // fast path: every cached device still answers
+  size_t alive = 0;
+  while (alive < known.size() && commPing(comm, known[alive]) == 0)
+    alive++;
+  if (!known.empty() && alive == known.size())
+    return known.size();
+
+  char known_ids[255];
+  char list_of_ids[255];
+  int num_of_known = known.size() < 255 ? known.size() : 255;
+
+  for (int i = 0; i < num_of_known; ++i)
+    known_ids[i] = (char)known[i];
+
+  int num_of_devices = RS485DiscoverDevices(comm, list_of_ids, known_ids, num_of_known, 1);
+  scans_++;
+
+  forget(port);
+  ports_[port];                     // recorded even if nothing answered
+  for (int i = 0; i < num_of_devices; ++i)
+    update(port, query(comm, (unsigned char)list_of_ids[i]));
+  save();
+
+  return num_of_devices;
+}
+
+CubeRecord CubeRegistry::query(comm_settings *comm, int id)
+{
+  CubeRecord record;
+  record.id = id;
+
+  for (size_t i = 0; i < sizeof(PARAM_LAYOUTS) / sizeof(PARAM_LAYOUTS[0]); ++i)
+  {
+    const ParamLayout &layout = PARAM_LAYOUTS[i];
+    std::vector<unsigned char> value(layout.num_of_values * layout.value_size);
+
+    if (commGetParam(comm, id, layout.type, &value[0], layout.num_of_values) == 0)
+      record.params[layout.type] = value;
+  }
+
+  return record;
+}
@@ -0,0 +1,229 @@
+#include "cube_trajectory.h"
+
+#include <math.h>
+
+CubeTrajectory::CubeTrajectory() :
+  start_(0),
+  target_(0),
+  duration_(0)
+{
+  for (int i = 0; i < SEGMENTS; ++i)
+  {
+    Segment &segment = segments_[i];
+    segment.duration = segment.jerk = 0;
+    segment.position = segment.velocity = segment.acceleration = 0;
+  }
+}
+
+bool CubeTrajectory::plan(double start, double target, const CubeMotionLimits &limits)
+{
+  return plan(start, 0, 0, target, limits);
+}
+
+bool CubeTrajectory::plan(double start, double velocity, double acceleration, double target,
+                          const CubeMotionLimits &limits)
+{
+  double durations[SEGMENTS];
+  double jerks[SEGMENTS];
+  double accelerations[SEGMENTS];   // at each segment start
+  bool valid = limits.velocity > 0 && limits.acceleration > 0;
+
+  for (int i = 0; i < SEGMENTS; ++i)
+    durations[i] = jerks[i] = accelerations[i] = 0;
+
+  start_ = start;
+  target_ = target;
+
+  // come to rest first, then move from wherever that left the reference
+  if (valid)
+    brake(velocity, acceleration, limits, durations, jerks, accelerations);
+  double stop = start, stop_velocity = velocity;
+  for (int i = 0; i < STOP_SEGMENTS; ++i)
+  {
+    double t = durations[i];
+    stop += stop_velocity * t + accelerations[i] * t * t / 2 + jerks[i] * t * t * t / 6;
+    stop_velocity += accelerations[i] * t + jerks[i] * t * t / 2;
+  }
+
+  double distance = fabs(target - stop);
+  double direction = target < stop ? -1.0 : 1.0;
+  double *move_durations = durations + STOP_SEGMENTS;
+  double *move_jerks = jerks + STOP_SEGMENTS;
+  double *move_accelerations = accelerations + STOP_SEGMENTS;
+
+  if (valid && distance > 0 && limits.jerk > 0)
+  {
+    double v = limits.velocity, a = limits.acceleration, j = limits.jerk;
+    double jerk_time, constant_time, peak;
+
+    // acceleration phase reaching v, with or without a stretch at full a
+    if (v * j >= a * a)
+    {
+      jerk_time = a / j;
+      constant_time = v / a - jerk_time;
+      peak = a;
+    }
+    else
+    {
+      jerk_time = sqrt(v / j);
+      constant_time = 0;
+      peak = j * jerk_time;
+    }
+
+    double cruise_time = distance / v - (2 * jerk_time + constant_time);
+    if (cruise_time < 0)
+    {
+      // too short to reach v: the peak velocity covers the distance exactly
+      // with no cruise, full a still reached or not
+      double top = a / 2 * (-a / j + sqrt(a * a / (j * j) + 4 * distance / a));
+      if (top * j >= a * a)
+      {
+        jerk_time = a / j;
+        constant_time = top / a - jerk_time;
+        peak = a;
+      }
+      else
+      {
+        top = pow(distance * sqrt(j) / 2, 2.0 / 3.0);
+        jerk_time = sqrt(top / j);
+        constant_time = 0;
+        peak = j * jerk_time;
+      }
+      cruise_time = 0;
+    }
+
+    double d[MOVE_SEGMENTS] = { jerk_time, constant_time, jerk_time, cruise_time,
+                                jerk_time, constant_time, jerk_time };
+    double k[MOVE_SEGMENTS] = { j, 0, -j, 0, -j, 0, j };
+    double s[MOVE_SEGMENTS] = { 0, peak, peak, 0, 0, -peak, -peak };
+    for (int i = 0; i < MOVE_SEGMENTS; ++i)
+    {
+      move_durations[i] = d[i];
+      move_jerks[i] = direction * k[i];
+      move_accelerations[i] = direction * s[i];
+    }
+  }
+  else if (valid && distance > 0)
+  {
+    // trapezoid: full acceleration, cruise, full deceleration
+    double v = limits.velocity, a = limits.acceleration;
+    double ramp_time = v / a;
+    double cruise_time = distance / v - ramp_time;
+    if (cruise_time < 0)
+    {
+      ramp_time = sqrt(distance / a);
+      cruise_time = 0;
+    }
+
+    move_durations[0] = ramp_time;
+    move_accelerations[0] = direction * a;
+    move_durations[3] = cruise_time;
+    move_durations[4] = ramp_time;
+    move_accelerations[4] = -direction * a;
+  }
+
+  // integrate the state at each segment start
+  double position = start;
+  duration_ = 0;
+  for (int i = 0; i < SEGMENTS; ++i)
+  {
+    Segment &segment = segments_[i];
+    double t = durations[i];
+
+    segment.duration = t;
+    segment.jerk = jerks[i];
+    segment.acceleration = accelerations[i];
+    segment.position = position;
+    segment.velocity = velocity;
+
+    position += velocity * t + segment.acceleration * t * t / 2 + segment.jerk * t * t * t / 6;
+    velocity += segment.acceleration * t + segment.jerk * t * t / 2;
+    duration_ += t;
+  }
+
+  return valid;
+}
+
+void CubeTrajectory::brake(double velocity, double acceleration, const CubeMotionLimits &limits,
+                           double *durations, double *jerks, double *accelerations)
+{
+  // worked out moving forwards, direction flips it back
+  double direction = velocity < 0 || (velocity == 0 && acceleration < 0) ? -1.0 : 1.0;
+  double v = direction * velocity, a = direction * acceleration;
+  double j = limits.jerk;
+  int i = 0;
+
+  if (v == 0 && a == 0)
+    return;
+
+  if (j <= 0)
+  {
+    // no jerk limit, the deceleration may jump straight to full
+    durations[0] = v / limits.acceleration;
+    accelerations[0] = -direction * limits.acceleration;
+    return;
+  }
+
+  if (a < 0 && j * v < a * a / 2)
+  {
+    // decelerating so hard that even easing off at once stops too late: ease
+    // off, and brake the small backwards velocity that leaves
+    durations[i] = -a / j;
+    jerks[i] = direction * j;
+    accelerations[i++] = direction * a;
+    v -= a * a / (2 * j);
+    a = 0;
+    direction = -direction;
+    v = -v;
+  }
+
+  // ramp the deceleration to a peak, hold it, ramp it back to 0 as the
+  // velocity reaches 0
+  double peak = sqrt(j * v + a * a / 2);
+  if (peak > limits.acceleration)
+    peak = limits.acceleration;
+  if (peak < -a)
+    peak = -a;                      // already decelerating beyond the limit
+  if (peak <= 0)
+    return;
+
+  double hold = (v + a * a / (2 * j) - peak * peak / j) / peak;
+  durations[i] = (a + peak) / j;
+  jerks[i] = -direction * j;
+  accelerations[i++] = direction * a;
+  durations[i] = hold > 0 ? hold : 0;
+  accelerations[i++] = -direction * peak;
+  durations[i] = peak / j;
+  jerks[i] = direction * j;
+  accelerations[i] = -direction * peak;
+}
+
+void CubeTrajectory::sample(double t, double *position, double *velocity,
+                            double *acceleration) const
+{
+  if (t >= duration_)
+  {
+    *position = target_;
+    *velocity = *acceleration = 0;
+    return;
+  }
+  if (t < 0)
+    t = 0;
+
+  int i = 0;
+  while (i < SEGMENTS - 1 && t >= segments_[i].duration)
+    t -= segments_[i++].duration;
+
+  const Segment &segment = segments_[i];
+  *position = segment.position + segment.velocity * t + segment.acceleration * t * t / 2 +
+              segment.jerk * t * t * t / 6;
+  *velocity = segment.velocity + segment.acceleration * t + segment.jerk * t * t / 2;
+  *acceleration = segment.acceleration + segment.jerk * t;
+}
+
+double CubeTrajectory::position(double t) const
+{
+  double position, velocity, acceleration;
+  sample(t, &position, &velocity, &acceleration);
+  return position;
+}
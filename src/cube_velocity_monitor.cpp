@@ -0,0 +1,116 @@
+#include "cube_velocity_monitor.h"
+
+#include <math.h>
+#include <string.h>
+
+CubeVelocityMonitor::CubeVelocityMonitor(double window, double tolerance) :
+  window_us_((long)(window * 1e6)),
+  tolerance_(tolerance),
+  square_sum_(0),
+  within_since_us_(0)
+{
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+void CubeVelocityMonitor::setWindow(double window)
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  window_us_ = (long)(window * 1e6);
+}
+
+void CubeVelocityMonitor::setTolerance(double tolerance)
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  tolerance_ = tolerance;
+}
+
+double CubeVelocityMonitor::tolerance() const
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return tolerance_;
+}
+
+void CubeVelocityMonitor::reset(double commanded)
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  memset(&stats_, 0, sizeof(stats_));
+  stats_.active = true;
+  stats_.commanded = commanded;
+  stats_.error = -commanded;
+  square_sum_ = 0;
+  within_since_us_ = 0;
+  samples_.clear();
+}
+
+void CubeVelocityMonitor::stop()
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  stats_.active = false;
+  samples_.clear();
+}
+
+void CubeVelocityMonitor::add(long long stamp_us, short int position)
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  if (!stats_.active || (!samples_.empty() && stamp_us <= samples_.back().stamp_us))
+    return;
+
+  // the difference of 16 bit readings is right across a wrap
+  Sample sample;
+  sample.stamp_us = stamp_us;
+  sample.reading = position;
+  sample.position = samples_.empty() ? position :
+                    samples_.back().position + (short int)(position - samples_.back().reading);
+  samples_.push_back(sample);
+
+  while (samples_.size() > 2 && stamp_us - samples_[1].stamp_us >= window_us_)
+    samples_.pop_front();
+
+  const Sample &first = samples_.front();
+  if (stamp_us - first.stamp_us < window_us_)
+    return;
+
+  // least-squares slope over the window, a single late-stamped sample
+  // barely moves it
+  double mean_t = 0, mean_p = 0;
+  for (size_t i = 0; i < samples_.size(); ++i)
+  {
+    mean_t += samples_[i].stamp_us - first.stamp_us;
+    mean_p += samples_[i].position - first.position;
+  }
+  mean_t /= samples_.size();
+  mean_p /= samples_.size();
+
+  double covariance = 0, variance = 0;
+  for (size_t i = 0; i < samples_.size(); ++i)
+  {
+    double t = samples_[i].stamp_us - first.stamp_us - mean_t;
+    covariance += t * (samples_[i].position - first.position - mean_p);
+    variance += t * t;
+  }
+  stats_.measured = covariance * 1e6 / variance;
+  stats_.error = stats_.measured - stats_.commanded;
+  if (!stats_.locked)
+  {
+    // within tolerance for a whole window, not just crossing it while ringing
+    if (fabs(stats_.error) > tolerance_)
+      within_since_us_ = 0;
+    else if (!within_since_us_)
+      within_since_us_ = stamp_us;
+    if (!within_since_us_ || stamp_us - within_since_us_ < window_us_)
+      return;
+    stats_.locked = true;
+  }
+
+  stats_.samples++;
+  if (fabs(stats_.error) > stats_.max_error)
+    stats_.max_error = fabs(stats_.error);
+  square_sum_ += stats_.error * stats_.error;
+  stats_.rms_error = sqrt(square_sum_ / stats_.samples);
+}
+
+CubeVelocityStats CubeVelocityMonitor::stats() const
+{
+  boost::lock_guard<boost::mutex> lock(mutex_);
+  return stats_;
+}
@@ -0,0 +1,1242 @@
+/**
+ *  \file       qb_cube_bench.cpp
+ *
+ *  \brief      Transaction benchmark for the QB cube serial library.
+ *
+ *  \details
+ *
+ *  Runs a series of CMD_GET_MEASUREMENTS cycles against one or more cubes (or
+ *  the emulator) and reports the CPU time spent per cycle together with the
+ *  latency percentiles. Each cycle polls every id once.
+ *
+ *  - "poll" uses the library, one request at a time;
+ *  - "spin" replays the FIONREAD busy-wait that RS485read used before
+ *    switching to poll(), so both read paths can be compared on the same bus.
+ *    That path never resynchronised: a reply later than its 4 ms stage was
+ *    read as the next one and every reply after it was off by one. The bench
+ *    lets the line go quiet after a failure instead, so that each late reply
+ *    costs one transaction and the comparison is of the read paths;
+ *  - "pipeline" keeps up to -w requests in flight with commPipeline;
+ *  - "discover" times full bus scans with RS485DiscoverDevices, pinging
+ *    windows of -w ids and probing the -i ids first;
+ *  - "probe" reports the throughput RS485ProbeThroughput measures with the
+ *    first id at the -b baud rate;
+ *  - "batch" sends CMD_SET_INPUTS to every -i id, -n times one commSetInputs
+ *    per device and -n times a single commSetInputsBatch, and compares the
+ *    syscalls and the time until the frames have left the port, then the
+ *    skew commSetInputsSync estimates for distinct inputs;
+ *  - "jitter" runs a fixed-rate loop of -t us (1000 by default) on a CubeBus
+ *    thread opened with the -r priority, -c cpu and -L memory locking
+ *    settings, and reports how late each cycle woke up and how long its
+ *    transaction took. Run it with and without load on the machine to see
+ *    what each setting buys;
+ *  - "trajectory" moves the first id back and forth by -a degrees (90 by
+ *    default), once with the raw step and once along a CubeController
+ *    profile within the -l velocity,acceleration,jerk limits (deg/s, deg/s^2,
+ *    deg/s^3) streamed every -t us (5000 by default), and compares the time
+ *    to settle within 0.5 deg and 2 deg/s and the overshoot. Meant for the
+ *    emulator's second order plant (qb_cube_emulator -w);
+ *  - "stream" plays -n setpoints of a 0.5 Hz sine sweeping -a degrees at
+ *    irregular 20-50 ms intervals, the way a planner sends them, once
+ *    writing each straight to the cube and once through a CubeController
+ *    stream rendered every -t us, and compares how far the measured
+ *    position strays from the sine (at the lag that fits it best);
+ *  - "velocity" spins the first id at -a deg/s, ramping at the -l
+ *    acceleration, and reports the time until the velocity measured over
+ *    0.2 s came within 1 deg/s, then the largest and RMS error over -n
+ *    samples. -W sends the reference modulo 2^16 for endless rotation
+ *    (qb_cube_emulator -W); without it the spin must end within the range;
+ *  - "coalesce" polls the -i ids at 500 Hz each while -w client threads
+ *    send -n bursts of 16 setpoints to the first id, once with setpoint
+ *    coalescing off and once on, and compares the setpoints that reached
+ *    the line, the time each burst took to drain and the poll rate left;
+ *  - "priority" polls the -i ids at 500 Hz each while -w threads read their
+ *    info strings back to back, and times -n setpoints to the first id at
+ *    200 Hz from submission to the line: once queued with the diagnostics,
+ *    as a single queue would, and once in the control class. Then it prints
+ *    the queueing delay of each class and its share of the bus time;
+ *  - "codec" needs no device: it times -n encodes and decodes of
+ *    CMD_SET_INPUTS and CMD_GET_MEASUREMENTS frames with qb_cube_codec.h
+ *    against the hand-rolled code the comm* functions used before, plus the
+ *    fixed frame patching of argument-less requests, and reports frames/s.
+ *
+ *  Usage: qb_cube_bench [-p port] [-b baud] [-i id[,id...]] [-n cycles]
+ *                       [-t period_us] [-a angle] [-l velocity,acceleration,jerk]
+ *                       [-m poll|spin|pipeline|discover|probe|batch|jitter|
+ *                           trajectory|stream|velocity|coalesce|priority|codec]
+ *                       [-w window] [-r priority] [-c cpu] [-L] [-W]
+**/
+
+#include <qb_cube_lib.h>
+#include <qb_cube_codec.h>
+#include <cube_bus.h>
+#include <cube_controller.h>
+#include <cube_poller.h>
+#include <cube_trajectory.h>
+#include <cube_velocity_monitor.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+//==============================================================================
+//                                                                       helpers
+//==============================================================================
+
+static long long clockUsec(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static long percentile(std::vector<long> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+#define SPIN_QUIET_US 20000
+
+// Busy-wait read path as it was before RS485read moved to poll(): spin on
+// FIONREAD and gettimeofday for up to 4000 us per stage.
+static int spinRead(comm_settings *comm_settings_t, int id, char *package)
+{
+    unsigned char data_in[500];
+    unsigned int package_size;
+    int n_bytes;
+    struct timeval start, now;
+
+    gettimeofday(&start, NULL);
+    gettimeofday(&now, NULL);
+    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
+    while ((n_bytes < 4) && (timevaldiff(&start, &now) < 4000))
+    {
+        gettimeofday(&now, NULL);
+        ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
+    }
+    if (read(comm_settings_t->file_handle, data_in, 4) != 4)
+        return -1;
+    if ((id != 0) && (data_in[2] != id))
+        return -1;
+
+    package_size = data_in[3];
+    gettimeofday(&start, NULL);
+    gettimeofday(&now, NULL);
+    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
+    while ((n_bytes < (int)package_size) && (timevaldiff(&start, &now) < 4000))
+    {
+        gettimeofday(&now, NULL);
+        ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
+    }
+    if (package_size == 0 ||
+        read(comm_settings_t->file_handle, data_in, package_size) != (int)package_size)
+        return -1;
+    if (checksum((char *)data_in, package_size - 1) != (char)data_in[package_size - 1])
+        return -1;
+
+    memcpy(package, data_in, package_size);
+    return package_size;
+}
+
+static int spinGetMeasurements(comm_settings *comm_settings_t, int id)
+{
+    char data_out[6];
+    char package_in[500];
+    int n_bytes;
+
+    data_out[0] = ':';
+    data_out[1] = ':';
+    data_out[2] = (unsigned char) id;
+    data_out[3] = 2;
+    data_out[4] = CMD_GET_MEASUREMENTS;
+    data_out[5] = CMD_GET_MEASUREMENTS;
+
+    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
+    if (n_bytes)
+        read(comm_settings_t->file_handle, package_in, n_bytes);
+    write(comm_settings_t->file_handle, data_out, 6);
+
+    if (spinRead(comm_settings_t, id, package_in) != -1)
+        return 0;
+
+    // the reply may still be on its way, do not take it for the next one
+    usleep(SPIN_QUIET_US);
+    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
+    while (n_bytes > 0)
+    {
+        int n = read(comm_settings_t->file_handle, package_in,
+                     n_bytes < (int)sizeof(package_in) ? n_bytes : (int)sizeof(package_in));
+        if (n <= 0)
+            break;
+        n_bytes -= n;
+    }
+    return -1;
+}
+
+static int runDiscovery(comm_settings *comm, const std::vector<int> &known,
+                        int count, int window)
+{
+    char known_ids[255];
+    char list_of_ids[255];
+    int num_of_known = known.size() < 255 ? known.size() : 255;
+    int found = 0;
+    std::vector<long> durations;
+
+    for (int i = 0; i < num_of_known; ++i)
+        known_ids[i] = (char) known[i];
+
+    for (int i = 0; i < count; ++i)
+    {
+        long long t0 = clockUsec(CLOCK_MONOTONIC);
+        found = RS485DiscoverDevices(comm, list_of_ids, known_ids, num_of_known, window);
+        durations.push_back((long)(clockUsec(CLOCK_MONOTONIC) - t0));
+    }
+
+    closeRS485(comm);
+    std::sort(durations.begin(), durations.end());
+
+    printf("mode            discover (window %d)\n", window);
+    printf("devices         %d:", found);
+    for (int i = 0; i < found; ++i)
+        printf(" %d", (unsigned char) list_of_ids[i]);
+    printf("\n");
+    printf("scans           %d\n", count);
+    printf("scan time p50   %.1f ms\n", percentile(durations, 0.50) / 1e3);
+    printf("scan time p99   %.1f ms\n", percentile(durations, 0.99) / 1e3);
+    printf("scan time max   %.1f ms\n", durations.empty() ? 0.0 : durations.back() / 1e3);
+
+    return found ? 0 : 1;
+}
+
+static int runProbe(comm_settings *comm, int id, int count)
+{
+    float bytes_per_second, round_trips_per_second;
+    int answered = RS485ProbeThroughput(comm, id, count,
+                                        &bytes_per_second, &round_trips_per_second);
+    int baud_rate = comm->baud_rate;
+
+    closeRS485(comm);
+
+    printf("mode            probe (id %d)\n", id);
+    printf("baud rate       %d\n", baud_rate);
+    printf("round trips     %d (%d answered)\n", count, answered < 0 ? 0 : answered);
+    printf("throughput      %.0f bytes/s (%.1f%% of the line)\n", bytes_per_second,
+           100.0 * bytes_per_second * 10 / baud_rate);
+    printf("round trip rate %.0f /s\n", round_trips_per_second);
+
+    return answered > 0 ? 0 : 1;
+}
+
+static int runBatch(comm_settings *comm, const std::vector<int> &ids, int count)
+{
+    int num_of_ids = ids.size() < 255 ? ids.size() : 255;
+    short int inputs[255][NUM_OF_MOTORS];
+    std::vector<long> single_times, batch_times;
+    unsigned long single_syscalls, batch_syscalls;
+    static comm_stats stats;
+
+    memset(inputs, 0, sizeof(inputs));
+    single_times.reserve(count);
+    batch_times.reserve(count);
+
+    commStatsSnapshot(comm, &stats);
+    single_syscalls = stats.syscalls;
+    for (int i = 0; i < count; ++i)
+    {
+        long long t0 = clockUsec(CLOCK_MONOTONIC);
+        for (int j = 0; j < num_of_ids; ++j)
+        {
+            inputs[j][0] = inputs[j][1] = (short int)i;
+            commSetInputs(comm, ids[j], inputs[j]);
+        }
+        tcdrain(comm->file_handle);
+        single_times.push_back((long)(clockUsec(CLOCK_MONOTONIC) - t0));
+    }
+    commStatsSnapshot(comm, &stats);
+    single_syscalls = stats.syscalls - single_syscalls + count;   // + tcdrain
+
+    batch_syscalls = stats.syscalls;
+    int failures = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        long wire_time_us = 0;
+        for (int j = 0; j < num_of_ids; ++j)
+            inputs[j][0] = inputs[j][1] = (short int)i;
+        if (commSetInputsBatch(comm, num_of_ids, &ids[0], inputs, &wire_time_us) < 0)
+            failures++;
+        batch_times.push_back(wire_time_us);
+    }
+    commStatsSnapshot(comm, &stats);
+    batch_syscalls = stats.syscalls - batch_syscalls;
+
+    // distinct inputs force a batch, the skew is what spacing the frames costs
+    std::vector<long> skews;
+    int held_up = 0;
+    skews.reserve(count);
+    for (int i = 0; i < count; ++i)
+    {
+        long skew_us = 0;
+        for (int j = 0; j < num_of_ids; ++j)
+            inputs[j][0] = inputs[j][1] = (short int)(i + j);
+        int ret = commSetInputsSync(comm, num_of_ids, &ids[0], inputs, 0, &skew_us);
+        if (ret < 0)
+            failures++;
+        else if (ret == 2)
+            held_up++;
+        skews.push_back(skew_us);
+    }
+
+    int baud_rate = comm->baud_rate;
+    closeRS485(comm);
+
+    std::sort(single_times.begin(), single_times.end());
+    std::sort(batch_times.begin(), batch_times.end());
+    std::sort(skews.begin(), skews.end());
+
+    printf("mode            batch (%d devices, %d cycles)\n", num_of_ids, count);
+    printf("frame time      %.0f us per device at %d baud\n",
+           qbcodec::SetInputs::FRAME_SIZE * 10 * 1e6 / baud_rate, baud_rate);
+    printf("one per device  %.1f syscalls/cycle (drain included), "
+           "p50 %ld us, p99 %ld us\n",
+           count ? (double)single_syscalls / count : 0.0,
+           percentile(single_times, 0.50), percentile(single_times, 0.99));
+    printf("batched         %.1f syscalls/cycle (drain included), "
+           "p50 %ld us, p99 %ld us (%d failed)\n",
+           count ? (double)batch_syscalls / count : 0.0,
+           percentile(batch_times, 0.50), percentile(batch_times, 0.99), failures);
+    printf("sync skew       p50 %ld us, p99 %ld us, max %ld us estimated "
+           "(%d held up, nominal only)\n",
+           percentile(skews, 0.50), percentile(skews, 0.99),
+           skews.empty() ? 0 : skews.back(), held_up);
+
+    return failures ? 1 : 0;
+}
+
+struct JitterRun
+{
+    int id;
+    int count;
+    long period_us;
+    int failures;
+    std::vector<long> lateness;     // wake up time past the cycle start
+    std::vector<long> latencies;    // transaction time
+};
+
+// runs on the bus thread, with its scheduling settings
+static int jitterCycles(JitterRun *run, comm_settings *comm)
+{
+    short int measurements[NUM_OF_SENSORS];
+    struct timespec next;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (int i = 0; i < run->count; ++i)
+    {
+        next.tv_nsec += run->period_us * 1000;
+        while (next.tv_nsec >= 1000000000)
+        {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        long long t0 = clockUsec(CLOCK_MONOTONIC);
+        if (commGetMeasurements(comm, run->id, measurements))
+            run->failures++;
+        long long t1 = clockUsec(CLOCK_MONOTONIC);
+
+        run->lateness.push_back((long)(t0 - (next.tv_sec * 1000000LL + next.tv_nsec / 1000)));
+        run->latencies.push_back((long)(t1 - t0));
+    }
+
+    return 0;
+}
+
+static int runJitter(const char *port, int baud_rate, int id, int count,
+                     long period_us, const CubeBusRealtime &realtime)
+{
+    JitterRun run;
+    run.id = id;
+    run.count = count;
+    run.period_us = period_us > 0 ? period_us : 1000;
+    run.failures = 0;
+    run.lateness.reserve(count);
+    run.latencies.reserve(count);
+
+    CubeBus bus;
+    if (!bus.open(port, baud_rate, realtime))
+    {
+        fprintf(stderr, "Could not open %s\n", port);
+        return 1;
+    }
+    if (!bus.realtimeError().empty())
+        fprintf(stderr, "Real-time profile not fully applied: %s\n",
+                bus.realtimeError().c_str());
+
+    bus.submitJob(boost::bind(jitterCycles, &run, _1)).wait();
+    bus.close();
+
+    std::sort(run.lateness.begin(), run.lateness.end());
+    std::sort(run.latencies.begin(), run.latencies.end());
+
+    long overruns = 0;
+    for (size_t i = 0; i < run.latencies.size(); ++i)
+        if (run.latencies[i] > run.period_us)
+            overruns++;
+
+    printf("mode            jitter (id %d, period %ld us)\n", id, run.period_us);
+    printf("priority        %s", realtime.priority > 0 ? "SCHED_FIFO " : "SCHED_OTHER\n");
+    if (realtime.priority > 0)
+        printf("%d\n", realtime.priority);
+    printf("cpu             %s", realtime.cpu >= 0 ? "" : "any\n");
+    if (realtime.cpu >= 0)
+        printf("%d\n", realtime.cpu);
+    printf("memory locked   %s\n", realtime.lock_memory ? "yes" : "no");
+    printf("cycles          %d (%d failed, %ld overran the period)\n",
+           count, run.failures, overruns);
+    printf("wake up p50     %ld us late\n", percentile(run.lateness, 0.50));
+    printf("wake up p99     %ld us late\n", percentile(run.lateness, 0.99));
+    printf("wake up max     %ld us late\n", run.lateness.empty() ? 0 : run.lateness.back());
+    printf("latency p50     %ld us\n", percentile(run.latencies, 0.50));
+    printf("latency p99     %ld us\n", percentile(run.latencies, 0.99));
+    printf("latency max     %ld us\n", run.latencies.empty() ? 0 : run.latencies.back());
+
+    return run.failures == count ? 1 : 0;
+}
+
+struct MoveResult
+{
+    long settle_us;         // -1 if it never settled
+    double overshoot;       // ticks past the target
+};
+
+// waits until the cube has been within tolerance for SETTLE_SAMPLES samples
+#define SETTLE_TICKS (0.5 * DEG_TICK_MULTIPLIER)
+#define SETTLE_TICKS_PER_S (2.0 * DEG_TICK_MULTIPLIER)
+#define SETTLE_SAMPLES 10
+#define SETTLE_TIMEOUT_US 5000000LL
+
+static MoveResult waitSettled(CubePoller &poller, int id, double start, double target,
+                              long long t0)
+{
+    MoveResult result;
+    result.settle_us = -1;
+    result.overshoot = 0;
+
+    double direction = target >= start ? 1.0 : -1.0;
+    unsigned long seen = 0;
+    int settled = 0;
+    long long settled_since = 0;
+
+    while (clockUsec(CLOCK_MONOTONIC) - t0 < SETTLE_TIMEOUT_US)
+    {
+        CubeSample sample;
+        poller.latest(id, &sample);
+        if (sample.samples != seen && sample.stamp_us > t0)
+        {
+            seen = sample.samples;
+            double error = target - sample.measurements[0];
+            if (-direction * error > result.overshoot)
+                result.overshoot = -direction * error;
+
+            if (fabs(error) <= SETTLE_TICKS && fabs(sample.velocity) <= SETTLE_TICKS_PER_S)
+            {
+                if (!settled++)
+                    settled_since = sample.stamp_us;
+                if (settled >= SETTLE_SAMPLES)
+                {
+                    result.settle_us = (long)(settled_since - t0);
+                    break;
+                }
+            }
+            else
+                settled = 0;
+        }
+        usleep(500);
+    }
+    return result;
+}
+
+static int runTrajectory(const char *port, int baud_rate, int id, int count,
+                         long period_us, double angle, const CubeMotionLimits &limits)
+{
+    CubeBus bus;
+    if (!bus.open(port, baud_rate))
+    {
+        fprintf(stderr, "Could not open %s\n", port);
+        return 1;
+    }
+    bus.activate(id, true).wait();
+
+    CubePoller poller(bus);
+    CubeController controller(bus, id);
+    poller.start(std::vector<int>(1, id), 500);
+    controller.start(1e6 / (period_us > 0 ? period_us : 5000));
+
+    CubeMotionLimits ticks(limits.velocity * DEG_TICK_MULTIPLIER,
+                           limits.acceleration * DEG_TICK_MULTIPLIER,
+                           limits.jerk * DEG_TICK_MULTIPLIER);
+    double distance = angle * DEG_TICK_MULTIPLIER;
+    const char *names[2] = { "step", "profile" };
+    std::vector<long> settle[2];
+    double overshoot[2] = { 0, 0 };
+    int failures[2] = { 0, 0 };
+    double duration = 0;
+
+    // start from rest at 0
+    controller.hold(0);
+    waitSettled(poller, id, 0, 0, clockUsec(CLOCK_MONOTONIC));
+
+    // moves back and forth, each with the raw step and with the profile
+    for (int i = 0; i < count; ++i)
+    {
+        for (int mode = 0; mode < 2; ++mode)
+        {
+            double start = controller.reference();
+            double target = start ? 0 : distance;
+            long long t0 = clockUsec(CLOCK_MONOTONIC);
+
+            if (mode == 0)
+                controller.hold(target);
+            else
+            {
+                controller.moveTo(target, ticks, start);
+                CubeTrajectory trajectory;
+                trajectory.plan(start, target, ticks);
+                duration = trajectory.duration();
+            }
+
+            MoveResult result = waitSettled(poller, id, start, target, t0);
+            if (result.settle_us < 0)
+                failures[mode]++;
+            else
+                settle[mode].push_back(result.settle_us);
+            overshoot[mode] += result.overshoot;
+        }
+    }
+
+    controller.stop();
+    poller.stop();
+    bus.close();
+
+    printf("mode            trajectory (id %d, %.1f deg moves, control every %ld us)\n",
+           id, angle, period_us > 0 ? period_us : 5000);
+    printf("limits          %.0f deg/s, %.0f deg/s^2, %.0f deg/s^3 (profile %.0f ms)\n",
+           limits.velocity, limits.acceleration, limits.jerk, duration * 1e3);
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        std::sort(settle[mode].begin(), settle[mode].end());
+        printf("%-15s settle p50 %.0f ms, max %.0f ms, overshoot %.2f deg (%d did not settle)\n",
+               names[mode], percentile(settle[mode], 0.50) / 1e3,
+               settle[mode].empty() ? 0.0 : settle[mode].back() / 1e3,
+               count ? overshoot[mode] / count / DEG_TICK_MULTIPLIER : 0.0, failures[mode]);
+    }
+
+    return failures[1] ? 1 : 0;
+}
+
+// Frame building and parsing as the comm* functions did before the codec:
+// 500 byte buffers, byte swapping through casts and a checksum loop.
+static int legacyEncodeSetInputs(char *data_out, int id, short int inputs[2])
+{
+    char buffer[500];
+
+    buffer[0] = ':';
+    buffer[1] = ':';
+    buffer[2] = (unsigned char) id;
+    buffer[3] = 6;
+    buffer[4] = CMD_SET_INPUTS;
+    buffer[5] = ((char *) &inputs[0])[1];
+    buffer[6] = ((char *) &inputs[0])[0];
+    buffer[7] = ((char *) &inputs[1])[1];
+    buffer[8] = ((char *) &inputs[1])[0];
+    buffer[9] = checksum(buffer + 4, 5);
+
+    memcpy(data_out, buffer, 10);
+    return 10;
+}
+
+static void legacyDecodeMeasurements(const char *package_in, short int measurements[])
+{
+    for (int i = 0; i < NUM_OF_SENSORS; ++i)
+    {
+        ((char *) &measurements[i])[0] = package_in[2 + 2 * i];
+        ((char *) &measurements[i])[1] = package_in[1 + 2 * i];
+    }
+}
+
+// keeps the compiler from folding the timed loops: the buffer may be read
+// and written behind its back after every iteration
+static inline void clobber(void *buffer)
+{
+    asm volatile("" : : "g"(buffer) : "memory");
+}
+
+static double framesPerSecond(long long start, int count)
+{
+    long long elapsed = clockUsec(CLOCK_MONOTONIC) - start;
+    return elapsed > 0 ? count * 1e6 / elapsed : 0.0;
+}
+
+static int runCodec(int count)
+{
+    char frame[16];
+    char package_in[8][qbcodec::GetMeasurements::REPLY_SIZE];
+    short int inputs[NUM_OF_MOTORS] = { 0, 0 };
+    short int measurements[NUM_OF_SENSORS];
+    qbcodec::SetInputs::Request request;
+    qbcodec::GetMeasurements::Reply reply;
+    unsigned int check = 0;
+    long long start;
+
+    // a few distinct replies to decode in turn
+    qbcodec::GetMeasurements::Reply sample;
+    for (int k = 0; k < 8; ++k)
+    {
+        for (int i = 0; i < NUM_OF_SENSORS; ++i)
+            sample.values[i] = (short int)(1000 * i - 1234 + 77 * k);
+        package_in[k][0] = CMD_GET_MEASUREMENTS;
+        qbcodec::GetMeasurements::Reply::put(package_in[k] + 1, sample);
+    }
+
+    printf("mode            codec (%d frames each)\n", count);
+
+    // inputs change every iteration and every output feeds the check printed
+    // at the end, so no loop can be hoisted or folded away
+    start = clockUsec(CLOCK_MONOTONIC);
+    for (int i = 0; i < count; ++i)
+    {
+        inputs[0] = (short int) i;
+        legacyEncodeSetInputs(frame, 1, inputs);
+        clobber(frame);
+        check += (unsigned char) frame[i & 7];
+    }
+    printf("encode legacy   %.1f M frames/s\n", framesPerSecond(start, count) / 1e6);
+
+    start = clockUsec(CLOCK_MONOTONIC);
+    for (int i = 0; i < count; ++i)
+    {
+        request.values[0] = (short int) i;
+        request.values[1] = 0;
+        qbcodec::encode<qbcodec::SetInputs>(frame, 1, request);
+        clobber(frame);
+        check += (unsigned char) frame[i & 7];
+    }
+    printf("encode codec    %.1f M frames/s\n", framesPerSecond(start, count) / 1e6);
+
+    start = clockUsec(CLOCK_MONOTONIC);
+    for (int i = 0; i < count; ++i)
+    {
+        qbcodec::encodeFixed<qbcodec::GetMeasurements>(frame, i & 0xFF);
+        clobber(frame);
+        check += (unsigned char) frame[i & 7];
+    }
+    printf("encode fixed    %.1f M frames/s (get measurements, id patched)\n",
+           framesPerSecond(start, count) / 1e6);
+
+    start = clockUsec(CLOCK_MONOTONIC);
+    for (int i = 0; i < count; ++i)
+    {
+        legacyDecodeMeasurements(package_in[i & 7], measurements);
+        clobber(measurements);
+        check += measurements[i % NUM_OF_SENSORS];
+    }
+    printf("decode legacy   %.1f M frames/s\n", framesPerSecond(start, count) / 1e6);
+
+    start = clockUsec(CLOCK_MONOTONIC);
+    for (int i = 0; i < count; ++i)
+    {
+        qbcodec::decode<qbcodec::GetMeasurements>(package_in[i & 7], sizeof(package_in[0]),
+                                                  reply);
+        clobber(&reply);
+        check += reply.values[i % NUM_OF_SENSORS];
+    }
+    printf("decode codec    %.1f M frames/s\n", framesPerSecond(start, count) / 1e6);
+    printf("check           %08x\n", check);
+
+    return 0;
+}
+
+//==============================================================================
+//                                                                     runStream
+//==============================================================================
+
+#define STREAM_FREQUENCY_HZ 0.5
+#define STREAM_MAX_LAG_US 300000
+
+struct TrackedSample
+{
+    long long stamp_us;
+    double position;        // ticks
+};
+
+// RMS and peak distance of the samples from the sine delayed by lag_us
+static void trackingError(const std::vector<TrackedSample> &samples, long long t0,
+                          double amplitude, long lag_us, double *rms, double *peak)
+{
+    double sum = 0;
+    int n = 0;
+    *peak = 0;
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        double t = (samples[i].stamp_us - t0 - lag_us) / 1e6;
+        if (t < 0)
+            continue;
+        double ideal = amplitude / 2 * (1 - cos(2 * M_PI * STREAM_FREQUENCY_HZ * t));
+        double error = fabs(samples[i].position - ideal);
+        sum += error * error;
+        if (error > *peak)
+            *peak = error;
+        n++;
+    }
+    *rms = n ? sqrt(sum / n) : 0;
+}
+
+static int runStream(const char *port, int baud_rate, int id, int count, long period_us,
+                     double angle)
+{
+    CubeBus bus;
+    if (!bus.open(port, baud_rate))
+    {
+        fprintf(stderr, "Could not open %s\n", port);
+        return 1;
+    }
+    bus.activate(id, true).wait();
+
+    CubePoller poller(bus);
+    CubeController controller(bus, id);
+    poller.start(std::vector<int>(1, id), 500);
+    controller.start(1e6 / (period_us > 0 ? period_us : 5000));
+
+    double amplitude = angle * DEG_TICK_MULTIPLIER;
+    const char *names[2] = { "direct", "stream" };
+    double rms[2], peak[2];
+    long lag[2];
+
+    srand(1);
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        controller.hold(0);
+        waitSettled(poller, id, 0, 0, clockUsec(CLOCK_MONOTONIC));
+
+        std::vector<TrackedSample> samples;
+        unsigned long seen = 0;
+        long long t0 = clockUsec(CLOCK_MONOTONIC);
+        long long next = t0;
+
+        for (int i = 0; i < count; ++i)
+        {
+            long long now = clockUsec(CLOCK_MONOTONIC);
+            double t = (now - t0) / 1e6;
+            double setpoint = amplitude / 2 * (1 - cos(2 * M_PI * STREAM_FREQUENCY_HZ * t));
+            if (mode == 0)
+                controller.hold(setpoint);
+            else
+                controller.stream(setpoint, now, 0);
+
+            // record the cube until the next setpoint is due
+            next += 20000 + rand() % 30000;
+            while (clockUsec(CLOCK_MONOTONIC) < next)
+            {
+                CubeSample sample;
+                poller.latest(id, &sample);
+                if (sample.samples != seen)
+                {
+                    seen = sample.samples;
+                    TrackedSample tracked = { sample.stamp_us, (double)sample.measurements[0] };
+                    samples.push_back(tracked);
+                }
+                usleep(1000);
+            }
+        }
+
+        // the lag that fits best, then the error left
+        rms[mode] = -1;
+        for (long l = 0; l <= STREAM_MAX_LAG_US; l += 2000)
+        {
+            double r, p;
+            trackingError(samples, t0, amplitude, l, &r, &p);
+            if (rms[mode] < 0 || r < rms[mode])
+            {
+                rms[mode] = r;
+                peak[mode] = p;
+                lag[mode] = l;
+            }
+        }
+    }
+
+    controller.stop();
+    poller.stop();
+    bus.close();
+
+    printf("mode            stream (id %d, %d setpoints, %.1f deg at %.1f Hz, control every %ld us)\n",
+           id, count, angle, STREAM_FREQUENCY_HZ, period_us > 0 ? period_us : 5000);
+    for (int mode = 0; mode < 2; ++mode)
+        printf("%-15s error rms %.2f deg, peak %.2f deg at lag %ld ms\n", names[mode],
+               rms[mode] / DEG_TICK_MULTIPLIER, peak[mode] / DEG_TICK_MULTIPLIER, lag[mode] / 1000);
+    return 0;
+}
+
+//==============================================================================
+//                                                                   runVelocity
+//==============================================================================
+
+#define VELOCITY_WINDOW_S 0.2
+#define VELOCITY_TOLERANCE_DEG_S 1.0
+
+static int runVelocity(const char *port, int baud_rate, int id, int count, long period_us,
+                       double velocity, double acceleration, bool wrap)
+{
+    CubeBus bus;
+    if (!bus.open(port, baud_rate))
+    {
+        fprintf(stderr, "Could not open %s\n", port);
+        return 1;
+    }
+    bus.activate(id, true).wait();
+
+    CubePoller poller(bus);
+    CubeController controller(bus, id);
+    CubeVelocityMonitor monitor(VELOCITY_WINDOW_S, VELOCITY_TOLERANCE_DEG_S * DEG_TICK_MULTIPLIER);
+    poller.start(std::vector<int>(1, id), 500);
+    controller.setWrap(wrap);
+    controller.start(1e6 / (period_us > 0 ? period_us : 5000));
+
+    controller.hold(0);
+    waitSettled(poller, id, 0, 0, clockUsec(CLOCK_MONOTONIC));
+
+    double commanded = velocity * DEG_TICK_MULTIPLIER;
+    unsigned long seen = 0;
+    long long t0 = clockUsec(CLOCK_MONOTONIC);
+    long long locked_us = -1;
+    CubeVelocityStats stats;
+
+    monitor.reset(commanded);
+    controller.spin(commanded, acceleration * DEG_TICK_MULTIPLIER, 0);
+    do
+    {
+        CubeSample sample;
+        poller.latest(id, &sample);
+        if (sample.samples != seen && sample.stamp_us > t0)
+        {
+            seen = sample.samples;
+            monitor.add(sample.stamp_us, sample.measurements[0]);
+        }
+        stats = monitor.stats();
+        if (stats.locked && locked_us < 0)
+            locked_us = clockUsec(CLOCK_MONOTONIC) - t0;
+        usleep(500);
+    }
+    while (controller.isSpinning() && stats.samples < (unsigned long)count);
+
+    bool limited = controller.isLimited();
+    controller.spin(0, acceleration * DEG_TICK_MULTIPLIER, 0);
+    while (controller.isSpinning())
+        usleep(1000);
+
+    controller.stop();
+    poller.stop();
+    bus.close();
+
+    printf("mode            velocity (id %d, %.1f deg/s at %.0f deg/s^2, %s, control every %ld us)\n",
+           id, velocity, acceleration, wrap ? "wrapped" : "clamped", period_us > 0 ? period_us : 5000);
+    if (!stats.locked)
+    {
+        printf("never came within %.1f deg/s%s\n", VELOCITY_TOLERANCE_DEG_S,
+               limited ? " before the end of the 16 bit range" : "");
+        return 1;
+    }
+    printf("locked          after %.0f ms\n", locked_us / 1e3);
+    printf("error           max %.3f deg/s, rms %.3f deg/s over %lu samples of %.1f s%s\n",
+           stats.max_error / DEG_TICK_MULTIPLIER, stats.rms_error / DEG_TICK_MULTIPLIER,
+           stats.samples, VELOCITY_WINDOW_S, limited ? " (stopped at the end of the range)" : "");
+    return stats.max_error <= VELOCITY_TOLERANCE_DEG_S * DEG_TICK_MULTIPLIER ? 0 : 1;
+}
+
+//==============================================================================
+//                                                                   runCoalesce
+//==============================================================================
+
+#define COALESCE_BURST 16
+#define COALESCE_PAUSE_US 20000
+
+struct BurstClient
+{
+    CubeBus *bus;
+    int id;
+    int bursts;
+    std::vector<long> *drain_us;
+    boost::mutex *mutex;
+};
+
+// bursts of setpoints, timing each until its last one has completed
+static void sendBursts(BurstClient client)
+{
+    std::vector<long> drain_us;
+    for (int i = 0; i < client.bursts; ++i)
+    {
+        CubeFuture last;
+        for (int k = 0; k < COALESCE_BURST; ++k)
+        {
+            short int inputs[NUM_OF_MOTORS];
+            inputs[0] = inputs[1] = (short int)(rand() % 2000);
+            last = client.bus->setInputs(client.id, inputs);
+        }
+        long long t0 = clockUsec(CLOCK_MONOTONIC);
+        last.wait();
+        drain_us.push_back((long)(clockUsec(CLOCK_MONOTONIC) - t0));
+        usleep(COALESCE_PAUSE_US);
+    }
+
+    boost::lock_guard<boost::mutex> lock(*client.mutex);
+    client.drain_us->insert(client.drain_us->end(), drain_us.begin(), drain_us.end());
+}
+
+static int runCoalesce(const char *port, int baud_rate, const std::vector<int> &ids, int count,
+                       int clients)
+{
+    CubeBus bus;
+    if (!bus.open(port, baud_rate))
+    {
+        fprintf(stderr, "Could not open %s\n", port);
+        return 1;
+    }
+
+    printf("mode            coalesce (id %d, %d clients x %d bursts of %d, %d polled)\n",
+           ids[0], clients, count, COALESCE_BURST, (int)ids.size());
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        CubePoller poller(bus);
+        std::vector<long> drain_us;
+        boost::mutex mutex;
+        boost::thread_group threads;
+
+        bus.setCoalescing(mode == 1);
+        poller.start(ids, 500);
+        usleep(100000);
+        bus.resetStats();
+        CubeSample before;
+        poller.latest(ids[0], &before);
+        long long t0 = clockUsec(CLOCK_MONOTONIC);
+
+        for (int i = 0; i < clients; ++i)
+        {
+            BurstClient client = { &bus, ids[0], count, &drain_us, &mutex };
+            threads.create_thread(boost::bind(sendBursts, client));
+        }
+        threads.join_all();
+
+        CubeSample after;
+        poller.latest(ids[0], &after);
+        double poll_rate = (after.samples - before.samples) * 1e6 / (clockUsec(CLOCK_MONOTONIC) - t0);
+        poller.stop();
+
+        CubeBusCounters counters = bus.counters();
+        std::sort(drain_us.begin(), drain_us.end());
+        printf("%-15s %lu sent, %lu coalesced; drain p50 %ld us, p99 %ld us; poll %.0f Hz\n",
+               mode ? "coalescing" : "every setpoint", counters.setpoints_sent,
+               counters.setpoints_coalesced, percentile(drain_us, 0.50), percentile(drain_us, 0.99),
+               poll_rate);
+    }
+
+    bus.close();
+    return 0;
+}
+
+//==============================================================================
+//                                                                   runPriority
+//==============================================================================
+
+#define PRIORITY_CONTROL_PERIOD_US 5000
+
+struct InfoClient
+{
+    CubeBus *bus;
+    std::vector<int> ids;
+    boost::atomic<bool> *running;
+    boost::atomic<unsigned long> *reads;
+};
+
+static int readInfo(comm_settings *comm, int id)
+{
+    char info[2000];
+    return commGetInfo(comm, id, INFO_ALL, info);
+}
+
+// info reads back to back, the way a diagnostics tool would hammer the bus
+static void readInfoLoop(InfoClient client)
+{
+    for (size_t i = 0; *client.running; i = (i + 1) % client.ids.size())
+    {
+        client.bus->submitJob(boost::bind(readInfo, _1, client.ids[i])).wait();
+        (*client.reads)++;
+    }
+}
+
+static int writeInputs(comm_settings *comm, int id, short int value)
+{
+    short int inputs[NUM_OF_MOTORS] = { value, value };
+    commSetInputs(comm, id, inputs);
+    return 0;
+}
+
+static int runPriority(const char *port, int baud_rate, const std::vector<int> &ids, int count,
+                       int clients)
+{
+    static const char *class_names[BUS_CLASSES] = { "control", "poll", "diagnostic" };
+
+    CubeBus bus;
+    if (!bus.open(port, baud_rate))
+    {
+        fprintf(stderr, "Could not open %s\n", port);
+        return 1;
+    }
+
+    printf("mode            priority (id %d, %d setpoints at %d Hz, %d info readers, %d polled)\n",
+           ids[0], count, 1000000 / PRIORITY_CONTROL_PERIOD_US, clients, (int)ids.size());
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        CubePoller poller(bus);
+        boost::atomic<bool> running(true);
+        boost::atomic<unsigned long> reads(0);
+        boost::thread_group threads;
+        std::vector<long> latency_us;
+
+        poller.start(ids, 500);
+        for (int i = 0; i < clients; ++i)
+        {
+            InfoClient client = { &bus, ids, &running, &reads };
+            threads.create_thread(boost::bind(readInfoLoop, client));
+        }
+        usleep(100000);
+        bus.resetStats();
+        long long t0 = clockUsec(CLOCK_MONOTONIC);
+
+        for (int i = 0; i < count; ++i)
+        {
+            short int inputs[NUM_OF_MOTORS];
+            inputs[0] = inputs[1] = (short int)(i % 1000);
+            long long start = clockUsec(CLOCK_MONOTONIC);
+            if (mode == 0)
+                bus.submitJob(boost::bind(writeInputs, _1, ids[0], inputs[0])).wait();
+            else
+                bus.setInputs(ids[0], inputs).wait();
+            latency_us.push_back((long)(clockUsec(CLOCK_MONOTONIC) - start));
+            usleep(PRIORITY_CONTROL_PERIOD_US);
+        }
+
+        double elapsed = (clockUsec(CLOCK_MONOTONIC) - t0) / 1e6;
+        CubeBusCounters counters = bus.counters();
+        running = false;
+        threads.join_all();
+        poller.stop();
+
+        std::sort(latency_us.begin(), latency_us.end());
+        printf("%-15s setpoint p50 %ld us, p99 %ld us, max %ld us; %.0f info reads/s\n",
+               mode ? "control class" : "single queue", percentile(latency_us, 0.50),
+               percentile(latency_us, 0.99), latency_us.empty() ? 0 : latency_us.back(),
+               reads / elapsed);
+        for (int c = 0; mode == 1 && c < BUS_CLASSES; ++c)
+            printf("  %-13s queued p50 %.0f us, p99 %.0f us; %.1f%% of the bus\n", class_names[c],
+                   commStatsPercentile(&counters.queue_delay[c], 0.50),
+                   commStatsPercentile(&counters.queue_delay[c], 0.99),
+                   counters.busy_us[c] / elapsed / 1e4);
+    }
+
+    bus.close();
+    return 0;
+}
+
+//==============================================================================
+//                                                                          main
+//==============================================================================
+
+int main(int argc, char **argv)
+{
+    const char *port = "/dev/ttyUSB0";
+    const char *mode = "poll";
+    std::vector<int> ids;
+    int count = 1000;
+    int window = 4;
+    int baud_rate = DEFAULT_BAUD_RATE;
+    CubeBusRealtime realtime;
+    long period_us = 0;
+    double angle = 90;
+    CubeMotionLimits limits(200, 1440, 7200);
+    bool wrap = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:b:i:n:t:a:l:m:w:r:c:LWh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p': port = optarg; break;
+            case 'b': baud_rate = atoi(optarg); break;
+            case 'i':
+                for (char *token = strtok(optarg, ","); token; token = strtok(NULL, ","))
+                    ids.push_back(atoi(token));
+                break;
+            case 'n': count = atoi(optarg); break;
+            case 't': period_us = atol(optarg); break;
+            case 'a': angle = atof(optarg); break;
+            case 'l':
+                sscanf(optarg, "%lf,%lf,%lf", &limits.velocity, &limits.acceleration, &limits.jerk);
+                break;
+            case 'm': mode = optarg; break;
+            case 'w': window = atoi(optarg); break;
+            case 'r': realtime.priority = atoi(optarg); break;
+            case 'c': realtime.cpu = atoi(optarg); break;
+            case 'L': realtime.lock_memory = true; break;
+            case 'W': wrap = true; break;
+            default:
+                fprintf(stderr, "Usage: %s [-p port] [-b baud] [-i id[,id...]] [-n cycles] "
+                        "[-t period_us] [-a angle] [-l velocity,acceleration,jerk] "
+                        "[-m poll|spin|pipeline|discover|probe|batch|jitter|trajectory|stream|velocity|coalesce|"
+                        "priority|codec] "
+                        "[-w window] [-r priority] [-c cpu] [-L] [-W]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    bool discover = !strcmp(mode, "discover");
+    if (ids.empty() && !discover)
+        ids.push_back(1);
+
+    bool spin = !strcmp(mode, "spin");
+    bool pipeline = !strcmp(mode, "pipeline");
+    bool probe = !strcmp(mode, "probe");
+    bool batch = !strcmp(mode, "batch");
+    bool jitter = !strcmp(mode, "jitter");
+    bool codec = !strcmp(mode, "codec");
+    bool trajectory = !strcmp(mode, "trajectory");
+    bool stream = !strcmp(mode, "stream");
+    bool velocity = !strcmp(mode, "velocity");
+    bool coalesce = !strcmp(mode, "coalesce");
+    bool priority = !strcmp(mode, "priority");
+    if (!spin && !pipeline && !discover && !probe && !batch && !jitter && !trajectory && !stream &&
+        !velocity && !coalesce && !priority && !codec && strcmp(mode, "poll"))
+    {
+        fprintf(stderr, "Unknown mode '%s'\n", mode);
+        return 1;
+    }
+
+    if (codec)
+        return runCodec(count);
+    if (jitter)
+        return runJitter(port, baud_rate, ids[0], count, period_us, realtime);
+    if (trajectory)
+        return runTrajectory(port, baud_rate, ids[0], count, period_us, angle, limits);
+    if (stream)
+        return runStream(port, baud_rate, ids[0], count, period_us, angle);
+    if (velocity)
+        return runVelocity(port, baud_rate, ids[0], count, period_us, angle, limits.acceleration, wrap);
+    if (coalesce)
+        return runCoalesce(port, baud_rate, ids, count, window);
+    if (priority)
+        return runPriority(port, baud_rate, ids, count, window);
+
+    comm_settings comm;
+    openRS485(&comm, port, baud_rate);
+    if (comm.file_handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "Could not open %s\n", port);
+        return 1;
+    }
+
+    if (discover)
+        return runDiscovery(&comm, ids, count, window);
+    if (probe)
+        return runProbe(&comm, ids[0], count);
+    if (batch)
+        return runBatch(&comm, ids, count);
+
+    std::vector<long> latencies;
+    latencies.reserve(count);
+    short int measurements[255][NUM_OF_SENSORS];
+    int status[255];
+    int num_of_ids = ids.size() < 255 ? ids.size() : 255;
+    int failures = 0;
+
+    long long wall_start = clockUsec(CLOCK_MONOTONIC);
+    long long cpu_start = clockUsec(CLOCK_PROCESS_CPUTIME_ID);
+
+    for (int i = 0; i < count; ++i)
+    {
+        long long t0 = clockUsec(CLOCK_MONOTONIC);
+        int answered = 0;
+        if (pipeline)
+        {
+            answered = commPipelineGetMeasurements(&comm, &ids[0], num_of_ids,
+                                                   measurements, status, window);
+        }
+        else
+        {
+            for (int j = 0; j < num_of_ids; ++j)
+            {
+                int ret = spin ? spinGetMeasurements(&comm, ids[j])
+                               : commGetMeasurements(&comm, ids[j], measurements[j]);
+                if (!ret)
+                    answered++;
+            }
+        }
+        long long t1 = clockUsec(CLOCK_MONOTONIC);
+
+        failures += num_of_ids - answered;
+        latencies.push_back((long)(t1 - t0));
+
+        if (period_us > t1 - t0)
+            usleep(period_us - (t1 - t0));
+    }
+
+    long long cpu_total = clockUsec(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+    long long wall_total = clockUsec(CLOCK_MONOTONIC) - wall_start;
+    static comm_stats stats;
+    commStatsSnapshot(&comm, &stats);
+    const comm_histogram *latency = commStatsLatency(&stats, CMD_GET_MEASUREMENTS);
+
+    closeRS485(&comm);
+
+    std::sort(latencies.begin(), latencies.end());
+
+    long requests = (long)count * num_of_ids;
+
+    printf("mode            %s\n", mode);
+    printf("cycles          %d x %d devices\n", count, num_of_ids);
+    printf("transactions    %ld (%d failed)\n", requests, failures);
+    printf("wall time       %.3f s\n", wall_total / 1e6);
+    printf("request rate    %.0f /s\n", wall_total ? requests * 1e6 / wall_total : 0.0);
+    printf("cpu time        %.3f s (%.1f%% of one core)\n",
+           cpu_total / 1e6, wall_total ? 100.0 * cpu_total / wall_total : 0.0);
+    printf("cpu/transaction %.1f us\n", requests ? (double)cpu_total / requests : 0.0);
+    printf("bytes discarded %lu (%lu resyncs)\n", stats.bytes_drained, stats.resyncs);
+    printf("library stats   %lu timeouts, %lu id mismatches, %lu checksum failures\n",
+           stats.timeouts, stats.id_mismatches, stats.checksum_failures);
+    printf("syscalls        %.1f per transaction\n",
+           requests ? (double)stats.syscalls / requests : 0.0);
+    if (latency->count)
+        printf("transaction     p50 %.0f us, p99 %.0f us, max %.0f us (library histogram)\n",
+               commStatsPercentile(latency, 0.50), commStatsPercentile(latency, 0.99),
+               commStatsPercentile(latency, 1.0));
+    printf("cycle latency:\n");
+    printf("latency p50     %ld us\n", percentile(latencies, 0.50));
+    printf("latency p90     %ld us\n", percentile(latencies, 0.90));
+    printf("latency p99     %ld us\n", percentile(latencies, 0.99));
+    printf("latency max     %ld us\n", latencies.empty() ? 0 : latencies.back());
+
+    return failures == requests ? 1 : 0;
+}
@@ -0,0 +1,591 @@
+/**
+ *  \file       qb_cube_emulator.cpp
+ *
+ *  \brief      QB cube firmware emulator on a pseudo-terminal.
+ *
+ *  \details
+ *
+ *  Opens a pty pair and answers on the slave side as one or more QB cubes
+ *  would on the RS485 bus, so that qbcubelib, its tools and the turn table
+ *  node can be exercised without hardware. The slave path is printed on
+ *  start-up and can optionally be published through a symlink, to be passed
+ *  to openRS485 (or to the node's ~port parameter).
+ *
+ *  The protocol follows commands.h: "::" id length payload checksum, where the
+ *  checksum is the XOR of the payload bytes. Requests to BROADCAST_ID are
+ *  applied to every cube and never answered. Replies are delayed by a fixed
+ *  latency plus the time the frames would take on the wire at the emulated
+ *  baud rate (10 bits per byte).
+ *
+ *  Each cube drives a slew-rate limited plant from its position reference, so
+ *  CMD_GET_MEASUREMENTS reports a position that moves after CMD_SET_INPUTS.
+ *  With -w the plant is the firmware position loop instead: an underdamped
+ *  second order system of natural frequency -w Hz and damping ratio -z
+ *  (0.2 by default), still within the slew rate, which overshoots and rings
+ *  on a step the way the turn table does. With -W the cubes turn endlessly:
+ *  the loop closes on the error wrapped to 16 bits and the measurement wraps
+ *  around, so a reference sent modulo 2^16 keeps them spinning.
+ *
+ *  With -g, random line noise is written before a reply with the given
+ *  probability, to exercise the host side resynchronisation.
+ *
+ *  Usage: qb_cube_emulator [-i id[,id...]] [-l link] [-d latency_us] [-b baud]
+ *                          [-g noise_probability] [-w natural_hz] [-z damping]
+ *                          [-W] [-v]
+**/
+
+#include <commands.h>
+#include <definitions.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <math.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#define MAX_SLEW_TICKS_PER_S 20000.0    ///< Plant slew rate (ticks/s)
+#define PLANT_STEP_US 100               ///< Integration step of the second order plant
+
+//==============================================================================
+//                                                                       helpers
+//==============================================================================
+
+static volatile sig_atomic_t running = 1;
+static bool verbose = false;
+
+static void onSignal(int)
+{
+    running = 0;
+}
+
+static long long monotonicUsec()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static unsigned char xorChecksum(const unsigned char *data, int length)
+{
+    unsigned char chk = 0;
+    for (int i = 0; i < length; ++i)
+        chk ^= data[i];
+    return chk;
+}
+
+static void putShort(std::vector<unsigned char> &out, short value)
+{
+    out.push_back((unsigned char)((value >> 8) & 0xFF));
+    out.push_back((unsigned char)(value & 0xFF));
+}
+
+static void putFloat(std::vector<unsigned char> &out, float value)
+{
+    unsigned char bytes[4];
+    memcpy(bytes, &value, 4);
+    for (int i = 3; i >= 0; --i)
+        out.push_back(bytes[i]);
+}
+
+//==============================================================================
+//                                                                 Emulated cube
+//==============================================================================
+
+struct Cube
+{
+    int id;
+    bool active;
+    short inputs[2];
+    double position;        // ticks
+    double velocity;        // ticks/s
+    double natural_hz;      // second order plant if > 0
+    double damping;
+    bool wrap;              // endless rotation, 16 bit error
+    long long last_update;  // us
+    std::map<int, std::vector<unsigned char> > params;   // big-endian values
+
+    Cube(int cube_id, double plant_hz, double plant_damping, bool plant_wrap) :
+        id(cube_id), active(false), position(0.0), velocity(0.0),
+        natural_hz(plant_hz), damping(plant_damping), wrap(plant_wrap),
+        last_update(monotonicUsec())
+    {
+        inputs[0] = inputs[1] = 0;
+
+        std::vector<unsigned char> value;
+        value.push_back((unsigned char)cube_id);
+        params[PARAM_ID] = value;
+
+        value.clear();
+        putFloat(value, DEFAULT_PID_P);
+        putFloat(value, DEFAULT_PID_I);
+        putFloat(value, DEFAULT_PID_D);
+        params[PARAM_PID_CONTROL] = value;
+
+        params[PARAM_STARTUP_ACTIVATION] = std::vector<unsigned char>(1, 0);
+        params[PARAM_INPUT_MODE] = std::vector<unsigned char>(1, INPUT_MODE_EXTERNAL);
+        params[PARAM_POS_RESOLUTION] = std::vector<unsigned char>(3, DEFAULT_RESOLUTION);
+        params[PARAM_MEASUREMENT_OFFSET] = std::vector<unsigned char>(6, 0);
+
+        value.clear();
+        for (int i = 0; i < 3; ++i)
+            putFloat(value, 1.0f);
+        params[PARAM_MEASUREMENT_MULTIPLIER] = value;
+
+        params[PARAM_POS_LIMIT_FLAG] = std::vector<unsigned char>(1, 0);
+        params[PARAM_POS_LIMIT] = std::vector<unsigned char>(16, 0);
+    }
+
+    void update()
+    {
+        long long now = monotonicUsec();
+        double dt = (now - last_update) / 1e6;
+        last_update = now;
+
+        double target = active ? inputs[0] : position;
+        if (wrap)
+            target = position + remainder(target - position, 65536.0);
+
+        if (natural_hz > 0)
+        {
+            // x'' = wn^2 (r - x) - 2 z wn x', in fixed steps to stay stable
+            // however long the cube was left alone
+            double wn = 2 * M_PI * natural_hz;
+            double h = PLANT_STEP_US / 1e6;
+            for (double t = 0; t < dt; t += h)
+            {
+                double step = dt - t < h ? dt - t : h;
+                double acceleration = active ? wn * wn * (target - position) -
+                                               2 * damping * wn * velocity
+                                             : -2 * damping * wn * velocity;
+                velocity += acceleration * step;
+                if (velocity > MAX_SLEW_TICKS_PER_S)
+                    velocity = MAX_SLEW_TICKS_PER_S;
+                else if (velocity < -MAX_SLEW_TICKS_PER_S)
+                    velocity = -MAX_SLEW_TICKS_PER_S;
+                position += velocity * step;
+            }
+            if (wrap)
+                position = remainder(position, 65536.0);
+            return;
+        }
+
+        double step = MAX_SLEW_TICKS_PER_S * dt;
+        double error = target - position;
+
+        if (error > step)
+            error = step;
+        else if (error < -step)
+            error = -step;
+
+        position += error;
+        velocity = dt > 0 ? error / dt : 0.0;
+        if (wrap)
+            position = remainder(position, 65536.0);
+    }
+
+    short measurement() const
+    {
+        return (short)(unsigned short)(long)floor(position + 0.5);
+    }
+
+    short current() const
+    {
+        return (short)(velocity / 100.0);
+    }
+};
+
+//==============================================================================
+//                                                                      Emulator
+//==============================================================================
+
+class Emulator
+{
+public:
+    Emulator(int master_fd, long latency_us, long baud_rate, double noise,
+             double plant_hz, double plant_damping, bool plant_wrap) :
+        fd_(master_fd), latency_us_(latency_us), baud_rate_(baud_rate),
+        noise_(noise), plant_hz_(plant_hz), plant_damping_(plant_damping),
+        plant_wrap_(plant_wrap)
+    {
+    }
+
+    void addCube(int id)
+    {
+        cubes_.push_back(Cube(id, plant_hz_, plant_damping_, plant_wrap_));
+    }
+
+    void feed(const unsigned char *data, int size)
+    {
+        rx_.insert(rx_.end(), data, data + size);
+        parse();
+    }
+
+private:
+    int fd_;
+    long latency_us_;
+    long baud_rate_;
+    double noise_;
+    double plant_hz_;
+    double plant_damping_;
+    bool plant_wrap_;
+    std::vector<Cube> cubes_;
+    std::vector<unsigned char> rx_;
+
+    long wireUsec(size_t bytes) const
+    {
+        return baud_rate_ > 0 ? (long)(bytes * 10 * 1000000LL / baud_rate_) : 0;
+    }
+
+    void parse()
+    {
+        size_t pos = 0;
+
+        while (pos < rx_.size())
+        {
+            // info request "?\r\n", answered by whichever device is attached;
+            // a '?' not followed by CR LF is line noise, as for the firmware
+            if (rx_[pos] == '?')
+            {
+                if ((rx_.size() > pos + 1 && rx_[pos + 1] != '\r') ||
+                    (rx_.size() > pos + 2 && rx_[pos + 2] != '\n'))
+                {
+                    pos++;
+                    continue;
+                }
+                if (rx_.size() - pos < 3)
+                    break;
+                pos += 3;
+                sendInfoString();
+                continue;
+            }
+
+            if (rx_[pos] != ':')
+            {
+                pos++;
+                continue;
+            }
+            if (pos + 1 >= rx_.size())
+                break;
+            if (rx_[pos + 1] != ':')
+            {
+                pos++;
+                continue;
+            }
+            if (rx_.size() - pos < 4)
+                break;
+
+            int id = rx_[pos + 2];
+            int length = rx_[pos + 3];
+            if (rx_.size() - pos < (size_t)(4 + length))
+                break;
+
+            const unsigned char *payload = &rx_[pos + 4];
+            if (length < 2 || xorChecksum(payload, length - 1) != payload[length - 1])
+            {
+                if (verbose)
+                    fprintf(stderr, "[emulator] bad frame for id %d, resyncing\n", id);
+                pos++;
+                continue;
+            }
+
+            usleep(wireUsec(4 + length));
+            dispatch(id, payload, length - 1);
+            pos += 4 + length;
+        }
+
+        rx_.erase(rx_.begin(), rx_.begin() + pos);
+    }
+
+    void dispatch(int id, const unsigned char *payload, int size)
+    {
+        for (size_t i = 0; i < cubes_.size(); ++i)
+        {
+            if (id == BROADCAST_ID || cubes_[i].id == id)
+            {
+                cubes_[i].update();
+                handle(cubes_[i], payload, size, id != BROADCAST_ID);
+                if (id != BROADCAST_ID)
+                    return;
+            }
+        }
+    }
+
+    void handle(Cube &cube, const unsigned char *payload, int size, bool reply)
+    {
+        std::vector<unsigned char> out;
+        unsigned char command = payload[0];
+
+        if (verbose)
+            fprintf(stderr, "[emulator] id %d command %d\n", cube.id, command);
+
+        out.push_back(command);
+
+        switch (command)
+        {
+            case CMD_PING:
+                break;
+
+            case CMD_ACTIVATE:
+                if (size >= 2)
+                    cube.active = payload[1] != 0;
+                return;
+
+            case CMD_GET_ACTIVATE:
+                out.push_back(cube.active ? 3 : 0);
+                break;
+
+            case CMD_SET_INPUTS:
+                if (size >= 5)
+                {
+                    cube.inputs[0] = (short)((payload[1] << 8) | payload[2]);
+                    cube.inputs[1] = (short)((payload[3] << 8) | payload[4]);
+                }
+                return;
+
+            case CMD_GET_INPUTS:
+                putShort(out, cube.inputs[0]);
+                putShort(out, cube.inputs[1]);
+                break;
+
+            case CMD_GET_MEASUREMENTS:
+                for (int i = 0; i < NUM_OF_SENSORS; ++i)
+                    putShort(out, cube.measurement());
+                break;
+
+            case CMD_GET_CURRENTS:
+                putShort(out, cube.current());
+                putShort(out, cube.current());
+                break;
+
+            case CMD_GET_CURR_AND_MEAS:
+                putShort(out, cube.current());
+                putShort(out, cube.current());
+                for (int i = 0; i < NUM_OF_SENSORS; ++i)
+                    putShort(out, cube.measurement());
+                break;
+
+            case CMD_GET_INFO:
+            {
+                std::string info = infoString(cube);
+                out.push_back(1);    // number of pages
+                out.insert(out.end(), info.begin(), info.end());
+                out.push_back(0);
+                break;
+            }
+
+            case CMD_SET_PARAM:
+            {
+                if (size < 3)
+                    return;
+                int type = (payload[1] << 8) | payload[2];
+                std::vector<unsigned char> value(payload + 3, payload + size);
+                if (type == PARAM_ID && !value.empty())
+                    cube.id = value[0];
+                cube.params[type] = value;
+                break;
+            }
+
+            case CMD_GET_PARAM:
+            {
+                if (size < 3)
+                    return;
+                int type = (payload[1] << 8) | payload[2];
+                const std::vector<unsigned char> &value = cube.params[type];
+                out.insert(out.end(), value.begin(), value.end());
+                break;
+            }
+
+            case CMD_STORE_PARAMS:
+            case CMD_STORE_DEFAULT_PARAMS:
+            case CMD_RESTORE_PARAMS:
+            case CMD_INIT_MEM:
+            case CMD_BOOTLOADER:
+                break;
+
+            default:
+                if (verbose)
+                    fprintf(stderr, "[emulator] unknown command %d\n", command);
+                return;
+        }
+
+        if (reply)
+            send(cube.id, out);
+    }
+
+    std::string infoString(const Cube &cube) const
+    {
+        char buffer[200];
+        snprintf(buffer, sizeof(buffer),
+                 "QB cube emulator\r\nID: %d\r\nActivated: %s\r\n"
+                 "Position: %d\r\nInputs: %d %d\r\n",
+                 cube.id, cube.active ? "ON" : "OFF", cube.measurement(),
+                 cube.inputs[0], cube.inputs[1]);
+        return buffer;
+    }
+
+    void sendInfoString()
+    {
+        if (cubes_.empty())
+            return;
+        cubes_[0].update();
+        std::string info = infoString(cubes_[0]);
+        usleep(latency_us_ + wireUsec(info.size() + 1));
+        writeAll((const unsigned char *)info.c_str(), info.size() + 1);
+    }
+
+    void send(int id, const std::vector<unsigned char> &payload)
+    {
+        std::vector<unsigned char> frame;
+        frame.push_back(':');
+        frame.push_back(':');
+        frame.push_back((unsigned char)id);
+        frame.push_back((unsigned char)(payload.size() + 1));
+        frame.insert(frame.end(), payload.begin(), payload.end());
+        frame.push_back(xorChecksum(&payload[0], payload.size()));
+
+        if (noise_ > 0 && rand() < noise_ * RAND_MAX)
+        {
+            int garbage = 1 + rand() % 8;
+            for (int i = 0; i < garbage; ++i)
+                frame.insert(frame.begin(), (unsigned char)(rand() & 0xFF));
+        }
+
+        usleep(latency_us_ + wireUsec(frame.size()));
+        writeAll(&frame[0], frame.size());
+    }
+
+    void writeAll(const unsigned char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t ret = write(fd_, data, size);
+            if (ret < 0)
+            {
+                if (errno == EINTR || errno == EAGAIN)
+                    continue;
+                return;
+            }
+            data += ret;
+            size -= ret;
+        }
+    }
+};
+
+//==============================================================================
+//                                                                          main
+//==============================================================================
+
+int main(int argc, char **argv)
+{
+    const char *link_path = NULL;
+    std::string ids = "1";
+    long latency_us = 100;
+    long baud_rate = 460800;
+    double noise = 0.0;
+    double plant_hz = 0.0;
+    double plant_damping = 0.2;
+    bool plant_wrap = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:l:d:b:g:w:z:Wvh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'i': ids = optarg; break;
+            case 'l': link_path = optarg; break;
+            case 'd': latency_us = atol(optarg); break;
+            case 'b': baud_rate = atol(optarg); break;
+            case 'g': noise = atof(optarg); break;
+            case 'w': plant_hz = atof(optarg); break;
+            case 'z': plant_damping = atof(optarg); break;
+            case 'W': plant_wrap = true; break;
+            case 'v': verbose = true; break;
+            default:
+                fprintf(stderr, "Usage: %s [-i id[,id...]] [-l link] "
+                        "[-d latency_us] [-b baud] [-g noise_probability] "
+                        "[-w natural_hz] [-z damping] [-W] [-v]\n",
+                        argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) || unlockpt(master))
+    {
+        perror("posix_openpt");
+        return 1;
+    }
+
+    // keep the master side raw as well, the slave is configured by openRS485
+    struct termios options;
+    if (tcgetattr(master, &options) == 0)
+    {
+        cfmakeraw(&options);
+        tcsetattr(master, TCSANOW, &options);
+    }
+
+    const char *slave = ptsname(master);
+    printf("%s\n", slave);
+    fflush(stdout);
+
+    if (link_path)
+    {
+        unlink(link_path);
+        if (symlink(slave, link_path))
+        {
+            perror("symlink");
+            return 1;
+        }
+    }
+
+    Emulator emulator(master, latency_us, baud_rate, noise, plant_hz, plant_damping, plant_wrap);
+    char *list = strdup(ids.c_str());
+    for (char *token = strtok(list, ","); token; token = strtok(NULL, ","))
+        emulator.addCube(atoi(token));
+    free(list);
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    unsigned char buffer[512];
+    struct pollfd pfd;
+    pfd.fd = master;
+    pfd.events = POLLIN;
+
+    while (running)
+    {
+        int ret = poll(&pfd, 1, 100);
+        if (ret <= 0)
+            continue;
+
+        // no slave open (yet, or anymore): wait for a client to connect,
+        // checking again well within the host read timeout so that its
+        // first request is not missed
+        if (pfd.revents & POLLHUP)
+        {
+            usleep(1000);
+            continue;
+        }
+
+        ssize_t n = read(master, buffer, sizeof(buffer));
+        if (n > 0)
+            emulator.feed(buffer, n);
+    }
+
+    if (link_path)
+        unlink(link_path);
+    close(master);
+
+    return 0;
+}
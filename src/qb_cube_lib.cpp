@@ -40,6 +40,7 @@
 //=================================================================     includes
 
 #include <qb_cube_lib.h>
+#include <qb_cube_codec.h>
 #include <commands.h>
 #include <definitions.h>
 
@@ -54,6 +55,8 @@
     #include <errno.h>   /* Error number definitions */
     #include <termios.h> /* POSIX terminal control definitions */
     #include <sys/ioctl.h>    
+    #include <sys/uio.h>
+    #include <poll.h>
     #include <dirent.h>
     #include <sys/time.h>
     #include <time.h>
@@ -68,19 +71,92 @@
 
 //=================================================================     #defines
 
-#if (defined(_WIN32) || defined(_WIN64))
-    //#define BAUD_RATE   CBR_115200      ///< Virtual COM baud rate - WINDOWS
-    #define BAUD_RATE   460800            ///< Virtual COM baud rate - WINDOWS
-#elif (defined(__APPLE__))
-    #define BAUD_RATE   460800
-#else
-    #define BAUD_RATE   B460800         ///< Virtual COM baud rate - UNIX
+#if !(defined(_WIN32) || defined(_WIN64)) && !(defined(__APPLE__))
+    // termios2 from <asm/termbits.h>, which cannot be included together with
+    // <termios.h>. It carries the baud rate as a plain number when the BOTHER
+    // speed is set, so that any rate the adapter can generate is usable.
+    struct termios2
+    {
+        tcflag_t c_iflag;
+        tcflag_t c_oflag;
+        tcflag_t c_cflag;
+        tcflag_t c_lflag;
+        cc_t c_line;
+        cc_t c_cc[19];
+        speed_t c_ispeed;
+        speed_t c_ospeed;
+    };
+
+    #ifndef BOTHER
+        #define BOTHER 0010000
+    #endif
+    #ifndef TCGETS2
+        #define TCGETS2 _IOR('T', 0x2A, struct termios2)
+        #define TCSETS2 _IOW('T', 0x2B, struct termios2)
+    #endif
 #endif
 
 
 #define BUFFER_SIZE 500
 ///< Size of buffers that store communication packets
 
+#define READ_TIMEOUT_US 4000
+///< Time allowed to each stage (header, payload) of a package read, the
+///  whole package is given twice as much
+
+#define DISCOVERY_MIN_TIMEOUT_US 500
+///< Shortest time a discovery window waits for replies
+
+#define DISCOVERY_RTT_PINGS 3
+///< Extra round trips timed to the first device to answer a scan
+
+#define INFO_TIMEOUT_US 500000
+///< Upper bound on the time an info request waits for its reply
+
+#define INFO_IDLE_GAP_US 20000
+///< Silence that ends an info string sent without a terminator
+
+#define FLASH_TIMEOUT_US 500000
+///< Upper bound on the time a device takes to store or restore its memory
+
+#define SYNC_DRAIN_SLACK_US 16000
+///< Drain time allowed beyond the frames' own before a batch write counts as
+///  held up (USB adapters flush on a latency timer of up to 16 ms)
+
+// Statistics have a single writer, the thread owning the port, and may be
+// read from any other: relaxed atomics keep each counter consistent without
+// ordering costs. The baseline is guarded by a generation count instead,
+// odd while a reset rewrites it, which readers retry on (a seqlock).
+#if defined(__GNUC__)
+    #define STATS_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+    #define STATS_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+    #define STATS_LOAD_ACQUIRE(counter) __atomic_load_n(&(counter), __ATOMIC_ACQUIRE)
+    #define STATS_STORE_RELEASE(counter, n) __atomic_store_n(&(counter), (n), __ATOMIC_RELEASE)
+    #define STATS_CLAIM(counter, expected) \
+        __atomic_compare_exchange_n(&(counter), &(expected), (expected) + 1, false, \
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+    #define STATS_FENCE_ACQUIRE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+    #define STATS_FENCE_RELEASE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#elif (defined(_WIN32) || defined(_WIN64))
+    #define STATS_ADD(counter, n) InterlockedExchangeAdd((volatile LONG *) &(counter), (n))
+    #define STATS_LOAD(counter) (*(volatile LONG *) &(counter))
+    #define STATS_LOAD_ACQUIRE(counter) (*(volatile LONG *) &(counter))
+    #define STATS_STORE_RELEASE(counter, n) (MemoryBarrier(), (*(volatile LONG *) &(counter) = (n)))
+    #define STATS_CLAIM(counter, expected) \
+        (InterlockedCompareExchange((volatile LONG *) &(counter), (expected) + 1, (expected)) \
+         == (LONG) (expected))
+    #define STATS_FENCE_ACQUIRE() MemoryBarrier()
+    #define STATS_FENCE_RELEASE() MemoryBarrier()
+#else
+    #define STATS_ADD(counter, n) ((counter) += (n))
+    #define STATS_LOAD(counter) (counter)
+    #define STATS_LOAD_ACQUIRE(counter) (counter)
+    #define STATS_STORE_RELEASE(counter, n) ((counter) = (n))
+    #define STATS_CLAIM(counter, expected) ((counter) == (expected) && ((counter) = (expected) + 1))
+    #define STATS_FENCE_ACQUIRE()
+    #define STATS_FENCE_RELEASE()
+#endif
+
 //#define VERBOSE                 ///< Used for debugging
 
 //===========================================     public fuctions implementation
@@ -204,13 +280,55 @@ int RS485listPorts( char list_of_ports[10][255] )
     return 0;
 }
 
+#if !(defined(_WIN32) || defined(_WIN64)) && !(defined(__APPLE__))
+
+//==============================================================================
+//                                                                   baudToSpeed
+//==============================================================================
+// Maps a baud rate to its termios constant, 0 if it has none.
+//==============================================================================
+
+static speed_t baudToSpeed(int baud_rate)
+{
+    switch (baud_rate)
+    {
+        case 9600:    return B9600;
+        case 19200:   return B19200;
+        case 38400:   return B38400;
+        case 57600:   return B57600;
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+        case 460800:  return B460800;
+        case 500000:  return B500000;
+        case 576000:  return B576000;
+        case 921600:  return B921600;
+        case 1000000: return B1000000;
+        case 1152000: return B1152000;
+        case 1500000: return B1500000;
+        case 2000000: return B2000000;
+        case 2500000: return B2500000;
+        case 3000000: return B3000000;
+        default:      return 0;
+    }
+}
+
+#endif
+
 //==============================================================================
 //                                                                openRS485
 //==============================================================================
 
 
-void openRS485(comm_settings *comm_settings_t, const char *port_s)
+void openRS485(comm_settings *comm_settings_t, const char *port_s, int baud_rate)
 {
+    comm_settings_t->baud_rate = baud_rate;
+    comm_settings_t->rx_head = 0;
+    comm_settings_t->rx_tail = 0;
+    comm_settings_t->rx_skipping = 0;
+    memset(&comm_settings_t->stats, 0, sizeof(comm_stats));
+    memset(&comm_settings_t->stats_baseline, 0, sizeof(comm_stats));
+    comm_settings_t->stats_generation = 0;
+    comm_settings_t->stats_command = -1;
 
 //////////////////////////////   WINDOWS CODE   //////////////////////////////
 
@@ -237,7 +355,7 @@ void openRS485(comm_settings *comm_settings_t, const char *port_s)
     	dcb.DCBlength = sizeof (DCB); 
 
     	GetCommState(comm_settings_t->file_handle, &dcb);
-    	dcb.BaudRate  = BAUD_RATE;
+    	dcb.BaudRate  = baud_rate;        // any rate the driver supports
     	dcb.Parity    = NOPARITY;
     	dcb.StopBits  = ONESTOPBIT;
 
@@ -286,6 +404,9 @@ void openRS485(comm_settings *comm_settings_t, const char *port_s)
     #else
     
         struct termios options;
+        #if !(defined __APPLE__)
+            speed_t speed;
+        #endif
 
         comm_settings_t->file_handle = 
             open(port_s, O_RDWR | O_NOCTTY | O_NONBLOCK);
@@ -319,9 +440,15 @@ void openRS485(comm_settings *comm_settings_t, const char *port_s)
 
         }
     
-        // set baud rate
-        cfsetispeed(&options, BAUD_RATE);
-        cfsetospeed(&options, BAUD_RATE);
+        // set baud rate, non standard ones are set below through termios2
+        #if (defined __APPLE__)
+            cfsetispeed(&options, baud_rate);
+            cfsetospeed(&options, baud_rate);
+        #else
+            speed = baudToSpeed(baud_rate);
+            cfsetispeed(&options, speed ? speed : B38400);
+            cfsetospeed(&options, speed ? speed : B38400);
+        #endif
 
         // enable the receiver and set local mode
         options.c_cflag |= (CLOCAL | CREAD);
@@ -354,6 +481,26 @@ void openRS485(comm_settings *comm_settings_t, const char *port_s)
         {
             goto error;
         }
+
+        #if !(defined __APPLE__)
+            if (!speed)
+            {
+                struct termios2 options2;
+
+                if (ioctl(comm_settings_t->file_handle, TCGETS2, &options2) == -1)
+                {
+                    goto error;
+                }
+                options2.c_cflag &= ~CBAUD;
+                options2.c_cflag |= BOTHER;
+                options2.c_ispeed = baud_rate;
+                options2.c_ospeed = baud_rate;
+                if (ioctl(comm_settings_t->file_handle, TCSETS2, &options2) == -1)
+                {
+                    goto error;
+                }
+            }
+        #endif
         
         return;
 
@@ -399,675 +546,1094 @@ long timevaldiff(struct timeval *starttime, struct timeval *finishtime)
 
 
 //==============================================================================
-//                                                                     RS485read
-//==============================================================================
-// This function is used to read packets from the device.
+//                                                                 monotonicUsec
 //==============================================================================
 
-int RS485read(comm_settings *comm_settings_t, int id, char *package)
+/*
+ * Return a monotonic timestamp in microseconds, not affected by wall clock
+ * adjustments
+ */
+static long long monotonicUsec()
 {
-    unsigned char data_in[BUFFER_SIZE] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};     // output data buffer
-    unsigned int package_size = 6;
-    
-    memcpy(package, data_in, package_size);
-    
-    package[1] = 0;
-    package[2] = 0;
-    package[3] = 0;
-	package[4] = 0;
-    package[5] = 0;
-	package[6] = 0;
-
-            
-    
+#if (defined(_WIN32) || defined(_WIN64))
+    return (long long)GetTickCount64() * 1000LL;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+#endif
+}
 
-    // WINDOWS
-    #if (defined(_WIN32) || defined(_WIN64))
-        DWORD data_in_bytes = 0;
-        
-        if (!ReadFile(comm_settings_t->file_handle, data_in, 4, &data_in_bytes, NULL))
-            return -1;
-            
-        // Control ID
-        if ((id != 0) && (data_in[2] != id)) {
-        	return -1;
-        }
-        
-        package_size = data_in[3];            
- 
-        if (!ReadFile(comm_settings_t->file_handle, data_in, package_size, &data_in_bytes, NULL))
-            return -1;
-    
-    // UNIX
-    #else
-        int n_bytes;
-        struct timeval start, now;
-        
-        gettimeofday(&start, NULL);
-        gettimeofday(&now, NULL);                 
-        
-        ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);        
+//==============================================================================
+//                                                                    statsIndex
+//==============================================================================
+// Histogram slot of a command: 0-10 for the general commands, 11-17 for the
+// QB Move ones and 18 for anything else.
+//==============================================================================
 
-        while((n_bytes < 4) && ( timevaldiff(&start, &now) < 4000)) 
-        {
-            gettimeofday(&now, NULL);                 
-            ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-        }
+static int statsIndex(int command)
+{
+    if (command >= CMD_PING && command <= CMD_INIT_MEM)
+        return command - CMD_PING;
+    if (command >= CMD_ACTIVATE && command <= CMD_GET_CURR_AND_MEAS)
+        return 11 + command - CMD_ACTIVATE;
+    return COMM_STATS_COMMANDS - 1;
+}
 
-        if (!read(comm_settings_t->file_handle, data_in, 4)) {
-            return -1;
-        }
+//==============================================================================
+//                                                                   statsBucket
+//==============================================================================
 
-        // Control ID
-        if ((id != 0) && (data_in[2] != id)) {
-            return -1;
-        }
+static int statsBucket(long long usec)
+{
+    int msb = 0;
 
-            
-        package_size = data_in[3];
-        
-        gettimeofday(&start, NULL);
-        gettimeofday(&now, NULL);                 
-        
-        ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
+    if (usec < 8)
+        return usec < 0 ? 0 : (int) usec;
 
-        while((n_bytes < package_size) && ( timevaldiff(&start, &now) < 4000))
-        {
-            gettimeofday(&now, NULL);
-            ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);            
-        }
-          
-        if (!read(comm_settings_t->file_handle, data_in, package_size)) {
-            return -1;
-        }
-            
-    #endif
+    while ((usec >> (msb + 1)) != 0)
+        msb++;
+    if (msb > 31)
+        return COMM_HIST_BUCKETS - 1;
 
-    // Control checksum
-    if (checksum ( (char *) data_in, package_size - 1) != (char) data_in[package_size-1])
-    {
-       return -1;
-    }
-    
+    return 8 + (msb - 3) * 8 + (int)((usec >> (msb - 3)) & 7);
+}
 
-    #ifdef VERBOSE
-        printf("Received package size: %d \n", package_size);
-    #endif
-    
+//==============================================================================
+//                                                                   statsRecord
+//==============================================================================
 
-    memcpy(package, data_in, package_size);
-        
-    return package_size;
+static void statsRecord(comm_settings *comm_settings_t, int command, long long usec)
+{
+    commHistogramAdd(&comm_settings_t->stats.latency[statsIndex(command)], usec);
 }
 
 //==============================================================================
-//                                                              RS485ListDevices
+//                                                                      statsEnd
+//==============================================================================
+// Closes the transaction opened by RS485send, if any.
 //==============================================================================
 
-int RS485ListDevices(comm_settings *comm_settings_t, char list_of_ids[255])
+static void statsEnd(comm_settings *comm_settings_t)
 {
-        unsigned char package_in[BUFFER_SIZE];
-        int id;
-        int h = 0;
-	    unsigned char data_out[BUFFER_SIZE];		// output data buffer
-	    int n_bytes;
-
-	    #if (defined(_WIN32) || defined(_WIN64))
-	        DWORD package_size_out;					// for serial port access	
-	    #endif    
-		
-        
-         #if (defined(_WIN32) || defined(_WIN64))
-             int aux_int;
-             int z = 0;   
-          DWORD n_bytes_in;
-             COMMTIMEOUTS cts_old, cts;         // for serial port configuration
-     
-          // timeouts
-          GetCommTimeouts(comm_settings_t->file_handle, &cts_old);
-          
-             memcpy(&cts, &cts_old, sizeof(COMMTIMEOUTS));
-          
-          cts.ReadIntervalTimeout         = 0;      // msec
-          // ReadTimeout = Constant + Multiplier * Nwritten
-          cts.ReadTotalTimeoutMultiplier  = 0;      // msec
-          cts.ReadTotalTimeoutConstant    = 5;      // msec
-          // WriteTimeout = Constant + Multiplier * Nwritten
-          cts.WriteTotalTimeoutConstant   = 5;      // msec
-          cts.WriteTotalTimeoutMultiplier = 0;      // msec
-     
-          SetCommTimeouts(comm_settings_t->file_handle, &cts);    
-         #else
-             ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-             if(n_bytes)
-                 read(comm_settings_t->file_handle, package_in, n_bytes);
-         #endif
-         
-         for(id = 1; id < 255; ++id)
-         {
-            list_of_ids[id] = 0;
-		
-		    data_out[0]  = ':';
-		    data_out[1]  = ':';
-		    data_out[2] = (unsigned char) id;
-		    data_out[3]  = 2;
-	 	    data_out[4] = CMD_PING;
-	 	    data_out[5] = CMD_PING;
-			 
-    #if (defined(_WIN32) || defined(_WIN64))
-        WriteFile(comm_settings_t->file_handle, data_out, 6, &package_size_out, NULL);
-    #else
-        ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-        if(n_bytes)
-            read(comm_settings_t->file_handle, package_in, n_bytes);
-    
-        write(comm_settings_t->file_handle, data_out, 6);
-    #endif
+    if (comm_settings_t->stats_command < 0)
+        return;
 
-     
-             #if (defined(_WIN32) || defined(_WIN64))
-     
-                 n_bytes_in  = 1;
-                 aux_int     = 0;
-                 z = 0;
-             
-                 while(n_bytes_in)
-                 {
-                     ReadFile(  comm_settings_t->file_handle, 
-                                package_out, 1, &n_bytes_in, NULL);
-                     aux_int |= n_bytes_in;
-                     
-                     memcpy(package_in + z, package_out, n_bytes_in);
-                     z += n_bytes_in;
-                 }
-             
-                 if(aux_int)
-                 {
-                     list_of_ids[h] = package_in[2];
-                     h++;            
-                 }
-     
-             #else
-                 usleep(20000);
-                 ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-                 if (n_bytes >= 6)
-                 {
-                     read(comm_settings_t->file_handle, package_in, n_bytes);
-                     list_of_ids[h] = package_in[2];
-                     h++;
-                 }
-             #endif
-         }
-         
-         #if (defined(_WIN32) || defined(_WIN64))
-              SetCommTimeouts(comm_settings_t->file_handle, &cts_old);    
-     #endif
-     
-         return h;
-    
+    statsRecord(comm_settings_t, comm_settings_t->stats_command,
+                monotonicUsec() - comm_settings_t->stats_start);
+    comm_settings_t->stats_command = -1;
 }
 
-
 //==============================================================================
-//                                                                          ping
+//                                                                     RS485fill
 //==============================================================================
-// This function is used to ping the serial port for a QB Move and 
-// get information about the device. ONLY USE WHEN ONE DEVICE IS CONNECTED
-//  ONLY.
+// Appends to the read-ahead ring whatever the port has to offer, with a single
+// read() once poll() reports data. Returns the number of bytes added, 0 if
+// the deadline expired, -1 on error.
 //==============================================================================
 
-void RS485GetInfo(comm_settings *comm_settings_t, char *buffer){
-    unsigned char auxstring[3];
+static int RS485fill(comm_settings *comm_settings_t, long long deadline)
+{
+    unsigned int start = comm_settings_t->rx_tail & (RX_BUFFER_SIZE - 1);
+    unsigned int used = comm_settings_t->rx_tail - comm_settings_t->rx_head;
+    unsigned int space = RX_BUFFER_SIZE - used;
+    int ret;
+
+    // only fill up to the end of the ring, the next call wraps around
+    if (space > RX_BUFFER_SIZE - start)
+        space = RX_BUFFER_SIZE - start;
+    if (space == 0)
+        return -1;
 
-    
-#if (defined(_WIN32) || defined(_WIN64))
-    DWORD n_bytes_out;					// for serial port access
-	DWORD n_bytes_in;					// for serial port access
-    unsigned char aux;
-    int i = 0;
-#else
-    int bytes;  
-#endif	
-    
-    auxstring[0] = '?'; 
-    auxstring[1] = 13; 
-    auxstring[2] = 10; 
-        
-#if (defined(_WIN32) || defined(_WIN64))
-    WriteFile(comm_settings_t->file_handle, auxstring, 3, &n_bytes_out, NULL);
-    n_bytes_in = 1;
+    #if (defined(_WIN32) || defined(_WIN64))
+        DWORD data_in_bytes = 0;
 
-    Sleep(200);
+        (void) deadline;
+        STATS_ADD(comm_settings_t->stats.syscalls, 1);
+        if (!ReadFile(comm_settings_t->file_handle,
+                comm_settings_t->rx_buffer + start, 1, &data_in_bytes, NULL))
+            return -1;
+        ret = data_in_bytes;
+    #else
+        struct pollfd pfd;
+        long long remaining;
 
-    while(n_bytes_in)
-    {
-        ReadFile(comm_settings_t->file_handle, &aux, 1, &n_bytes_in, NULL);
-        if(n_bytes_in)
-            buffer[i] = aux;
-        i++;
-    }    
-#else
-    write(comm_settings_t->file_handle, auxstring, 3);   
-    usleep(500000);
-    ioctl(comm_settings_t->file_handle, FIONREAD, &bytes);
-    printf("BYTES: %d\n", bytes);
-    read(comm_settings_t->file_handle, buffer, bytes);
-#endif        
-    
+        pfd.fd = comm_settings_t->file_handle;
+        pfd.events = POLLIN;
+
+        for (;;)
+        {
+            remaining = deadline - monotonicUsec();
+            if (remaining <= 0)
+                return 0;
+
+            STATS_ADD(comm_settings_t->stats.syscalls, 1);
+            #if defined(__linux__)
+                struct timespec timeout;
+                timeout.tv_sec = remaining / 1000000;
+                timeout.tv_nsec = (remaining % 1000000) * 1000;
+                ret = ppoll(&pfd, 1, &timeout, NULL);
+            #else
+                // round up so that we never wake before the deadline and spin
+                ret = poll(&pfd, 1, (int)((remaining + 999) / 1000));
+            #endif
+            if (ret < 0 && errno != EINTR)
+                return -1;
+            if (ret <= 0)
+                continue;
+            if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+                return -1;
+
+            STATS_ADD(comm_settings_t->stats.syscalls, 1);
+            ret = read(comm_settings_t->file_handle,
+                       comm_settings_t->rx_buffer + start, space);
+            if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+            if (ret < 0)
+                return -1;
+            break;
+        }
+    #endif
+
+    comm_settings_t->rx_tail += ret;
+    return ret;
 }
 
 //==============================================================================
-//                                                                      commPing
+//                                                                RS485dropBytes
 //==============================================================================
 
-int commPing(comm_settings *comm_settings_t, int id)
+static void RS485dropBytes(comm_settings *comm_settings_t, unsigned int n)
 {
-        char package_out[BUFFER_SIZE];		// output data buffer
-        char package_in[BUFFER_SIZE];		// output data buffer
-        int package_in_size;
-	    int n_bytes;
-		
-		#if (defined(_WIN32) || defined(_WIN64))
-		    DWORD package_size_out;					// for serial port access	
-		#endif    
+    comm_settings_t->rx_head += n;
+    STATS_ADD(comm_settings_t->stats.bytes_drained, n);
+    comm_settings_t->rx_skipping = 1;
+}
 
-//=================================================		preparing packet to send
+#define RX_BYTE(c, i) ((c)->rx_buffer[((c)->rx_head + (i)) & (RX_BUFFER_SIZE - 1)])
 
+//==============================================================================
+//                                                               RS485parseFrame
+//==============================================================================
+// Extracts the first valid package from the ring. Bytes that cannot start a
+// package (no "::" marker, bad size or checksum) are dropped one at a time
+// until the stream is aligned again.
+// Returns the payload size, 0 if no complete package is buffered yet.
+//==============================================================================
 
-	    package_out[0]  = ':';
-	    package_out[1]  = ':';
-	    package_out[2] = (unsigned char) id;
-	    package_out[3]  = 2;
+static int RS485parseFrame(comm_settings *comm_settings_t, unsigned char *header,
+                           char *package)
+{
+    unsigned int available, package_size, i;
+    char chk;
 
+    for (;;)
+    {
+        available = comm_settings_t->rx_tail - comm_settings_t->rx_head;
 
-	    package_out[4] = CMD_PING;
-	    package_out[5] = CMD_PING;
-		
+        if (available < 2)
+            return 0;
+        if (RX_BYTE(comm_settings_t, 0) != ':' || RX_BYTE(comm_settings_t, 1) != ':')
+        {
+            RS485dropBytes(comm_settings_t, 1);
+            continue;
+        }
+        if (available < 4)
+            return 0;
 
-#if (defined(_WIN32) || defined(_WIN64))
-    WriteFile(comm_settings_t->file_handle, package_out, 6, &package_size_out, NULL);
-#else
-    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-    if(n_bytes)
-        read(comm_settings_t->file_handle, package_in, n_bytes);
+        // the payload holds at least the command and the checksum
+        package_size = RX_BYTE(comm_settings_t, 3);
+        if (package_size < 2)
+        {
+            RS485dropBytes(comm_settings_t, 1);
+            continue;
+        }
+        if (available < 4 + package_size)
+            return 0;
 
-    write(comm_settings_t->file_handle, package_out, 6);
-#endif
+        chk = 0;
+        for (i = 0; i < package_size - 1; ++i)
+            chk ^= RX_BYTE(comm_settings_t, 4 + i);
+        if (chk != (char) RX_BYTE(comm_settings_t, 4 + package_size - 1))
+        {
+            STATS_ADD(comm_settings_t->stats.checksum_failures, 1);
+            RS485dropBytes(comm_settings_t, 1);
+            continue;
+        }
 
-        package_in_size = RS485read(comm_settings_t, id, package_in);
-        if ((package_in_size == -1) || (package_in[1] != CMD_PING))
-            return -1;
+        for (i = 0; i < 4; ++i)
+            header[i] = RX_BYTE(comm_settings_t, i);
+        for (i = 0; i < package_size; ++i)
+            package[i] = RX_BYTE(comm_settings_t, 4 + i);
+        comm_settings_t->rx_head += 4 + package_size;
 
-        return 0;
-}
+        if (comm_settings_t->rx_skipping)
+        {
+            STATS_ADD(comm_settings_t->stats.resyncs, 1);
+            comm_settings_t->rx_skipping = 0;
+        }
 
+        return package_size;
+    }
+}
 
 //==============================================================================
-//                                                                  commActivate
+//                                                                RS485readFrame
 //==============================================================================
-// This function activates or deactivates the QB Move motors.
+// Reads one complete package, whatever device it comes from. The 4 header
+// bytes (":", ":", id, size) are stored in header and the payload, starting
+// with the command byte and ending with the checksum, in package.
+// Returns the payload size, -1 if nothing valid arrived before the deadline.
 //==============================================================================
 
-
-void commActivate(comm_settings *comm_settings_t, int id, char activate)
+static int RS485readFrame(comm_settings *comm_settings_t, unsigned char *header,
+                          char *package, long long deadline)
 {
-    char data_out[BUFFER_SIZE];		// output data buffer
-    char package_in[BUFFER_SIZE];
-    int n_bytes;
+    int package_size;
 
-    #if (defined(_WIN32) || defined(_WIN64))
-        DWORD package_size_out;					// for serial port access	
-    #endif    
-	
-	    data_out[0]  = ':';
-	    data_out[1]  = ':';
-	    data_out[2] = (unsigned char) id;
-	    data_out[3]  = 3;
-	    data_out[4] = CMD_ACTIVATE;                       // command
-		data_out[5] = activate ? 3 : 0; 
-		data_out[6] = checksum(data_out + 4, 2);      // checksum    
-	
-	#if (defined(_WIN32) || defined(_WIN64))
-	    WriteFile(comm_settings_t->file_handle, data_out, 7, &package_size_out, NULL);
-	#else
-	    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-	    if(n_bytes)
-	        read(comm_settings_t->file_handle, package_in, n_bytes);
-
-	    write(comm_settings_t->file_handle, data_out, 7);
-	#endif
-	
+    for (;;)
+    {
+        package_size = RS485parseFrame(comm_settings_t, header, package);
+        if (package_size > 0)
+            return package_size;
+
+        if (RS485fill(comm_settings_t, deadline) <= 0)
+            break;
+    }
+
+    // a truncated or corrupted header may hide packages behind it
+    while (comm_settings_t->rx_tail - comm_settings_t->rx_head > 1)
+    {
+        RS485dropBytes(comm_settings_t, 1);
+        package_size = RS485parseFrame(comm_settings_t, header, package);
+        if (package_size > 0)
+            return package_size;
+    }
+
+    return -1;
 }
 
 //==============================================================================
-//                                                               commGetActivate
-//==============================================================================
-// This function gets measurements from the QB Move.
+//                                                               RS485writeBytes
 //==============================================================================
 
-int commGetActivate(comm_settings *comm_settings_t, int id, char *activate){
-    char data_out[BUFFER_SIZE];		// output data buffer
-    char package_in[BUFFER_SIZE];		// output data buffer
-    int package_in_size;
-    int n_bytes;
+static int RS485writeBytes(comm_settings *comm_settings_t, const char *data, int size)
+{
+    STATS_ADD(comm_settings_t->stats.syscalls, 1);
 
     #if (defined(_WIN32) || defined(_WIN64))
-        DWORD package_size_out;					// for serial port access	
-    #endif    
-	
-
-//=================================================		preparing packet to send
-
-	
-    data_out[0]  = ':';
-    data_out[1]  = ':';
-    data_out[2] = (unsigned char) id;
-    data_out[3]  = 2;	
-    data_out[4] = CMD_GET_ACTIVATE;             // command
-    data_out[5] = CMD_GET_ACTIVATE;             // checksum
-	
-
-	#if (defined(_WIN32) || defined(_WIN64))
-	    WriteFile(comm_settings_t->file_handle, data_out, 6, &package_size_out, NULL);
-	#else
-	    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-	    if(n_bytes)
-	        read(comm_settings_t->file_handle, package_in, n_bytes);
+        DWORD package_size_out;
+        if (!WriteFile(comm_settings_t->file_handle, data, size, &package_size_out, NULL))
+            return -1;
+        return package_size_out;
+    #else
+        return write(comm_settings_t->file_handle, data, size);
+    #endif
+}
 
-	    write(comm_settings_t->file_handle, data_out, 6);
-	#endif
+//==============================================================================
+//                                                                     RS485send
+//==============================================================================
+// Sends a request package. Leftovers of previous exchanges that are already
+// buffered are dropped first, bytes still in flight are skipped by the parser.
+//==============================================================================
 
+static void RS485beginRequest(comm_settings *comm_settings_t, int command)
+{
+    unsigned int pending = comm_settings_t->rx_tail - comm_settings_t->rx_head;
 
-    package_in_size = RS485read(comm_settings_t, id, package_in);
-    if (package_in_size == -1)
-        return -1;
+    // time the transaction until statsEnd, when the reply is read
+    comm_settings_t->stats_command = command;
+    comm_settings_t->stats_start = monotonicUsec();
 
-//==============================================================	 get packet
-	
-    *activate = package_in[1];
+    if (pending)
+    {
+        comm_settings_t->rx_head = comm_settings_t->rx_tail;
+        STATS_ADD(comm_settings_t->stats.bytes_drained, pending);
+    }
+}
 
-    return 0;
+static int RS485send(comm_settings *comm_settings_t, const char *data, int size)
+{
+    RS485beginRequest(comm_settings_t, size > 4 ? (unsigned char) data[4] : -1);
+    return RS485writeBytes(comm_settings_t, data, size);
 }
 
 //==============================================================================
-//                                                               commSetInputs
+//                                                                RS485sendFixed
 //==============================================================================
-// This function send reference inputs to the qb move.
+// Sends a fixed request frame (see qbcodec::FixedFrame) straight from its
+// table: the id byte is spliced in by writev, so nothing is built or copied.
 //==============================================================================
 
-void commSetInputs(comm_settings *comm_settings_t, int id, short int inputs[2])
-{    
-    char data_out[BUFFER_SIZE];		// output data buffer
-    unsigned char package_in[BUFFER_SIZE];
-    int n_bytes;
+static int RS485sendFixed(comm_settings *comm_settings_t, int id, const char *frame)
+{
+    RS485beginRequest(comm_settings_t, (unsigned char) frame[4]);
 
     #if (defined(_WIN32) || defined(_WIN64))
-        DWORD package_size_out;					// for serial port access	
-    #endif    
+        char data_out[6];
+
+        memcpy(data_out, frame, 6);
+        data_out[2] = (unsigned char) id;
+        return RS485writeBytes(comm_settings_t, data_out, 6);
+    #else
+        unsigned char id_byte = (unsigned char) id;
+        struct iovec iov[3];
+
+        iov[0].iov_base = (void *) frame;           // "::"
+        iov[0].iov_len = 2;
+        iov[1].iov_base = &id_byte;
+        iov[1].iov_len = 1;
+        iov[2].iov_base = (void *) (frame + 3);     // size, command, checksum
+        iov[2].iov_len = 3;
+
+        STATS_ADD(comm_settings_t->stats.syscalls, 1);
+        return writev(comm_settings_t->file_handle, iov, 3);
+    #endif
+}
 
+//==============================================================================
+//                                                                RS485readUntil
+//==============================================================================
+// Reads the next package from device id, returning as soon as it is complete
+// or -1 once the deadline expires.
+//==============================================================================
 
-    data_out[0]  = ':';
-    data_out[1]  = ':';
-    data_out[2] = (unsigned char) id;
-    data_out[3]  = 6;
+static int RS485readUntil(comm_settings *comm_settings_t, int id, char *package,
+                          long long deadline)
+{
+    unsigned char header[4];
+    int package_size;
 
+    for (;;)
+    {
+        package_size = RS485readFrame(comm_settings_t, header, package, deadline);
+        if (package_size == -1)
+        {
+            // timeouts are counted, not mixed with the latencies
+            STATS_ADD(comm_settings_t->stats.timeouts, 1);
+            comm_settings_t->stats_command = -1;
+            return -1;
+        }
 
-    data_out[4] = CMD_SET_INPUTS;                // command
-    data_out[5] = ((char *) &inputs[0])[1];
-    data_out[6] = ((char *) &inputs[0])[0];
-    data_out[7] = ((char *) &inputs[1])[1];
-    data_out[8] = ((char *) &inputs[1])[0];
-    data_out[9] = checksum(data_out + 4, 5);   // checksum    
+        // Control ID, late replies from other devices are skipped
+        if ((id == 0) || (header[2] == id))
+            break;
+        STATS_ADD(comm_settings_t->stats.id_mismatches, 1);
+    }
 
-	#if (defined(_WIN32) || defined(_WIN64))
-	    WriteFile(comm_settings_t->file_handle, data_out, 10, &package_size_out, NULL);
-	#else
-	    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-	    if(n_bytes)
-	        read(comm_settings_t->file_handle, package_in, n_bytes);
+    statsEnd(comm_settings_t);
 
-	    write(comm_settings_t->file_handle, data_out, 10);
-	#endif
+    #ifdef VERBOSE
+        printf("Received package size: %d \n", package_size);
+    #endif
 
+    return package_size;
 }
 
 //==============================================================================
-//                                                                 commGetInputs
+//                                                                     RS485read
 //==============================================================================
-// This function gets input references from the QB Move.
+// This function is used to read packets from the device.
 //==============================================================================
 
-int commGetInputs(comm_settings *comm_settings_t, int id, short int inputs[2]){
+int RS485read(comm_settings *comm_settings_t, int id, char *package)
+{
+    return RS485readUntil(comm_settings_t, id, package,
+                          monotonicUsec() + 2 * READ_TIMEOUT_US);
+}
 
-    char data_out[BUFFER_SIZE];		// output data buffer
-    char package_in[BUFFER_SIZE];		// output data buffer
-    int package_in_size;
-    int n_bytes;
+//==============================================================================
+//                                                                      transact
+//==============================================================================
+// Sends the request of message M and, if M has one, waits for its reply and
+// decodes it. Frame layout and sizes come from qb_cube_codec.h; requests
+// without arguments are sent from their constant frame.
+//==============================================================================
 
-    #if (defined(_WIN32) || defined(_WIN64))
-        DWORD package_size_out;					// for serial port access	
-    #endif    
-	
+template <class M, class Request = typename M::Request>
+struct RequestSender
+{
+    static int send(comm_settings *comm_settings_t, int id, const Request &request)
+    {
+        char data_out[M::FRAME_SIZE];
 
-//=================================================		preparing packet to send
-	
-    data_out[0]  = ':';
-    data_out[1]  = ':';
-    data_out[2] = (unsigned char) id;
-    data_out[3]  = 2;
-    data_out[4] = CMD_GET_INPUTS;             // command
-    data_out[5] = CMD_GET_INPUTS;             // checksum
-	
-    
-
-	#if (defined(_WIN32) || defined(_WIN64))
-	    WriteFile(comm_settings_t->file_handle, data_out, 6, &package_size_out, NULL);
-	#else
-	    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-	    if(n_bytes)
-	        read(comm_settings_t->file_handle, package_in, n_bytes);
+        qbcodec::encode<M>(data_out, id, request);
+        return RS485send(comm_settings_t, data_out, M::FRAME_SIZE);
+    }
+};
 
-	    write(comm_settings_t->file_handle, data_out, 6);
-	#endif
+// requests without arguments go out from their constant frame
+template <class M>
+struct RequestSender<M, qbcodec::Empty>
+{
+    static int send(comm_settings *comm_settings_t, int id, const qbcodec::Empty &)
+    {
+        return RS485sendFixed(comm_settings_t, id, qbcodec::FixedFrame<M>::bytes);
+    }
+};
 
+template <class M>
+static int transact(comm_settings *comm_settings_t, int id,
+                    const typename M::Request &request, typename M::Reply &reply,
+                    long long timeout_us = 2 * READ_TIMEOUT_US)
+{
+    char package_in[COMM_PACKAGE_SIZE];
+    int package_in_size;
 
+    RequestSender<M>::send(comm_settings_t, id, request);
 
-    package_in_size = RS485read(comm_settings_t, id, package_in);
-    if (package_in_size == -1)
-            return -1;
+    if (!M::HAS_REPLY)
+    {
+        statsEnd(comm_settings_t);              // no reply, time the write
+        return 0;
+    }
 
-//==============================================================	 get packet
-	
-	
-    ((char *) &inputs[0])[0] = package_in[2];
-    ((char *) &inputs[0])[1] = package_in[1];
-    
-    ((char *) &inputs[1])[0] = package_in[4];
-    ((char *) &inputs[1])[1] = package_in[3];
-	
+    package_in_size = RS485readUntil(comm_settings_t, id, package_in,
+                                     monotonicUsec() + timeout_us);
+    if (package_in_size == -1 ||
+        !qbcodec::decode<M>(package_in, package_in_size, reply))
+        return -1;
 
     return 0;
 }
 
 //==============================================================================
-//                                                          commGetMeasurements
+//                                                                  commPipeline
 //==============================================================================
-// This function gets measurements from the QB Move.
+// Keeps up to window requests in flight and matches replies back by device id
+// and command byte.
 //==============================================================================
 
-int commGetMeasurements(comm_settings *comm_settings_t, int id, short int measurements[]){
-
-    char data_out[BUFFER_SIZE];		// output data buffer
-    char package_in[BUFFER_SIZE];		// output data buffer
+int commPipeline(comm_settings *comm_settings_t, comm_transaction *transactions,
+                 int num_of_transactions, int window)
+{
+    char data_out[BUFFER_SIZE];
+    char package_in[BUFFER_SIZE];
+    unsigned char header[4];
     int package_in_size;
-    int n_bytes;
+    int next = 0;           // next transaction to send
+    int oldest = 0;         // oldest transaction possibly still in flight
+    int in_flight = 0;
+    int answered = 0;
+    long long start = monotonicUsec();
+    int i;
+
+    if (window < 1)
+        window = 1;
+
+    for (i = 0; i < num_of_transactions; ++i)
+    {
+        transactions[i].package_in_size = -1;
+        transactions[i].latency_us = -1;
+    }
+
+    while (next < num_of_transactions || in_flight > 0)
+    {
+        // fill the window
+        while (in_flight < window && next < num_of_transactions)
+        {
+            comm_transaction *t = &transactions[next++];
+
+            // a size the payload array cannot hold is not sent at all; it
+            // stays unanswered and never counts as in flight
+            if (t->payload_size < 0 || t->payload_size > COMM_PAYLOAD_SIZE ||
+                !qbcodec::putHeader(data_out, t->id, t->command, t->payload_size))
+                continue;
+            memcpy(data_out + 5, t->payload, t->payload_size);
+            data_out[5 + t->payload_size] = checksum(data_out + 4, 1 + t->payload_size);
+
+            RS485writeBytes(comm_settings_t, data_out, 6 + t->payload_size);
+            t->latency_us = (long)(monotonicUsec() - start);     // sent at
+            in_flight++;
+        }
+
+        package_in_size = RS485readFrame(comm_settings_t, header, package_in,
+                                         monotonicUsec() + 2 * READ_TIMEOUT_US);
+
+        if (package_in_size == -1)
+        {
+            // nothing more is coming for the oldest request, give up on it;
+            // answered, given up and rejected requests are not in flight
+            while (oldest < next && (transactions[oldest].package_in_size != -1 ||
+                                     transactions[oldest].latency_us < 0))
+                oldest++;
+            if (oldest < next)
+            {
+                transactions[oldest].latency_us = -1;
+                STATS_ADD(comm_settings_t->stats.timeouts, 1);
+                oldest++;
+                in_flight--;
+            }
+            continue;
+        }
+
+        // match the reply with the first pending request it answers
+        for (i = oldest; i < next; ++i)
+        {
+            comm_transaction *t = &transactions[i];
+
+            if (t->package_in_size == -1 && t->latency_us >= 0 && t->id == header[2] &&
+                t->command == (unsigned char) package_in[0])
+            {
+                memcpy(t->package_in, package_in, package_in_size);
+                t->package_in_size = package_in_size;
+                t->latency_us = (long)(monotonicUsec() - start) - t->latency_us;
+                statsRecord(comm_settings_t, t->command, t->latency_us);
+                in_flight--;
+                answered++;
+                break;
+            }
+        }
+    }
+
+    return answered;
+}
+
+//==============================================================================
+//                                                   commPipelineGetMeasurements
+//==============================================================================
+
+int commPipelineGetMeasurements(comm_settings *comm_settings_t, const int *ids,
+                                int num_of_devices,
+                                short int measurements[][NUM_OF_SENSORS],
+                                int *status, int window)
+{
+    comm_transaction transactions[255];
+    int answered;
+    int i;
+
+    if (num_of_devices > 255)
+        num_of_devices = 255;
+
+    for (i = 0; i < num_of_devices; ++i)
+    {
+        transactions[i].id = ids[i];
+        transactions[i].command = CMD_GET_MEASUREMENTS;
+        transactions[i].payload_size = 0;
+    }
+
+    answered = commPipeline(comm_settings_t, transactions, num_of_devices, window);
+
+    for (i = 0; i < num_of_devices; ++i)
+    {
+        status[i] = transactions[i].package_in_size == -1 ? -1 : 0;
+        if (status[i])
+            continue;
+
+        qbcodec::GetMeasurements::Reply reply;
+        if (!qbcodec::decode<qbcodec::GetMeasurements>(transactions[i].package_in,
+                                                       transactions[i].package_in_size, reply))
+        {
+            status[i] = -1;
+            answered--;
+            continue;
+        }
+        memcpy(measurements[i], reply.values, sizeof(reply.values));
+    }
+
+    return answered;
+}
+
+//==============================================================================
+//                                                         RS485DiscoverDevices
+//==============================================================================
+// Pings the bus in windows of back-to-back requests and collects the replies
+// until a deadline derived from the round trip times observed so far.
+//==============================================================================
+
+// Sends CMD_PING to every id in ids (up to window of them at a time) and marks
+// the ones answering in found. rtt is the shortest round trip seen so far:
+// late replies (scheduling, adapter latency) only ever make samples longer.
+// timed counts the samples taken during the scan.
+static void RS485pingWindowed(comm_settings *comm_settings_t, const int *ids,
+                              int num_of_ids, int window, char found[256],
+                              long long *rtt, int *timed)
+{
+    char data_out[6 * 255];
+    char package_in[BUFFER_SIZE];
+    unsigned char header[4];
+    long long sent, deadline, sample, line_time;
+    unsigned long discarded;
+    int first, i, n, pending, timed_id;
+
+    if (num_of_ids < 1)
+        return;
+
+    // no reply to this window comes back faster than ping and reply take on
+    // the line, anything quicker is a late one to an earlier window
+    line_time = 2 * qbcodec::Ping::FRAME_SIZE * 10 * 1000000LL / comm_settings_t->baud_rate;
+
+    for (first = 0; first < num_of_ids; first += window)
+    {
+        n = num_of_ids - first < window ? num_of_ids - first : window;
+
+        for (i = 0; i < n; ++i)
+        {
+            qbcodec::encodeFixed<qbcodec::Ping>(data_out + qbcodec::Ping::FRAME_SIZE * i,
+                                                ids[first + i]);
+        }
+
+        discarded = comm_settings_t->stats.bytes_drained;
+        RS485send(comm_settings_t, data_out, qbcodec::Ping::FRAME_SIZE * n);
+        sent = monotonicUsec();
+
+        // the window is over once every id answered or the slowest plausible
+        // reply had time to arrive
+        deadline = sent + (n - 1) * (*rtt) / 2 + 2 * (*rtt);
+        if (deadline - sent < DISCOVERY_MIN_TIMEOUT_US)
+            deadline = sent + DISCOVERY_MIN_TIMEOUT_US;
+
+        pending = n;
+        timed_id = -1;
+        while (pending > 0 &&
+               RS485readFrame(comm_settings_t, header, package_in, deadline) > 0)
+        {
+            if (package_in[0] != CMD_PING || found[header[2]])
+                continue;
+
+            for (i = 0; i < n; ++i)
+            {
+                if (ids[first + i] == header[2])
+                {
+                    found[header[2]] = 1;
+                    pending--;
+
+                    // the first reply of a window is the cleanest RTT sample
+                    sample = monotonicUsec() - sent;
+                    if (pending == n - 1 && sample >= line_time)
+                    {
+                        if (sample < *rtt)
+                            *rtt = sample;
+                        if (!(*timed)++)
+                            timed_id = header[2];
+                    }
+                    break;
+                }
+            }
+        }
+
+        // replies garbled by overlapping traffic: ask the silent ids again
+        if (n > 1 && comm_settings_t->stats.bytes_drained != discarded)
+        {
+            int retry[255];
+            int num_of_retries = 0;
+
+            for (i = 0; i < n; ++i)
+                if (!found[ids[first + i]])
+                    retry[num_of_retries++] = ids[first + i];
+
+            RS485pingWindowed(comm_settings_t, retry, num_of_retries, 1, found, rtt, timed);
+        }
+
+        // the estimate only ever comes down and silent windows never sample
+        // it, so a late first reply would stretch the whole scan: time a few
+        // more round trips to the device that gave it and keep the fastest
+        if (timed_id >= 0)
+        {
+            for (i = 0; i < DISCOVERY_RTT_PINGS; ++i)
+            {
+                found[timed_id] = 0;
+                RS485pingWindowed(comm_settings_t, &timed_id, 1, 1, found, rtt, timed);
+            }
+            found[timed_id] = 1;
+        }
+    }
+}
+
+int RS485DiscoverDevices(comm_settings *comm_settings_t, char list_of_ids[255],
+                         const char *known_ids, int num_of_known, int window)
+{
+    char found[256];
+    int ids[255] = { 0 };
+    int num_of_ids = 0;
+    long long rtt = READ_TIMEOUT_US;      // until the first reply is timed
+    int timed = 0;
+    int id, i, h = 0;
 
     #if (defined(_WIN32) || defined(_WIN64))
-        DWORD package_size_out;					// for serial port access	
-    #endif    
+        COMMTIMEOUTS cts_old, cts;
+
+        // short read timeouts, or each silent id would cost the default 100 ms
+        GetCommTimeouts(comm_settings_t->file_handle, &cts_old);
+        memcpy(&cts, &cts_old, sizeof(COMMTIMEOUTS));
+        cts.ReadTotalTimeoutConstant    = 1;      // msec
+        cts.WriteTotalTimeoutConstant   = 5;      // msec
+        SetCommTimeouts(comm_settings_t->file_handle, &cts);
+    #endif
 
-//=================================================		preparing packet to send
-	
-    data_out[0]  = ':';
-    data_out[1]  = ':';
-    data_out[2] = (unsigned char) id;
-    data_out[3]  = 2;
-    data_out[4] = CMD_GET_MEASUREMENTS;             // command
-    data_out[5] = CMD_GET_MEASUREMENTS;             // checksum
-	
+    if (window < 1)
+        window = 1;
+    if (window > 255)
+        window = 255;
 
-	#if (defined(_WIN32) || defined(_WIN64))
-	    WriteFile(comm_settings_t->file_handle, data_out, 6, &package_size_out, NULL);
-	#else
-	    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-	    if(n_bytes)
-	        read(comm_settings_t->file_handle, package_in, n_bytes);
+    memset(found, 0, sizeof(found));
 
-	    write(comm_settings_t->file_handle, data_out, 6);
-	#endif
+    // last known devices first, they also give a first RTT estimate
+    for (i = 0; i < num_of_known; ++i)
+    {
+        id = (unsigned char) known_ids[i];
+        if (id != BROADCAST_ID && id != 255)
+            ids[num_of_ids++] = id;
+    }
+    RS485pingWindowed(comm_settings_t, ids, num_of_ids, window, found, &rtt, &timed);
 
+    for (i = 0; i < num_of_ids; ++i)
+        if (found[ids[i]])
+            list_of_ids[h++] = ids[i];
 
-    package_in_size = RS485read(comm_settings_t, id, package_in);
-    if (package_in_size == -1)
-        return -1;
+    // then the rest of the bus
+    num_of_ids = 0;
+    for (id = 1; id < 255; ++id)
+    {
+        for (i = 0; i < num_of_known; ++i)
+            if ((unsigned char) known_ids[i] == id)
+                break;
+        if (i == num_of_known)
+            ids[num_of_ids++] = id;
+    }
+    RS485pingWindowed(comm_settings_t, ids, num_of_ids, window, found, &rtt, &timed);
 
-//==============================================================	 get packet
-	
-    ((char *) &measurements[0])[0] = package_in[2];
-    ((char *) &measurements[0])[1] = package_in[1];
-    
-    ((char *) &measurements[1])[0] = package_in[4];
-    ((char *) &measurements[1])[1] = package_in[3];
-    
-    ((char *) &measurements[2])[0] = package_in[6];
-    ((char *) &measurements[2])[1] = package_in[5];
+    for (i = 0; i < num_of_ids; ++i)
+        if (found[ids[i]])
+            list_of_ids[h++] = ids[i];
 
-    #if NUM_OF_SENSORS == 4
-        ((char *) &measurements[3])[0] = package_in[8];
-        ((char *) &measurements[3])[1] = package_in[7];
+    #if (defined(_WIN32) || defined(_WIN64))
+        SetCommTimeouts(comm_settings_t->file_handle, &cts_old);
     #endif
-	
 
+    return h;
+}
+
+//==============================================================================
+//                                                              RS485ListDevices
+//==============================================================================
+
+int RS485ListDevices(comm_settings *comm_settings_t, char list_of_ids[255])
+{
+    return RS485DiscoverDevices(comm_settings_t, list_of_ids, NULL, 0, 1);
+}
+
+//==============================================================================
+//                                                          RS485ProbeThroughput
+//==============================================================================
+// Times back to back CMD_GET_MEASUREMENTS round trips. A request is 6 bytes on
+// the wire and its reply 6 plus the measurements.
+//==============================================================================
+
+int RS485ProbeThroughput(comm_settings *comm_settings_t, int id,
+                         int num_of_round_trips, float *bytes_per_second,
+                         float *round_trips_per_second)
+{
+    short int measurements[NUM_OF_SENSORS];
+    long long bytes = 0;
+    long long start, elapsed;
+    int answered = 0;
+    int i;
+
+    start = monotonicUsec();
+    for (i = 0; i < num_of_round_trips; ++i)
+    {
+        bytes += 6;
+        if (commGetMeasurements(comm_settings_t, id, measurements) == 0)
+        {
+            bytes += 6 + 2 * NUM_OF_SENSORS;
+            answered++;
+        }
+    }
+    elapsed = monotonicUsec() - start;
+
+    if (elapsed <= 0)
+        elapsed = 1;
+    *bytes_per_second = bytes * 1e6f / elapsed;
+    *round_trips_per_second = answered * 1e6f / elapsed;
+
+    return answered ? answered : -1;
+}
+
+
+//==============================================================================
+//                                                                  RS485GetInfo
+//==============================================================================
+// This function is used to ping the serial port for a QB Move and 
+// get information about the device. ONLY USE WHEN ONE DEVICE IS CONNECTED
+//  ONLY.
+// The reply is a plain string: it ends at its terminating null byte or, for
+// firmwares that do not send one, once the line stays quiet for
+// INFO_IDLE_GAP_US. Returns the string length, -1 if nothing arrived.
+//==============================================================================
+
+int RS485GetInfo(comm_settings *comm_settings_t, char *buffer){
+    char auxstring[3];
+    long long deadline = monotonicUsec() + INFO_TIMEOUT_US;
+    long long wait_until;
+    int size = 0;
+    char c;
+
+    auxstring[0] = '?'; 
+    auxstring[1] = 13; 
+    auxstring[2] = 10; 
+
+    RS485send(comm_settings_t, auxstring, 3);
+
+    for (;;)
+    {
+        while (comm_settings_t->rx_tail != comm_settings_t->rx_head)
+        {
+            c = RX_BYTE(comm_settings_t, 0);
+            comm_settings_t->rx_head++;
+            if (c == '\0')
+            {
+                buffer[size] = '\0';
+                return size;
+            }
+            buffer[size++] = c;
+            if (size == BUFFER_SIZE - 1)
+            {
+                buffer[size] = '\0';
+                return size;
+            }
+        }
+
+        wait_until = deadline;
+        if (size && monotonicUsec() + INFO_IDLE_GAP_US < deadline)
+            wait_until = monotonicUsec() + INFO_IDLE_GAP_US;
+
+        if (RS485fill(comm_settings_t, wait_until) <= 0)
+            break;
+    }
+
+    buffer[size] = '\0';
+    return size ? size : -1;
+}
+
+//==============================================================================
+//                                                                      commPing
+//==============================================================================
+
+int commPing(comm_settings *comm_settings_t, int id)
+{
+    qbcodec::Ping::Reply reply;
+
+    return transact<qbcodec::Ping>(comm_settings_t, id, qbcodec::Empty(), reply);
+}
+
+
+//==============================================================================
+//                                                                  commActivate
+//==============================================================================
+// This function activates or deactivates the QB Move motors.
+//==============================================================================
+
+
+void commActivate(comm_settings *comm_settings_t, int id, char activate)
+{
+    qbcodec::Activate::Reply reply;
+
+    transact<qbcodec::Activate>(comm_settings_t, id,
+                                qbcodec::Byte(activate ? 3 : 0), reply);
+}
+
+//==============================================================================
+//                                                               commGetActivate
+//==============================================================================
+// This function gets measurements from the QB Move.
+//==============================================================================
+
+int commGetActivate(comm_settings *comm_settings_t, int id, char *activate){
+    qbcodec::GetActivate::Reply reply;
+
+    if (transact<qbcodec::GetActivate>(comm_settings_t, id, qbcodec::Empty(), reply))
+        return -1;
+
+    *activate = reply.value;
     return 0;
 }
 
 //==============================================================================
-//                                                          commGetCurrents
+//                                                               commSetInputs
 //==============================================================================
-// This function gets currents from the QB Move.
+// This function send reference inputs to the qb move.
 //==============================================================================
 
-int commGetCurrents(comm_settings *comm_settings_t, int id, short int currents[2]){
+void commSetInputs(comm_settings *comm_settings_t, int id, short int inputs[2])
+{    
+    qbcodec::SetInputs::Request request;
+    qbcodec::SetInputs::Reply reply;
 
-    char data_out[BUFFER_SIZE];         // output data buffer
-    char package_in[BUFFER_SIZE];       // output data buffer
-    int package_in_size;
-    int n_bytes;
+    memcpy(request.values, inputs, sizeof(request.values));
+    transact<qbcodec::SetInputs>(comm_settings_t, id, request, reply);
+}
 
-    #if (defined(_WIN32) || defined(_WIN64))
-        DWORD package_size_out;					// for serial port access	
-    #endif    
-	
+//==============================================================================
+//                                                            commSetInputsBatch
+//==============================================================================
+// Sends the inputs of several devices with a single write.
+//==============================================================================
 
-//=================================================		preparing packet to send
+int commSetInputsBatch(comm_settings *comm_settings_t, int num_of_devices,
+                       const int *ids, short int inputs[][NUM_OF_MOTORS],
+                       long *wire_time_us)
+{
+    char data_out[qbcodec::SetInputs::FRAME_SIZE * 255];
+    qbcodec::SetInputs::Request request;
+    long long start;
+    int size = 0;
+    int written;
+    int i;
 
-    data_out[0] = ':';
-    data_out[1] = ':';
-    data_out[2] = (unsigned char) id;
-    data_out[3] = 2;
-    data_out[4] = CMD_GET_CURRENTS;             // command
-    data_out[5] = CMD_GET_CURRENTS;             // checksum
+    if (num_of_devices < 1 || num_of_devices > 255)
+        return -1;
 
-	#if (defined(_WIN32) || defined(_WIN64))
-	    WriteFile(comm_settings_t->file_handle, data_out, 6, &package_size_out, NULL);
-	#else
-	    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-	    if(n_bytes)
-	        read(comm_settings_t->file_handle, package_in, n_bytes);
+    for (i = 0; i < num_of_devices; ++i)
+    {
+        memcpy(request.values, inputs[i], sizeof(request.values));
+        size += qbcodec::encode<qbcodec::SetInputs>(data_out + size, ids[i], request);
+    }
 
-	    write(comm_settings_t->file_handle, data_out, 6);
-	#endif
+    start = monotonicUsec();
+    written = RS485send(comm_settings_t, data_out, size);
+    statsEnd(comm_settings_t);              // no reply, time the write
 
+    if (wire_time_us)
+    {
+        STATS_ADD(comm_settings_t->stats.syscalls, 1);
+        #if (defined(_WIN32) || defined(_WIN64))
+            FlushFileBuffers(comm_settings_t->file_handle);
+        #else
+            tcdrain(comm_settings_t->file_handle);
+        #endif
+        *wire_time_us = (long)(monotonicUsec() - start);
+    }
 
-    package_in_size = RS485read(comm_settings_t, id, package_in);
-    if (package_in_size == -1)
+    return written == size ? written : -1;
+}
+
+//==============================================================================
+//                                                             commSetInputsSync
+//==============================================================================
+// Sets the inputs of several devices as close to the same instant as the line
+// allows: one broadcast frame when it can be used, a single batch otherwise.
+//==============================================================================
+
+int commSetInputsSync(comm_settings *comm_settings_t, int num_of_devices,
+                      const int *ids, short int inputs[][NUM_OF_MOTORS],
+                      int whole_bus, long *skew_us)
+{
+    long wire_time_us = 0;
+    long long frame_time_us;
+    long line_time_us;
+    int same = 1;
+    int i;
+
+    if (num_of_devices < 1 || num_of_devices > 255)
         return -1;
-//==============================================================	 get packet
 
-    ((char *) &currents[0])[0] = package_in[2];
-    ((char *) &currents[0])[1] = package_in[1];
-    
-    ((char *) &currents[1])[0] = package_in[4];
-    ((char *) &currents[1])[1] = package_in[3];
+    for (i = 1; i < num_of_devices && same; ++i)
+        same = !memcmp(inputs[i], inputs[0], sizeof(inputs[0]));
+
+    // every device latches the same frame, there is nothing to skew
+    if (same && whole_bus && num_of_devices > 1)
+    {
+        int broadcast_id = BROADCAST_ID;
+        if (commSetInputsBatch(comm_settings_t, 1, &broadcast_id, inputs, NULL) < 0)
+            return -1;
+        if (skew_us)
+            *skew_us = 0;
+        return 1;
+    }
+
+    if (commSetInputsBatch(comm_settings_t, num_of_devices, ids, inputs,
+                           skew_us ? &wire_time_us : NULL) < 0)
+        return -1;
 
+    if (!skew_us)
+        return 0;
 
+    // the frames are not timed one by one: back to back, the last device gets
+    // its frame (n - 1) frame times after the first, and the whole batch left
+    // within the drain time, which bounds the spacing from above
+    frame_time_us = qbcodec::SetInputs::FRAME_SIZE * 10 * 1000000LL / comm_settings_t->baud_rate;
+    line_time_us = (long)((num_of_devices - 1) * frame_time_us);
+    if (wire_time_us > 2 * num_of_devices * frame_time_us + SYNC_DRAIN_SLACK_US)
+    {
+        // the drain waited on something else (earlier output, a preempted
+        // thread) and bounds nothing, only the nominal spacing is known
+        *skew_us = line_time_us;
+        return 2;
+    }
+
+    *skew_us = wire_time_us * (num_of_devices - 1) / num_of_devices;
+    if (*skew_us < line_time_us)
+        *skew_us = line_time_us;
     return 0;
 }
 
-
 //==============================================================================
-//                                                            commGetCurrAndMeas
+//                                                                 commGetInputs
 //==============================================================================
-// This function gets currents and measurements from the QB Move.
+// This function gets input references from the QB Move.
 //==============================================================================
 
-int commGetCurrAndMeas( comm_settings *comm_settings_t,
-                        int id,
-                        short int *values) {
+int commGetInputs(comm_settings *comm_settings_t, int id, short int inputs[2]){
+    qbcodec::GetInputs::Reply reply;
 
-    char data_out[BUFFER_SIZE];     // output data buffer
-    char package_in[BUFFER_SIZE];       // output data buffer
-    int package_in_size;
-    int n_bytes;
+    if (transact<qbcodec::GetInputs>(comm_settings_t, id, qbcodec::Empty(), reply))
+        return -1;
 
-    #if (defined(_WIN32) || defined(_WIN64))
-        DWORD package_size_out;                 // for serial port access   
-    #endif
+    memcpy(inputs, reply.values, sizeof(reply.values));
+    return 0;
+}
 
-    //=================================================     preparing packet to send
+//==============================================================================
+//                                                          commGetMeasurements
+//==============================================================================
+// This function gets measurements from the QB Move.
+//==============================================================================
 
-    
-    data_out[0] = ':';
-    data_out[1] = ':';
-    data_out[2] = (unsigned char) id;
-    data_out[3] = 2;   
-    data_out[4] = CMD_GET_CURR_AND_MEAS;             // command
-    data_out[5] = CMD_GET_CURR_AND_MEAS;             // checksum
+int commGetMeasurements(comm_settings *comm_settings_t, int id, short int measurements[]){
+    qbcodec::GetMeasurements::Reply reply;
 
+    if (transact<qbcodec::GetMeasurements>(comm_settings_t, id, qbcodec::Empty(), reply))
+        return -1;
 
-    #if (defined(_WIN32) || defined(_WIN64))
-        WriteFile(comm_settings_t->file_handle, data_out, 6, &package_size_out, NULL);
-    #else
-        ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-        if(n_bytes)
-            read(comm_settings_t->file_handle, package_in, n_bytes);
+    memcpy(measurements, reply.values, sizeof(reply.values));
+    return 0;
+}
 
-        write(comm_settings_t->file_handle, data_out, 6);
-    #endif
+//==============================================================================
+//                                                          commGetCurrents
+//==============================================================================
+// This function gets currents from the QB Move.
+//==============================================================================
 
-    package_in_size = RS485read(comm_settings_t, id, package_in);
-    if (package_in_size == -1)
+int commGetCurrents(comm_settings *comm_settings_t, int id, short int currents[2]){
+    qbcodec::GetCurrents::Reply reply;
+
+    if (transact<qbcodec::GetCurrents>(comm_settings_t, id, qbcodec::Empty(), reply))
         return -1;
 
-    //==============================================================     get packet
+    memcpy(currents, reply.values, sizeof(reply.values));
+    return 0;
+}
 
-    // Currents
-    ((char *) &values[0])[0] = package_in[2];
-    ((char *) &values[0])[1] = package_in[1];
-    
-    ((char *) &values[1])[0] = package_in[4];
-    ((char *) &values[1])[1] = package_in[3];
 
-    // Measurements
-    ((char *) &values[2])[0] = package_in[6];
-    ((char *) &values[2])[1] = package_in[5];
+//==============================================================================
+//                                                            commGetCurrAndMeas
+//==============================================================================
+// This function gets currents and measurements from the QB Move.
+//==============================================================================
 
-    ((char *) &values[3])[0] = package_in[8];
-    ((char *) &values[3])[1] = package_in[7];
+int commGetCurrAndMeas( comm_settings *comm_settings_t,
+                        int id,
+                        short int *values) {
+    qbcodec::GetCurrAndMeas::Reply reply;
 
-    ((char *) &values[4])[0] = package_in[10];
-    ((char *) &values[4])[1] = package_in[9];
+    // currents first, then measurements
+    if (transact<qbcodec::GetCurrAndMeas>(comm_settings_t, id, qbcodec::Empty(), reply))
+        return -1;
 
+    memcpy(values, reply.values, sizeof(reply.values));
     return 0;
 }
 
@@ -1079,100 +1645,42 @@ int commGetCurrAndMeas( comm_settings *comm_settings_t,
 
 int commGetInfo(comm_settings *comm_settings_t, int id, unsigned char info_type, char *info){
 
-    char data_out[BUFFER_SIZE];			// output data buffer
-    char package_in[BUFFER_SIZE];		// output data buffer
-    int n_bytes;	
+    char data_out[qbcodec::GetInfo::FRAME_SIZE];
+    char package_in[COMM_PACKAGE_SIZE];
     int package_in_size;
-    unsigned char num_of_pages;
-    char aux_string[256];
-    int i;
-	
-	#if (defined(_WIN32) || defined(_WIN64))
-	    DWORD package_size_out;					// for serial port access	
-	#endif    
-	
+    unsigned char num_of_pages = 1;
+    int info_size = 0;
+    int i, j;
 
-    strcpy(aux_string, "");
     strcpy(info, "");    
 
-//=================================================		preparing packet to send
-
-    data_out[0]  = ':';
-    data_out[1]  = ':';
-    data_out[2] = (unsigned char) id;
-    data_out[3]  = 5;
-    data_out[4] = CMD_GET_INFO;                        // command
-    data_out[5] = ((unsigned char *) &info_type)[1];   // parameter type
-    data_out[6] = ((unsigned char *) &info_type)[0];   // parameter type
-    data_out[7] = 0;    
-    data_out[8] = checksum(data_out + 4, 4);           // checksum
-	
-	
-#if (defined(_WIN32) || defined(_WIN64))
-    WriteFile(comm_settings_t->file_handle, data_out, 9, &package_size_out, NULL);
-#else
-    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-    if(n_bytes)
-        read(comm_settings_t->file_handle, package_in, n_bytes);
+    // pages are length prefixed: each one is taken as soon as it is complete,
+    // the deadline only bounds a device that never answers
+    for (i = 0; i < num_of_pages; ++i)
+    {
 
-    write(comm_settings_t->file_handle, data_out, 9);
-#endif
+//=================================================		preparing packet to send
 
+        qbcodec::encode<qbcodec::GetInfo>(data_out, id, qbcodec::InfoPage(info_type, i));
+        RS485send(comm_settings_t, data_out, qbcodec::GetInfo::FRAME_SIZE);
 
 //==============================================================	 get packet
 
-    package_in_size = RS485read(comm_settings_t, id, package_in);
+        package_in_size = RS485readUntil(comm_settings_t, id, package_in,
+                                         monotonicUsec() + INFO_TIMEOUT_US);
+        if (package_in_size < 3)
+            return -1;
 
-    if (package_in_size == -1)
-        return -1;
-    
-	    strncpy(info, package_in + 2, package_in_size - 2);
-	
-    num_of_pages =  package_in[1];
-    
-    strcat(info, aux_string);
-    
-    if (num_of_pages > 1)
-    {        
-        for(i = 1; i < num_of_pages; ++i)
+        num_of_pages = package_in[1];
+
+        // page text, up to its null byte, without the checksum
+        for (j = 2; j < package_in_size - 1 && package_in[j] != '\0'; ++j)
         {
-						
-		    data_out[0]  = ':';
-		    data_out[1]  = ':';
-		    data_out[2] = (unsigned char) id;
-		    data_out[3]  = 5;
-						
-		    data_out[4] = CMD_GET_INFO;                        // command
-
-		    data_out[5] = ((unsigned char *) &info_type)[1];          // parameter type
-		    data_out[6] = ((unsigned char *) &info_type)[0];          // parameter type
-
-		    data_out[7] = i;    
-		    data_out[8] = checksum(data_out + 4, 4);             // checksum
-		
-		
-
-		#if (defined(_WIN32) || defined(_WIN64))
-		    WriteFile(comm_settings_t->file_handle, data_out, 9, &package_size_out, NULL);
-		#else
-		    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-		    if(n_bytes)
-		        read(comm_settings_t->file_handle, package_in, n_bytes);
-
-		    write(comm_settings_t->file_handle, data_out, 9);
-		#endif
-
-            package_in_size = 
-                RS485read(comm_settings_t, id, package_in);
-
-            if (package_in_size == -1) return -1;
-			
-		    strncpy(info, package_in + 2, package_in_size - 2);
-			
-            num_of_pages = package_in[1];
-                
-            strcat(info, aux_string);
+            if (info_size == BUFFER_SIZE - 1)
+                break;
+            info[info_size++] = package_in[j];
         }
+        info[info_size] = '\0';
     }
     
     return 0;
@@ -1189,37 +1697,9 @@ int commGetInfo(comm_settings *comm_settings_t, int id, unsigned char info_type,
 
 int commBootloader(comm_settings *comm_settings_t, int id)
 {
-    char data_out[BUFFER_SIZE];     // output data buffer
-    char package_in[BUFFER_SIZE];
-    int package_in_size;
-    int n_bytes;
-
-    #if (defined(_WIN32) || defined(_WIN64))
-        DWORD package_size_out;                 // for serial port access   
-    #endif    
-    
-        data_out[0] = ':';
-        data_out[1] = ':';
-        data_out[2] = (unsigned char) id;
-        data_out[3] = 2;
-        data_out[4] = CMD_BOOTLOADER;       // command
-        data_out[5] = CMD_BOOTLOADER;       // checksum
-    
-    #if (defined(_WIN32) || defined(_WIN64))
-        WriteFile(comm_settings_t->file_handle, data_out, 6, &package_size_out, NULL);
-    #else
-        ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-        if(n_bytes)
-            read(comm_settings_t->file_handle, package_in, n_bytes);
+    qbcodec::Bootloader::Reply reply;
 
-        write(comm_settings_t->file_handle, data_out, 6);
-    #endif
-
-    package_in_size = RS485read(comm_settings_t, id, package_in);
-    if (package_in_size == -1)
-            return -1;
-
-    return 0;
+    return transact<qbcodec::Bootloader>(comm_settings_t, id, qbcodec::Empty(), reply);
 }
 
 
@@ -1235,17 +1715,13 @@ int commSetParam(  comm_settings *comm_settings_t,
                     void *values, 
                     unsigned short num_of_values )
 {
-    char data_out[BUFFER_SIZE];		// output data buffer
-    char package_in[BUFFER_SIZE];
+    char data_out[6 + 2 + 4 * COMM_PAYLOAD_SIZE];
+    char package_in[COMM_PACKAGE_SIZE];
     int package_in_size;
-    int n_bytes;
 
-    #if (defined(_WIN32) || defined(_WIN64))
-        DWORD package_size_out;					// for serial port access	
-    #endif    
     
     void *value;
-    unsigned short int value_size, i, h;
+    unsigned short int value_size;
     
     switch (type){
         case PARAM_ID:
@@ -1288,24 +1764,13 @@ int commSetParam(  comm_settings *comm_settings_t,
 	
 	
 	
-    data_out[0]  = ':';
-    data_out[1]  = ':';
-    data_out[2]  = (unsigned char) id;
-    data_out[3]  = 4 + num_of_values * value_size;
-	
-	data_out[4] = CMD_SET_PARAM;		            // command
-    data_out[5] = ((char *) &type)[1];      // parameter type
-    data_out[6] = ((char *) &type)[0];      // parameter type
-
-    for(h = 0; h < num_of_values; ++h)
-    {
-        for(i = 0; i < value_size; ++i)
-        {
-            data_out[ h * value_size +  7 + i ] = 
-                ((char *) value)[ h * value_size + value_size - i - 1 ];
-        }
-
-    }
+    // parameter type, then each value with its bytes in wire order; more
+    // than the size byte can count would wrap it into a corrupt frame
+    if (num_of_values > COMM_PAYLOAD_SIZE ||
+        !qbcodec::putHeader(data_out, id, CMD_SET_PARAM, 2 + num_of_values * value_size))
+        return -1;
+    qbcodec::putShort(data_out + 5, (short int) type);
+    qbcodec::putReversed(data_out + 7, value, num_of_values, value_size);
 
 
 	data_out[ 7 + num_of_values * value_size ] =
@@ -1315,15 +1780,7 @@ int commSetParam(  comm_settings *comm_settings_t,
     //hexdump(data_out, 20);
 	
 
-    #if (defined(_WIN32) || defined(_WIN64))
-        WriteFile(comm_settings_t->file_handle, data_out, 8 + num_of_values * value_size, &package_size_out, NULL);
-    #else
-        ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-        if(n_bytes)
-            read(comm_settings_t->file_handle, package_in, n_bytes);
-
-        write(comm_settings_t->file_handle, data_out, 8 + num_of_values * value_size);
-    #endif
+    RS485send(comm_settings_t, data_out, 8 + num_of_values * value_size);
 
     package_in_size = RS485read(comm_settings_t, id, package_in);
 
@@ -1345,13 +1802,9 @@ int commGetParam(comm_settings *comm_settings_t,
                     unsigned short num_of_values )
 {
     int package_in_size;
-    char data_out[BUFFER_SIZE];		// output data buffer
-    char package_in[BUFFER_SIZE];
-    int n_bytes;
+    char data_out[8];
+    char package_in[COMM_PACKAGE_SIZE];
 
-    #if (defined(_WIN32) || defined(_WIN64))
-        DWORD package_size_out;					// for serial port access	
-    #endif    
 		    
     unsigned short int values_size;
 
@@ -1387,43 +1840,20 @@ int commGetParam(comm_settings *comm_settings_t,
 
 //================================================      preparing packet to send
     
-    data_out[0]  = ':';
-    data_out[1]  = ':';
-    data_out[2] = (unsigned char) id;
-    data_out[3]  = 4;
-	data_out[4] = CMD_GET_PARAM;		                // command
-    data_out[5] = ((char *) &type)[1];          		// parameter type
-    data_out[6] = ((char *) &type)[0];          		// parameter type
-    
+    qbcodec::putHeader(data_out, id, CMD_GET_PARAM, 2);
+    qbcodec::putShort(data_out + 5, (short int) type);      // parameter type
 	data_out[7] = checksum (data_out + 4, 3);	        // checksum
 
-	#if (defined(_WIN32) || defined(_WIN64))
-	    WriteFile(comm_settings_t->file_handle, data_out, 8, &package_size_out, NULL);
-	#else
-	    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-	    if(n_bytes)
-	        read(comm_settings_t->file_handle, package_in, n_bytes);
-
-	    write(comm_settings_t->file_handle, data_out, 8);
-	#endif
+    RS485send(comm_settings_t, data_out, 8);
 	
     package_in_size = RS485read(comm_settings_t, id, package_in);
 
-    if (package_in_size == -1)
+    if (package_in_size < 2 + num_of_values * values_size)
             return -1;
             
 //==============================================================  get packet
 
-    unsigned short int i, h;
-    for(h = 0; h < num_of_values; ++h)
-    {
-        for(i = 0; i < values_size; ++i)
-        {
-            ((char *) values) 
-                [ h * values_size + values_size - i - 1 ] =
-                package_in[ h * values_size + i + 1 ];
-        }
-    }
+    qbcodec::putReversed((char *) values, package_in + 1, num_of_values, values_size);
     
     return 0;
 }
@@ -1434,41 +1864,11 @@ int commGetParam(comm_settings *comm_settings_t,
 
 int commStoreParams( comm_settings *comm_settings_t, int id )
 {
+    qbcodec::StoreParams::Reply reply;
 
-	char data_out[BUFFER_SIZE];		// output data buffer
-	char package_in[BUFFER_SIZE];
-    int package_in_size;
-    int n_bytes;
-
-    #if (defined(_WIN32) || defined(_WIN64))
-        DWORD package_size_out;					// for serial port access	
-    #endif    
-
-    data_out[0] = ':';
-    data_out[1] = ':';
-    data_out[2] = (unsigned char) id;
-    data_out[3] = 2;
-    data_out[4] = CMD_STORE_PARAMS;                       // command
-    data_out[5] = CMD_STORE_PARAMS;                       // checksum
-
-	#if (defined(_WIN32) || defined(_WIN64))
-	    WriteFile(comm_settings_t->file_handle, data_out, 6, &package_size_out, NULL);
-	#else
-	    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-	    if(n_bytes)
-	        read(comm_settings_t->file_handle, package_in, n_bytes);
-
-	    write(comm_settings_t->file_handle, data_out, 6);
-	#endif
-
-    usleep(100000);
-    package_in_size = RS485read(comm_settings_t, id, package_in);
-
-    if (package_in_size == -1) {
-        return -1;
-    } else {
-        return 0;
-    }
+    // the reply comes once the flash is written
+    return transact<qbcodec::StoreParams>(comm_settings_t, id, qbcodec::Empty(), reply,
+                                 FLASH_TIMEOUT_US);
 }
 
 //==============================================================================
@@ -1477,127 +1877,203 @@ int commStoreParams( comm_settings *comm_settings_t, int id )
 
 int commStoreDefaultParams( comm_settings *comm_settings_t, int id )
 {
+    qbcodec::StoreDefaultParams::Reply reply;
 
-    char data_out[BUFFER_SIZE];     // output data buffer
-    char package_in[BUFFER_SIZE];
-    int package_in_size;
-    int n_bytes;
+    // the reply comes once the flash is written
+    return transact<qbcodec::StoreDefaultParams>(comm_settings_t, id, qbcodec::Empty(), reply,
+                                 FLASH_TIMEOUT_US);
+}
 
-    #if (defined(_WIN32) || defined(_WIN64))
-        DWORD package_size_out;                 // for serial port access   
-    #endif    
+//==============================================================================
+//                                                               commRestoreParams
+//==============================================================================
 
-    data_out[0] = ':';
-    data_out[1] = ':';
-    data_out[2] = (unsigned char) id;
-    data_out[3] = 2;
-    data_out[4] = CMD_STORE_DEFAULT_PARAMS;                       // command
-    data_out[5] = CMD_STORE_DEFAULT_PARAMS;                       // checksum
+int commRestoreParams( comm_settings *comm_settings_t, int id )
+{
+    qbcodec::RestoreParams::Reply reply;
 
-    #if (defined(_WIN32) || defined(_WIN64))
-        WriteFile(comm_settings_t->file_handle, data_out, 6, &package_size_out, NULL);
-    #else
-        ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-        if(n_bytes)
-            read(comm_settings_t->file_handle, package_in, n_bytes);
+    // the reply comes once the flash is written
+    return transact<qbcodec::RestoreParams>(comm_settings_t, id, qbcodec::Empty(), reply,
+                                 FLASH_TIMEOUT_US);
+}
 
-        write(comm_settings_t->file_handle, data_out, 6);
-    #endif
+//==============================================================================
+//                                                                   commInitMem
+//==============================================================================
 
-    usleep(200000);
-    package_in_size = RS485read(comm_settings_t, id, package_in);
+int commInitMem(comm_settings *comm_settings_t, int id) {
+    qbcodec::InitMem::Reply reply;
 
-    if (package_in_size == -1) {
-        return -1;
-    } else {
-        return 0;
-    }
+    // the reply comes once the flash is written
+    return transact<qbcodec::InitMem>(comm_settings_t, id, qbcodec::Empty(), reply,
+                                      FLASH_TIMEOUT_US);
 }
 
 //==============================================================================
-//                                                               commRestoreParams
+//                                                             commStatsSnapshot
+//==============================================================================
+// Counters only grow: a snapshot is their current value minus the baseline
+// saved by the last reset, so readers never write to what the owner updates.
+// The baseline is copied out under its generation count and copied again if
+// a reset ran meanwhile, so a snapshot never mixes two baselines.
 //==============================================================================
 
-int commRestoreParams( comm_settings *comm_settings_t, int id )
+void commStatsSnapshot(comm_settings *comm_settings_t, comm_stats *snapshot)
 {
+    const comm_stats *now = &comm_settings_t->stats;
+    comm_stats base;
+    unsigned int before, after;
+    int i;
 
-    char data_out[BUFFER_SIZE];		// output data buffer
-    char package_in[BUFFER_SIZE];
-    int package_in_size;
-    int n_bytes;
+    do
+    {
+        before = STATS_LOAD_ACQUIRE(comm_settings_t->stats_generation);
+        base = comm_settings_t->stats_baseline;
+        STATS_FENCE_ACQUIRE();
+        after = STATS_LOAD(comm_settings_t->stats_generation);
+    }
+    while ((before & 1) || before != after);
 
-    #if (defined(_WIN32) || defined(_WIN64))
-        DWORD package_size_out;					// for serial port access	
-    #endif    
+    snapshot->timeouts = STATS_LOAD(now->timeouts) - base.timeouts;
+    snapshot->id_mismatches = STATS_LOAD(now->id_mismatches) - base.id_mismatches;
+    snapshot->checksum_failures = STATS_LOAD(now->checksum_failures) - base.checksum_failures;
+    snapshot->bytes_drained = STATS_LOAD(now->bytes_drained) - base.bytes_drained;
+    snapshot->resyncs = STATS_LOAD(now->resyncs) - base.resyncs;
+    snapshot->syscalls = STATS_LOAD(now->syscalls) - base.syscalls;
 
-    data_out[0]  = ':';
-    data_out[1]  = ':';
-    data_out[2] = (unsigned char) id;
-    data_out[3]  = 2;
+    for (i = 0; i < COMM_STATS_COMMANDS; ++i)
+        commHistogramSnapshot(&now->latency[i], &base.latency[i], &snapshot->latency[i]);
+}
 
-    data_out[4] = CMD_RESTORE_PARAMS;                       // command
-    data_out[5] = CMD_RESTORE_PARAMS;                       // checksum
+//==============================================================================
+//                                                                commStatsReset
+//==============================================================================
+// Claims the baseline by making its generation odd, which also turns away a
+// second reset until this one is done, and makes it even again once written.
+//==============================================================================
 
-	#if (defined(_WIN32) || defined(_WIN64))
-	    WriteFile(comm_settings_t->file_handle, data_out, 6, &package_size_out, NULL);
-	#else
-	    ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-	    if(n_bytes)
-	        read(comm_settings_t->file_handle, package_in, n_bytes);
+void commStatsReset(comm_settings *comm_settings_t)
+{
+    comm_stats *now = &comm_settings_t->stats;
+    comm_stats *base = &comm_settings_t->stats_baseline;
+    unsigned int generation;
+    int i;
 
-	    write(comm_settings_t->file_handle, data_out, 6);
-	#endif
+    do
+        generation = STATS_LOAD(comm_settings_t->stats_generation) & ~1u;
+    while (!STATS_CLAIM(comm_settings_t->stats_generation, generation));
+    STATS_FENCE_RELEASE();
 
-    usleep(100000);
-    package_in_size = RS485read(comm_settings_t, id, package_in);
+    base->timeouts = STATS_LOAD(now->timeouts);
+    base->id_mismatches = STATS_LOAD(now->id_mismatches);
+    base->checksum_failures = STATS_LOAD(now->checksum_failures);
+    base->bytes_drained = STATS_LOAD(now->bytes_drained);
+    base->resyncs = STATS_LOAD(now->resyncs);
+    base->syscalls = STATS_LOAD(now->syscalls);
 
-    if (package_in_size == -1) {
-        return -1;
-    } else {
-        return 0;
-    }
+    for (i = 0; i < COMM_STATS_COMMANDS; ++i)
+        commHistogramSnapshot(&now->latency[i], NULL, &base->latency[i]);
+
+    STATS_STORE_RELEASE(comm_settings_t->stats_generation, generation + 2);
 }
 
 //==============================================================================
-//                                                                   commInitMem
+//                                                                  commStatsAdd
 //==============================================================================
 
-int commInitMem(comm_settings *comm_settings_t, int id) {
-    char data_out[BUFFER_SIZE];     // output data buffer
-    char package_in[BUFFER_SIZE];
-    int package_in_size;
-    int n_bytes;
+void commStatsAdd(comm_stats *total, const comm_stats *stats)
+{
+    int i;
 
-    #if (defined(_WIN32) || defined(_WIN64))
-        DWORD package_size_out;                 // for serial port access   
-    #endif    
+    total->timeouts += stats->timeouts;
+    total->id_mismatches += stats->id_mismatches;
+    total->checksum_failures += stats->checksum_failures;
+    total->bytes_drained += stats->bytes_drained;
+    total->resyncs += stats->resyncs;
+    total->syscalls += stats->syscalls;
 
-    data_out[0]  = ':';
-    data_out[1]  = ':';
-    data_out[2]  = (unsigned char) id;
-    data_out[3]  = 2;
+    for (i = 0; i < COMM_STATS_COMMANDS; ++i)
+        commHistogramMerge(&total->latency[i], &stats->latency[i]);
+}
 
-    data_out[4] = CMD_INIT_MEM;                       // command
-    data_out[5] = CMD_INIT_MEM;                       // checksum
+//==============================================================================
+//                                                            commHistogramMerge
+//==============================================================================
 
-    #if (defined(_WIN32) || defined(_WIN64))
-        WriteFile(comm_settings_t->file_handle, data_out, 6, &package_size_out, NULL);
-    #else
-        ioctl(comm_settings_t->file_handle, FIONREAD, &n_bytes);
-        if(n_bytes)
-            read(comm_settings_t->file_handle, package_in, n_bytes);
+void commHistogramMerge(comm_histogram *total, const comm_histogram *histogram)
+{
+    int i;
 
-        write(comm_settings_t->file_handle, data_out, 6);
-    #endif
+    total->count += histogram->count;
+    total->sum_us += histogram->sum_us;
+    for (i = 0; i < COMM_HIST_BUCKETS; ++i)
+        total->buckets[i] += histogram->buckets[i];
+}
 
-    usleep(200000);
-    package_in_size = RS485read(comm_settings_t, id, package_in);
+//==============================================================================
+//                                                              commStatsLatency
+//==============================================================================
 
-    if (package_in_size == -1) {
-        return -1;
-    } else {
+const comm_histogram *commStatsLatency(const comm_stats *stats, unsigned char command)
+{
+    return &stats->latency[statsIndex(command)];
+}
+
+//==============================================================================
+//                                                           commStatsPercentile
+//==============================================================================
+
+float commStatsPercentile(const comm_histogram *histogram, float fraction)
+{
+    unsigned long total = 0;
+    unsigned long rank, seen = 0;
+    int i, msb;
+
+    for (i = 0; i < COMM_HIST_BUCKETS; ++i)
+        total += histogram->buckets[i];
+    if (total == 0)
         return 0;
+
+    rank = (unsigned long)(fraction * (total - 1)) + 1;
+    for (i = 0; i < COMM_HIST_BUCKETS - 1; ++i)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+            break;
     }
+
+    if (i < 8)
+        return (float) i;
+
+    // middle of the bucket
+    msb = (i - 8) / 8 + 3;
+    return ((8 + (i - 8) % 8) + 0.5f) * (float)(1UL << (msb - 3));
+}
+
+//==============================================================================
+//                                                              commHistogramAdd
+//==============================================================================
+
+void commHistogramAdd(comm_histogram *histogram, long long usec)
+{
+    STATS_ADD(histogram->count, 1);
+    STATS_ADD(histogram->sum_us, (unsigned long) usec);
+    STATS_ADD(histogram->buckets[statsBucket(usec)], 1);
+}
+
+//==============================================================================
+//                                                         commHistogramSnapshot
+//==============================================================================
+
+void commHistogramSnapshot(const comm_histogram *histogram, const comm_histogram *base,
+                           comm_histogram *snapshot)
+{
+    int j;
+
+    snapshot->count = STATS_LOAD(histogram->count) - (base ? base->count : 0);
+    snapshot->sum_us = STATS_LOAD(histogram->sum_us) - (base ? base->sum_us : 0);
+    for (j = 0; j < COMM_HIST_BUCKETS; ++j)
+        snapshot->buckets[j] = STATS_LOAD(histogram->buckets[j]) - (base ? base->buckets[j] : 0);
 }
 
 //========================================     private functions implementations
@@ -1,14 +1,21 @@
 #include <tf/transform_listener.h>
 #include <tf_conversions/tf_eigen.h>
 #include <std_srvs/Empty.h>
-//#include <sensor_msgs/JointState.h>
+#include <sensor_msgs/JointState.h>
 #include <boost/thread/mutex.hpp>
 #include <ros/ros.h>
 #include <ros/console.h>
 #include <ros/duration.h>
+#include <actionlib/server/simple_action_server.h>
+#include <std_msgs/Float64.h>
 
 #include <time.h>
+#include <math.h>
 #include <boost/thread/mutex.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <sstream>
+#include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -16,8 +23,42 @@
 #include <string.h>
 
 #include "qb_cube_lib.h"
+#include "cube_bus.h"
+#include "cube_bus_manager.h"
+#include "cube_controller.h"
+#include "cube_poller.h"
+#include "cube_registry.h"
+#include "cube_velocity_monitor.h"
 #include "turn_table_interface/setPos.h"
 #include "turn_table_interface/getPos.h"
+#include "turn_table_interface/getStats.h"
+#include "turn_table_interface/setPosSync.h"
+#include "turn_table_interface/setVelocity.h"
+#include "turn_table_interface/getVelocity.h"
+#include "turn_table_interface/MoveToAngleAction.h"
+
+typedef actionlib::SimpleActionServer<turn_table_interface::MoveToAngleAction> MoveServer;
+
+static long long monotonicUsec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// a serial port and the cubes the node manages on it
+struct CubePort
+{
+  std::string port;
+  int baud;
+  CubeBusRealtime realtime;
+  std::vector<std::string> names;           // managed cubes, as routed by the manager
+  std::vector<int> ids;
+  std::vector<int> bus_ids;                 // every cube found on the port
+  boost::shared_ptr<CubePoller> poller;
+  std::vector<boost::shared_ptr<CubeController> > controllers;   // one per managed cube
+  std::vector<boost::shared_ptr<CubeVelocityMonitor> > monitors;
+};
 
 class TurnTable
 {
@@ -27,92 +68,884 @@ public:
 
 private:
   ros::NodeHandle nh_;
-  ros::ServiceServer srv_table_pos_, srv_read_pos_;
+  ros::ServiceServer srv_table_pos_, srv_read_pos_, srv_stats_, srv_sync_pos_;
+  std::vector<ros::ServiceServer> srv_cube_;
+  std::vector<ros::Publisher> pub_cube_pos_;
+  std::vector<ros::Subscriber> sub_cube_setpoint_;
+  ros::Publisher pub_joint_states_;
+  std::vector<boost::shared_ptr<MoveServer> > move_servers_;
+  ros::Timer publish_timer_;
   //service callback
   bool setTablePos(turn_table_interface::setPos::Request  &req,
                         turn_table_interface::setPos::Response &res );
   bool getTablePos(turn_table_interface::getPos::Request  &req,
                         turn_table_interface::getPos::Response &res );
+  bool setCubePos(const std::string &name, turn_table_interface::setPos::Request  &req,
+                        turn_table_interface::setPos::Response &res );
+  bool getCubePos(const std::string &name, turn_table_interface::getPos::Request  &req,
+                        turn_table_interface::getPos::Response &res );
+  bool getStats(turn_table_interface::getStats::Request  &req,
+                        turn_table_interface::getStats::Response &res );
+  bool setSyncPos(turn_table_interface::setPosSync::Request  &req,
+                        turn_table_interface::setPosSync::Response &res );
+  bool setCubeVelocity(const std::string &name, turn_table_interface::setVelocity::Request  &req,
+                        turn_table_interface::setVelocity::Response &res );
+  bool getCubeVelocity(const std::string &name, turn_table_interface::getVelocity::Request  &req,
+                        turn_table_interface::getVelocity::Response &res );
+  //topic callback
+  void streamSetpoint(const std::string &name, const std_msgs::Float64::ConstPtr &msg);
+  //action callback
+  void executeMove(size_t index, const turn_table_interface::MoveToAngleGoalConstPtr &goal);
 
-  std::string port_;
   double encoderRate_;
   int target_encoder_value_;
-  boost::mutex cube_mutex_;
-  comm_settings cube_comm_;
-  void connectToCube();
+  double reply_timeout_;
+  std::string registry_path_;
+  double poll_rate_;
+  double publish_rate_;
+  double settle_position_tolerance_;  // degrees
+  double settle_velocity_tolerance_;  // degrees/s
+  int settle_samples_;
+  double move_timeout_;
+  double control_rate_;
+  double stream_delay_, stream_decay_, stream_timeout_;   // seconds
+  bool wrap_reference_;
+  double velocity_window_;    // seconds
+  double velocity_tolerance_; // degrees/s
+  bool coalesce_setpoints_;
+  double budgets_[BUS_CLASSES];   // share of the bus time each traffic class may take
+  CubeMotionLimits limits_;   // ticks, ticks/s^2, ticks/s^3; no velocity for plain steps
+  std::vector<CubePort> ports_;
+  std::string table_;         // the cube behind the plain set_pos/get_pos
+  CubeBusManager buses_;
+  void readPorts();
+  void connectToCubes();
+  void syncRegistry();
+  void advertiseCubes();
+  CubePort *portOf(const std::string &name);
+  CubeController *controllerOf(const std::string &name);
+  CubeVelocityMonitor *monitorOf(const std::string &name);
+  void sendTo(const std::string &name, double position);
+  void publishPositions(const ros::TimerEvent &event);
+  void onSample(size_t port_index, int id, const CubeSample &sample);
+  void publishJointState(size_t port_index, int id, const CubeSample &sample);
 };
 
 TurnTable::TurnTable()
 {
   ROS_INFO("[TurnTable] Starting turn table interface node");
   nh_ = ros::NodeHandle("turn_table_interface");
-  nh_.param<std::string>("port", port_,"/dev/ttyUSB0");
   nh_.param<double>("encoderRate", encoderRate_, DEG_TICK_MULTIPLIER);
+  nh_.param<double>("reply_timeout", reply_timeout_, 0.1);
+  nh_.param<double>("poll_rate", poll_rate_, 500.0);      // per cube, Hz
+  nh_.param<double>("publish_rate", publish_rate_, 10.0);
+  // when a move_to_angle goal counts as reached
+  nh_.param<double>("settle_position_tolerance", settle_position_tolerance_, 0.5);
+  nh_.param<double>("settle_velocity_tolerance", settle_velocity_tolerance_, 2.0);
+  nh_.param<int>("settle_samples", settle_samples_, 10);
+  nh_.param<double>("move_timeout", move_timeout_, 10.0);
+  // motion profile of set_pos and move_to_angle, in degrees; a max_velocity
+  // of 0 writes the target straight to the cube
+  double max_velocity, max_acceleration, max_jerk;
+  nh_.param<double>("control_rate", control_rate_, 200.0);
+  nh_.param<double>("max_velocity", max_velocity, 200.0);
+  nh_.param<double>("max_acceleration", max_acceleration, 1440.0);
+  nh_.param<double>("max_jerk", max_jerk, 7200.0);
+  // <name>/setpoint streams: rendered stream_delay behind arrival, coasting
+  // to a stop over stream_decay once they run dry
+  nh_.param<double>("stream_delay", stream_delay_, 0.05);
+  nh_.param<double>("stream_decay", stream_decay_, 0.1);
+  nh_.param<double>("stream_timeout", stream_timeout_, 0.5);
+  // set_velocity: references past the 16 bit range wrap around if the cubes
+  // turn endlessly, else the spin stops at its end
+  nh_.param<bool>("wrap_reference", wrap_reference_, false);
+  nh_.param<double>("velocity_window", velocity_window_, 0.2);
+  nh_.param<double>("velocity_tolerance", velocity_tolerance_, 1.0);
+  // setpoints still queued when a newer one comes for the same cube are dropped
+  nh_.param<bool>("coalesce_setpoints", coalesce_setpoints_, true);
+  // control writes go first; polling and diagnostics take turns within
+  // their shares of the bus time while both have work queued
+  nh_.param<double>("budget_control", budgets_[BUS_CLASS_CONTROL], 1.0);
+  nh_.param<double>("budget_poll", budgets_[BUS_CLASS_POLL], 0.8);
+  nh_.param<double>("budget_diagnostic", budgets_[BUS_CLASS_DIAGNOSTIC], 0.2);
 
-  ROS_INFO_STREAM("[TurnTable] Connecting to table at " << port_ );
+  const char *ros_home = getenv("ROS_HOME");
+  const char *home = getenv("HOME");
+  std::string ros_dir = ros_home ? ros_home : std::string(home ? home : ".") + "/.ros";
+  nh_.param<std::string>("registry", registry_path_, ros_dir + "/turn_table_interface_registry");
 
-  cube_mutex_.lock();
-  this->connectToCube();
-  commActivate(&cube_comm_, 1, true); //cube_id is 1 for table
-  cube_mutex_.unlock();
+  limits_ = CubeMotionLimits(max_velocity * encoderRate_, max_acceleration * encoderRate_,
+                             max_jerk * encoderRate_);
 
+  this->readPorts();
+  this->connectToCubes();
+  this->syncRegistry();
+  for(size_t i = 0; i < buses_.devices().size(); ++i)
+    buses_.activate(buses_.devices()[i], true);
+
+  // the un-prefixed services drive the first cube, the table
   srv_table_pos_ = nh_.advertiseService("set_pos", &TurnTable::setTablePos, this);
   srv_read_pos_ = nh_.advertiseService("get_pos", &TurnTable::getTablePos, this);
+  srv_stats_ = nh_.advertiseService("get_stats", &TurnTable::getStats, this);
+  srv_sync_pos_ = nh_.advertiseService("set_pos_sync", &TurnTable::setSyncPos, this);
+  this->advertiseCubes();
+  pub_joint_states_ = nh_.advertise<sensor_msgs::JointState>("joint_states", 100);
+
+  for(size_t i = 0; i < ports_.size(); ++i)
+  {
+    CubePort &port = ports_[i];
+    if(!buses_.bus(port.port)->isOpen() || port.ids.empty())
+      continue;
+    // the monitors are fed from the polling thread, have them in place first
+    for(size_t j = 0; j < port.ids.size(); ++j)
+      port.monitors.push_back(boost::shared_ptr<CubeVelocityMonitor>(
+          new CubeVelocityMonitor(velocity_window_, velocity_tolerance_ * encoderRate_)));
+    port.poller.reset(new CubePoller(*buses_.bus(port.port)));
+    port.poller->setCallback(boost::bind(&TurnTable::onSample, this, i, _1, _2));
+    if(!port.poller->start(port.ids, poll_rate_))
+      ROS_WARN_STREAM("[TurnTable] Could not start polling " << port.port << " at " << poll_rate_ << " Hz");
+
+    for(size_t j = 0; j < port.ids.size(); ++j)
+    {
+      port.controllers.push_back(boost::shared_ptr<CubeController>(
+          new CubeController(*buses_.bus(port.port), port.ids[j])));
+      port.controllers.back()->setStreamTiming(stream_delay_, stream_decay_, stream_timeout_);
+      port.controllers.back()->setWrap(wrap_reference_);
+      port.controllers.back()->start(control_rate_);
+    }
+  }
+  if(publish_rate_ > 0)
+    publish_timer_ = nh_.createTimer(ros::Duration(1.0 / publish_rate_), &TurnTable::publishPositions, this);
+
+  // the action servers need the pollers for feedback, start them last
+  for(size_t i = 0; i < move_servers_.size(); ++i)
+    move_servers_[i]->start();
 
 }
 
 TurnTable::~TurnTable()
 {
-  cube_mutex_.lock();
-  closeRS485(&cube_comm_);
-  cube_mutex_.unlock();
+  for(size_t i = 0; i < ports_.size(); ++i)
+  {
+    for(size_t j = 0; j < ports_[i].controllers.size(); ++j)
+      ports_[i].controllers[j]->stop();
+    if(ports_[i].poller)
+      ports_[i].poller->stop();
+  }
+  buses_.close();
   ROS_INFO_STREAM("[TurnTable] Communication closed");
 }
 
-void TurnTable::connectToCube()
+void TurnTable::readPorts()
 {
-  openRS485(&cube_comm_, port_.c_str());
-  if(cube_comm_.file_handle <= 0)
+  // defaults for every port
+  std::string default_port;
+  CubePort defaults;
+  nh_.param<std::string>("port", default_port,"/dev/ttyUSB0");
+  nh_.param<int>("baud", defaults.baud, DEFAULT_BAUD_RATE);
+  // opt-in real-time profile for the bus threads
+  nh_.param<int>("rt_priority", defaults.realtime.priority, 0);
+  nh_.param<int>("rt_cpu", defaults.realtime.cpu, -1);
+  nh_.param<bool>("rt_lock_memory", defaults.realtime.lock_memory, false);
+
+  // several adapters: buses is a list of
+  //   { port: /dev/ttyUSB0, baud: 460800, rt_cpu: 2,
+  //     cubes: [ { name: table, id: 1 }, ... ] }
+  // cubes can also be plain ids, named cube_<id>
+  XmlRpc::XmlRpcValue buses;
+  if(nh_.getParam("buses", buses) && buses.getType() == XmlRpc::XmlRpcValue::TypeArray)
   {
-    ROS_ERROR("[TurnTable] Panic, cube file handle was invalid");
+    for(int i = 0; i < buses.size(); ++i)
+    {
+      XmlRpc::XmlRpcValue &bus = buses[i];
+      if(bus.getType() != XmlRpc::XmlRpcValue::TypeStruct || !bus.hasMember("port"))
+      {
+        ROS_WARN_STREAM("[TurnTable] buses[" << i << "] has no port, skipped");
+        continue;
+      }
+
+      CubePort port = defaults;
+      port.port = static_cast<std::string>(bus["port"]);
+      if(bus.hasMember("baud"))
+        port.baud = static_cast<int>(bus["baud"]);
+      if(bus.hasMember("rt_priority"))
+        port.realtime.priority = static_cast<int>(bus["rt_priority"]);
+      if(bus.hasMember("rt_cpu"))
+        port.realtime.cpu = static_cast<int>(bus["rt_cpu"]);
+      if(bus.hasMember("rt_lock_memory"))
+        port.realtime.lock_memory = static_cast<bool>(bus["rt_lock_memory"]);
+
+      if(bus.hasMember("cubes") && bus["cubes"].getType() == XmlRpc::XmlRpcValue::TypeArray)
+      {
+        XmlRpc::XmlRpcValue &cubes = bus["cubes"];
+        for(int j = 0; j < cubes.size(); ++j)
+        {
+          int id;
+          std::ostringstream name;
+          if(cubes[j].getType() == XmlRpc::XmlRpcValue::TypeStruct)
+          {
+            id = static_cast<int>(cubes[j]["id"]);
+            if(cubes[j].hasMember("name"))
+              name << static_cast<std::string>(cubes[j]["name"]);
+            else
+              name << "cube_" << id;
+          }
+          else
+          {
+            id = static_cast<int>(cubes[j]);
+            name << "cube_" << id;
+          }
+          port.names.push_back(name.str());
+          port.ids.push_back(id);
+        }
+      }
+      ports_.push_back(port);
+    }
+  }
+
+  if(!ports_.empty())
     return;
+
+  // a single port: cube_ids, or the single cube_id of the launch file
+  CubePort port = defaults;
+  port.port = default_port;
+  int cube_id;
+  nh_.param<int>("cube_id", cube_id, 1);
+  if(!nh_.getParam("cube_ids", port.ids) || port.ids.empty())
+    port.ids.assign(1, cube_id);
+  for(size_t i = 0; i < port.ids.size(); ++i)
+  {
+    std::ostringstream name;
+    name << "cube_" << port.ids[i];
+    port.names.push_back(name.str());
   }
-  else
+  ports_.push_back(port);
+}
+
+void TurnTable::connectToCubes()
+{
+  for(size_t i = 0; i < ports_.size(); ++i)
   {
-    ROS_INFO_STREAM("[TurnTable] Opened communication with file handle " << cube_comm_.file_handle);
+    CubePort &port = ports_[i];
+    ROS_INFO_STREAM("[TurnTable] Connecting to " << port.port << " (" << port.baud << " baud)");
+
+    if(!buses_.addPort(port.port, port.baud, port.realtime))
+      ROS_ERROR_STREAM("[TurnTable] Panic, cube file handle was invalid for " << port.port);
+    else
+      ROS_INFO_STREAM("[TurnTable] Opened communication on " << port.port);
+
+    CubeBus *bus = buses_.bus(port.port);
+    bus->setCoalescing(coalesce_setpoints_);
+    for(int c = 0; c < BUS_CLASSES; ++c)
+      bus->setBudget((CubeBusClass)c, budgets_[c]);
+    if(!bus->realtimeError().empty())
+      ROS_WARN_STREAM("[TurnTable] Real-time profile not fully applied on " << port.port << ": " << bus->realtimeError());
+    else if(bus->isOpen() && port.realtime.priority > 0)
+      ROS_INFO_STREAM("[TurnTable] Bus thread of " << port.port << " running SCHED_FIFO " << port.realtime.priority);
+
+    for(size_t j = 0; j < port.names.size(); ++j)
+      if(!buses_.addDevice(port.names[j], port.port, port.ids[j]))
+        ROS_WARN_STREAM("[TurnTable] Cube name " << port.names[j] << " used twice, ignored on " << port.port);
+
+    if(table_.empty() && !port.names.empty())
+      table_ = port.names[0];
   }
 }
 
+void TurnTable::syncRegistry()
+{
+  CubeRegistry registry(registry_path_);
+  bool cached = registry.load();
+
+  // one port at a time, they share the file
+  for(size_t i = 0; i < ports_.size(); ++i)
+  {
+    CubePort &port = ports_[i];
+    CubeBus *bus = buses_.bus(port.port);
+    if(!bus->isOpen())
+      continue;
+
+    // the registry talks to the port directly, run it on the bus thread
+    int scans = registry.scans();
+    CubeReply reply = bus->submitJob(boost::bind(&CubeRegistry::sync, &registry, _1, port.port,
+                                                 port.ids)).get();
+    port.bus_ids = registry.ids(port.port);
+
+    std::ostringstream list;
+    for(size_t j = 0; j < port.bus_ids.size(); ++j)
+      list << " " << port.bus_ids[j];
+
+    if(registry.scans() > scans)
+      ROS_INFO_STREAM("[TurnTable] Scanned " << port.port << (cached ? " (registry out of date)" : "")
+                      << ", found " << reply.status << " cube(s):" << list.str());
+    else
+      ROS_INFO_STREAM("[TurnTable] Registry validated " << reply.status << " cube(s) on " << port.port << ":" << list.str());
+
+    for(size_t j = 0; j < port.ids.size(); ++j)
+    {
+      const CubeRecord *record = registry.find(port.port, port.ids[j]);
+      if(!record)
+      {
+        ROS_WARN_STREAM("[TurnTable] Cube " << port.names[j] << " (id " << port.ids[j] << ") not found on " << port.port);
+        continue;
+      }
+
+      // angles are converted with encoderRate, which assumes the default
+      // resolution unless set; the cached parameters tell without asking
+      std::map<int, std::vector<unsigned char> >::const_iterator resolution =
+          record->params.find(PARAM_POS_RESOLUTION);
+      if(resolution != record->params.end() && !resolution->second.empty() &&
+         resolution->second[0] != DEFAULT_RESOLUTION && encoderRate_ == DEG_TICK_MULTIPLIER)
+        ROS_WARN_STREAM("[TurnTable] Cube " << port.names[j] << " uses position resolution "
+                        << (int)resolution->second[0] << ", angles assume " << DEFAULT_RESOLUTION
+                        << "; set ~encoderRate");
+    }
+  }
+}
+
+void TurnTable::advertiseCubes()
+{
+  // <name>/set_pos, <name>/get_pos and <name>/position for each cube
+  const std::vector<std::string> &names = buses_.devices();
+  for(size_t i = 0; i < names.size(); ++i)
+  {
+    const std::string &name = names[i];
+
+    srv_cube_.push_back(nh_.advertiseService<turn_table_interface::setPos::Request,
+                                             turn_table_interface::setPos::Response>(
+        name + "/set_pos", boost::bind(&TurnTable::setCubePos, this, name, _1, _2)));
+    srv_cube_.push_back(nh_.advertiseService<turn_table_interface::getPos::Request,
+                                             turn_table_interface::getPos::Response>(
+        name + "/get_pos", boost::bind(&TurnTable::getCubePos, this, name, _1, _2)));
+    pub_cube_pos_.push_back(nh_.advertise<std_msgs::Float64>(name + "/position", 10));
+    sub_cube_setpoint_.push_back(nh_.subscribe<std_msgs::Float64>(name + "/setpoint", 10,
+        boost::bind(&TurnTable::streamSetpoint, this, name, _1)));
+    srv_cube_.push_back(nh_.advertiseService<turn_table_interface::setVelocity::Request,
+                                             turn_table_interface::setVelocity::Response>(
+        name + "/set_velocity", boost::bind(&TurnTable::setCubeVelocity, this, name, _1, _2)));
+    srv_cube_.push_back(nh_.advertiseService<turn_table_interface::getVelocity::Request,
+                                             turn_table_interface::getVelocity::Response>(
+        name + "/get_velocity", boost::bind(&TurnTable::getCubeVelocity, this, name, _1, _2)));
+    move_servers_.push_back(boost::shared_ptr<MoveServer>(new MoveServer(nh_, name + "/move_to_angle",
+        boost::bind(&TurnTable::executeMove, this, i, _1), false)));
+  }
+}
+
+CubePort *TurnTable::portOf(const std::string &name)
+{
+  const CubeRoute *route = buses_.route(name);
+  for(size_t i = 0; route && i < ports_.size(); ++i)
+    if(ports_[i].port == route->port)
+      return &ports_[i];
+  return NULL;
+}
+
+CubeController *TurnTable::controllerOf(const std::string &name)
+{
+  CubePort *port = portOf(name);
+  if(!port)
+    return NULL;
+  for(size_t i = 0; i < port->controllers.size(); ++i)
+    if(port->names[i] == name)
+      return port->controllers[i].get();
+  return NULL;
+}
+
+CubeVelocityMonitor *TurnTable::monitorOf(const std::string &name)
+{
+  CubePort *port = portOf(name);
+  if(!port)
+    return NULL;
+  for(size_t i = 0; i < port->monitors.size(); ++i)
+    if(port->names[i] == name)
+      return port->monitors[i].get();
+  return NULL;
+}
+
+void TurnTable::sendTo(const std::string &name, double position)
+{
+  CubeVelocityMonitor *monitor = monitorOf(name);
+  if(monitor)
+    monitor->stop();
+
+  // along the motion profile from where the cube is, or as a step
+  CubeController *controller = controllerOf(name);
+  CubePort *port = portOf(name);
+  CubeSample sample;
+  if(controller && limits_.velocity > 0 &&
+     port->poller->latest(buses_.route(name)->id, &sample) && sample.stamp_us)
+  {
+    controller->moveTo(encoderRate_*position, limits_, sample.measurements[0]);
+    return;
+  }
+  if(controller)
+    controller->release();
+
+  short int curr_ref[NUM_OF_MOTORS];
+  curr_ref[0] = curr_ref[1] = encoderRate_*position;
+  buses_.setInputs(name, curr_ref); //queued, sent by the bus thread of its port
+}
+
+void TurnTable::publishPositions(const ros::TimerEvent &event)
+{
+  const std::vector<std::string> &names = buses_.devices();
+  for(size_t i = 0; i < names.size(); ++i)
+  {
+    CubePort *port = portOf(names[i]);
+    CubeSample sample;
+    if(!port->poller || !port->poller->latest(buses_.route(names[i])->id, &sample) || !sample.stamp_us)
+      continue;
+
+    std_msgs::Float64 position;
+    position.data = (double)sample.measurements[0] / encoderRate_;
+    pub_cube_pos_[i].publish(position);
+  }
+}
+
+void TurnTable::onSample(size_t port_index, int id, const CubeSample &sample)
+{
+  const CubePort &port = ports_[port_index];
+  std::vector<int>::const_iterator it = std::find(port.ids.begin(), port.ids.end(), id);
+  if(it != port.ids.end())
+    port.monitors[it - port.ids.begin()]->add(sample.stamp_us, sample.measurements[0]);
+
+  publishJointState(port_index, id, sample);
+}
+
+void TurnTable::publishJointState(size_t port_index, int id, const CubeSample &sample)
+{
+  const CubePort &port = ports_[port_index];
+  std::vector<int>::const_iterator it = std::find(port.ids.begin(), port.ids.end(), id);
+  if(it == port.ids.end())
+    return;
+
+  // the sample was stamped on the monotonic clock halfway through its
+  // transaction, carry that instant over to ROS time
+  long long age_us = monotonicUsec() - sample.stamp_us;
+
+  double ticks_to_rad = M_PI / 180.0 / encoderRate_;
+  sensor_msgs::JointState state;
+  state.header.stamp = ros::Time::now() - ros::Duration(age_us / 1e6);
+  state.name.push_back(port.names[it - port.ids.begin()]);
+  state.position.push_back(sample.measurements[0] * ticks_to_rad);
+  state.velocity.push_back(sample.velocity * ticks_to_rad);
+  state.effort.push_back(sample.currents[0]);   // motor current, mA
+  pub_joint_states_.publish(state);
+}
+
+void TurnTable::streamSetpoint(const std::string &name, const std_msgs::Float64::ConstPtr &msg)
+{
+  // stamped on arrival, the controller interpolates between the points
+  CubeController *controller = controllerOf(name);
+  CubePort *port = portOf(name);
+  CubeSample sample;
+  if(!controller || !port->poller->latest(buses_.route(name)->id, &sample) || !sample.stamp_us)
+  {
+    ROS_WARN_STREAM_THROTTLE(1.0, "[TurnTable] No position of " << name << " yet, setpoint dropped");
+    return;
+  }
+  CubeVelocityMonitor *monitor = monitorOf(name);
+  if(monitor)
+    monitor->stop();
+  controller->stream(encoderRate_*msg->data, monotonicUsec(), sample.measurements[0]);
+}
+
 bool TurnTable::setTablePos(turn_table_interface::setPos::Request  &req,
              turn_table_interface::setPos::Response &res )
 {
-  double position = req.position; // pos in degrees
+  return setCubePos(table_, req, res);
+}
 
-  ROS_INFO_STREAM("[TurnTable] Sending Turn Table to position: " << position);
+bool TurnTable::getTablePos(turn_table_interface::getPos::Request  &req,
+             turn_table_interface::getPos::Response &res )
+{
+  return getCubePos(table_, req, res);
+}
 
-  short int inputs;
-  inputs = encoderRate_*position;
-  short int curr_ref[NUM_OF_MOTORS];
-  curr_ref[0] = inputs;
-  curr_ref[1] = inputs;
+bool TurnTable::setCubePos(const std::string &name, turn_table_interface::setPos::Request  &req,
+             turn_table_interface::setPos::Response &res )
+{
+  double position = req.position; // pos in degrees
+
+  ROS_INFO_STREAM("[TurnTable] Sending " << name << " to position: " << position);
 
-  cube_mutex_.lock();
-  commSetInputs(&cube_comm_, 1, curr_ref); //actual communication
-  cube_mutex_.unlock();
+  sendTo(name, position);
   return true;
 }
 
-bool TurnTable::getTablePos(turn_table_interface::getPos::Request  &req,
+bool TurnTable::getCubePos(const std::string &name, turn_table_interface::getPos::Request  &req,
              turn_table_interface::getPos::Response &res )
 {
-  short int measurements[3];
+  long long now_us = monotonicUsec();
+
+  // the poller's latest sample, unless there is none or it is too old
+  CubePort *port = portOf(name);
+  CubeSample sample;
+  if(port && port->poller && port->poller->latest(buses_.route(name)->id, &sample) && sample.stamp_us &&
+     (req.max_age <= 0 || now_us - sample.stamp_us <= req.max_age * 1e6))
+  {
+    res.current_pos = (short int)((double)sample.measurements[0] / encoderRate_);
+    res.sample_age = (now_us - sample.stamp_us) / 1e6;
+    ROS_DEBUG_STREAM("[TurnTable] " << name << " position reads: " << res.current_pos << " (cached)");
+    return true;
+  }
+
   double position;
-  cube_mutex_.lock();
-  commGetMeasurements(&cube_comm_, 1, measurements);
-  cube_mutex_.unlock();
-  position = (double)(measurements[0]) /encoderRate_;
-  ROS_INFO_STREAM("[TurnTable] Table position reads: " << position );
+  CubeFuture reply = buses_.getMeasurements(name);
+  if(!reply.timed_wait(boost::posix_time::microseconds((long)(reply_timeout_ * 1e6))) ||
+     reply.get().status)
+  {
+    ROS_WARN_STREAM("[TurnTable] Could not read position of " << name);
+    return false;
+  }
+  position = (double)(reply.get().measurements[0]) /encoderRate_;
+  ROS_DEBUG_STREAM("[TurnTable] " << name << " position reads: " << position );
   res.current_pos = (short int)position;
+  res.sample_age = (monotonicUsec() - reply.get().stamp_us) / 1e6;
+  return true;
+}
+
+void TurnTable::executeMove(size_t index, const turn_table_interface::MoveToAngleGoalConstPtr &goal)
+{
+  const std::string &name = buses_.devices()[index];
+  MoveServer &server = *move_servers_[index];
+  turn_table_interface::MoveToAngleFeedback feedback;
+  turn_table_interface::MoveToAngleResult result;
+
+  double position_tolerance = goal->position_tolerance > 0 ? goal->position_tolerance : settle_position_tolerance_;
+  double velocity_tolerance = goal->velocity_tolerance > 0 ? goal->velocity_tolerance : settle_velocity_tolerance_;
+  int settle_samples = goal->settle_samples > 0 ? goal->settle_samples : settle_samples_;
+  double timeout = goal->timeout > 0 ? goal->timeout : move_timeout_;
+
+  CubePort *port = portOf(name);
+  if(!port || !port->poller)
+  {
+    server.setAborted(result, "cube is not polled");
+    return;
+  }
+  int id = buses_.route(name)->id;
+
+  ROS_INFO_STREAM("[TurnTable] Moving " << name << " to " << goal->angle << " deg");
+
+  long long start_us = monotonicUsec();
+  sendTo(name, goal->angle);
+
+  // judge every new sample taken after the setpoint went out
+  unsigned long seen = 0;
+  int settled = 0;
+  long long settled_since_us = 0;
+  ros::Rate rate(poll_rate_ > 0 ? poll_rate_ : 100.0);
+  while(ros::ok())
+  {
+    CubeSample sample;
+    port->poller->latest(id, &sample);
+    result.angle = (double)sample.measurements[0] / encoderRate_;
+
+    if(server.isPreemptRequested())
+    {
+      // cancelled outright: hold where the cube is rather than finish the move
+      if(!server.isNewGoalAvailable() && sample.stamp_us)
+      {
+        CubeController *controller = controllerOf(name);
+        if(controller)
+          controller->hold(sample.measurements[0]);
+        else
+        {
+          short int curr_ref[NUM_OF_MOTORS];
+          curr_ref[0] = curr_ref[1] = sample.measurements[0];
+          buses_.setInputs(name, curr_ref);
+        }
+      }
+      server.setPreempted(result);
+      return;
+    }
+
+    if(sample.samples != seen && sample.stamp_us > start_us)
+    {
+      seen = sample.samples;
+      feedback.angle = result.angle;
+      feedback.error = goal->angle - feedback.angle;
+      feedback.velocity = sample.velocity / encoderRate_;
+      server.publishFeedback(feedback);
+
+      if(fabs(feedback.error) <= position_tolerance && fabs(feedback.velocity) <= velocity_tolerance)
+      {
+        if(!settled++)
+          settled_since_us = sample.stamp_us;
+        if(settled >= settle_samples)
+        {
+          result.settle_time = (settled_since_us - start_us) / 1e6;
+          ROS_INFO_STREAM("[TurnTable] " << name << " settled at " << result.angle << " deg after "
+                          << result.settle_time << " s");
+          server.setSucceeded(result);
+          return;
+        }
+      }
+      else
+        settled = 0;
+    }
+
+    if(monotonicUsec() - start_us > timeout * 1e6)
+    {
+      ROS_WARN_STREAM("[TurnTable] " << name << " did not settle within " << timeout << " s");
+      server.setAborted(result, "did not settle in time");
+      return;
+    }
+    rate.sleep();
+  }
+}
+
+bool TurnTable::setSyncPos(turn_table_interface::setPosSync::Request  &req,
+             turn_table_interface::setPosSync::Response &res )
+{
+  // cubes by name, or by id on the first port
+  std::vector<std::string> names(req.names);
+  for(size_t i = 0; i < req.ids.size() && !ports_.empty(); ++i)
+  {
+    const CubePort &first = ports_[0];
+    std::vector<int>::const_iterator it = std::find(first.ids.begin(), first.ids.end(), req.ids[i]);
+    if(it == first.ids.end())
+    {
+      ROS_WARN_STREAM("[TurnTable] set_pos_sync: no cube with id " << req.ids[i] << " on " << first.port);
+      return false;
+    }
+    names.push_back(first.names[it - first.ids.begin()]);
+  }
+
+  if(names.empty() || (req.positions.size() != 1 && req.positions.size() != names.size()))
+  {
+    ROS_WARN("[TurnTable] set_pos_sync takes names or ids and one position per cube, or a single one for all");
+    return false;
+  }
+
+  // one synchronized request per port, the ports run in parallel
+  std::vector<CubeFuture> replies;
+  for(size_t p = 0; p < ports_.size(); ++p)
+  {
+    const CubePort &port = ports_[p];
+    int ids[BUS_MAX_BATCH];
+    short int inputs[BUS_MAX_BATCH][NUM_OF_MOTORS];
+    std::vector<int> listed;
+
+    for(size_t i = 0; i < names.size(); ++i)
+    {
+      const CubeRoute *route = buses_.route(names[i]);
+      if(!route)
+      {
+        ROS_WARN_STREAM("[TurnTable] set_pos_sync: unknown cube " << names[i]);
+        return false;
+      }
+      if(route->port != port.port)
+        continue;
+      if(listed.size() == BUS_MAX_BATCH)
+      {
+        ROS_WARN_STREAM("[TurnTable] set_pos_sync takes at most " << BUS_MAX_BATCH << " cubes per port");
+        return false;
+      }
+
+      // the step replaces any profiled move in progress
+      CubeController *controller = controllerOf(names[i]);
+      CubeVelocityMonitor *monitor = monitorOf(names[i]);
+      if(controller)
+        controller->release();
+      if(monitor)
+        monitor->stop();
+
+      double position = req.positions.size() == 1 ? req.positions[0] : req.positions[i];
+      ids[listed.size()] = route->id;
+      inputs[listed.size()][0] = inputs[listed.size()][1] = encoderRate_*position;
+      listed.push_back(route->id);
+    }
+    if(listed.empty())
+      continue;
+
+    // a broadcast is only safe if no other cube is listening
+    std::vector<int> sorted(listed);
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<int> known(port.bus_ids);
+    std::sort(known.begin(), known.end());
+    bool whole_bus = !known.empty() &&
+                     std::includes(sorted.begin(), sorted.end(), known.begin(), known.end());
+
+    replies.push_back(buses_.bus(port.port)->setInputsSync(listed.size(), ids, inputs, whole_bus));
+  }
+
+  res.broadcast = true;
+  res.skew_us = 0;
+  res.skew_nominal = false;
+  for(size_t i = 0; i < replies.size(); ++i)
+  {
+    if(!replies[i].timed_wait(boost::posix_time::microseconds((long)(reply_timeout_ * 1e6))) ||
+       replies[i].get().status < 0)
+    {
+      ROS_WARN("[TurnTable] Could not send synchronized positions");
+      return false;
+    }
+    res.broadcast = res.broadcast && replies[i].get().status == 1;
+    res.skew_nominal = res.skew_nominal || replies[i].get().status == 2;
+    res.skew_us = std::max(res.skew_us, (double)replies[i].get().skew_us);
+  }
+
+  ROS_DEBUG_STREAM("[TurnTable] " << names.size() << " cube(s) on " << replies.size() << " port(s) set "
+                   << (res.broadcast ? "by broadcast" : "in batches")
+                   << ", skew " << res.skew_us << " us");
+  return true;
+}
+
+bool TurnTable::setCubeVelocity(const std::string &name, turn_table_interface::setVelocity::Request  &req,
+             turn_table_interface::setVelocity::Response &res )
+{
+  CubeController *controller = controllerOf(name);
+  CubeVelocityMonitor *monitor = monitorOf(name);
+  CubePort *port = portOf(name);
+  CubeSample sample;
+  if(!controller || !port->poller->latest(buses_.route(name)->id, &sample) || !sample.stamp_us)
+  {
+    ROS_WARN_STREAM("[TurnTable] No position of " << name << " yet, cannot spin it");
+    return false;
+  }
+
+  double velocity = encoderRate_*req.velocity;
+  double acceleration = req.acceleration > 0 ? encoderRate_*req.acceleration : limits_.acceleration;
+  ROS_INFO_STREAM("[TurnTable] Spinning " << name << " at " << req.velocity << " deg/s");
+
+  if(velocity)
+    monitor->reset(velocity);
+  else
+    monitor->stop();
+  controller->spin(velocity, acceleration, sample.measurements[0]);
+
+  // how long until a clamped reference runs out of range
+  double reference = controller->reference();
+  if(wrap_reference_)
+    res.range_time = -1;
+  else if(!velocity)
+    res.range_time = 0;
+  else
+    res.range_time = (velocity > 0 ? 32767 - reference : reference + 32768) / fabs(velocity);
+  return true;
+}
+
+bool TurnTable::getCubeVelocity(const std::string &name, turn_table_interface::getVelocity::Request  &req,
+             turn_table_interface::getVelocity::Response &res )
+{
+  CubeController *controller = controllerOf(name);
+  CubeVelocityMonitor *monitor = monitorOf(name);
+  if(!controller || !monitor)
+    return false;
+
+  CubeVelocityStats stats = monitor->stats();
+  res.spinning = controller->isSpinning();
+  res.commanded = controller->spinVelocity() / encoderRate_;
+  res.target = stats.active ? stats.commanded / encoderRate_ : 0;
+  res.measured = stats.measured / encoderRate_;
+  res.error = stats.error / encoderRate_;
+  res.locked = stats.locked;
+  res.max_error = stats.max_error / encoderRate_;
+  res.rms_error = stats.rms_error / encoderRate_;
+  res.tolerance = velocity_tolerance_;
+  res.within_tolerance = stats.locked && res.max_error <= velocity_tolerance_;
+  res.limited = controller->isLimited();
+  return true;
+}
+
+bool TurnTable::getStats(turn_table_interface::getStats::Request  &req,
+             turn_table_interface::getStats::Response &res )
+{
+  static const struct { unsigned char command; const char *name; } commands[] =
+  {
+    { CMD_PING, "ping" },
+    { CMD_SET_PARAM, "set_param" },
+    { CMD_GET_PARAM, "get_param" },
+    { CMD_STORE_PARAMS, "store_params" },
+    { CMD_GET_INFO, "get_info" },
+    { CMD_ACTIVATE, "activate" },
+    { CMD_GET_ACTIVATE, "get_activate" },
+    { CMD_SET_INPUTS, "set_inputs" },
+    { CMD_GET_INPUTS, "get_inputs" },
+    { CMD_GET_MEASUREMENTS, "get_measurements" },
+    { CMD_GET_CURRENTS, "get_currents" },
+    { CMD_GET_CURR_AND_MEAS, "get_curr_and_meas" }
+  };
+
+  static const char *classes[BUS_CLASSES] = { "control", "poll", "diagnostic" };
+
+  // about 20 kB each, keep them off the callback stack
+  static comm_stats stats, total;
+  static comm_histogram queue_delay[BUS_CLASSES];
+  unsigned long busy_us[BUS_CLASSES] = { 0, 0, 0 };
+  static boost::mutex stats_mutex;
+  boost::mutex::scoped_lock lock(stats_mutex);
+
+  // one port, or all of them added up
+  memset(&total, 0, sizeof(total));
+  memset(queue_delay, 0, sizeof(queue_delay));
+  res.setpoints_sent = res.setpoints_coalesced = 0;
+  for(size_t i = 0; i < ports_.size(); ++i)
+  {
+    if(!req.port.empty() && req.port != ports_[i].port)
+      continue;
+    CubeBus *bus = buses_.bus(ports_[i].port);
+    bus->stats(&stats);
+    CubeBusCounters counters = bus->counters();
+    if(req.reset)
+      bus->resetStats();
+    commStatsAdd(&total, &stats);
+    res.setpoints_sent += counters.setpoints_sent;
+    res.setpoints_coalesced += counters.setpoints_coalesced;
+    for(int c = 0; c < BUS_CLASSES; ++c)
+    {
+      commHistogramMerge(&queue_delay[c], &counters.queue_delay[c]);
+      busy_us[c] += counters.busy_us[c];
+    }
+  }
+
+  res.timeouts = total.timeouts;
+  res.id_mismatches = total.id_mismatches;
+  res.checksum_failures = total.checksum_failures;
+  res.bytes_drained = total.bytes_drained;
+  res.resyncs = total.resyncs;
+  res.syscalls = total.syscalls;
+
+  for(size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i)
+  {
+    const comm_histogram *latency = commStatsLatency(&total, commands[i].command);
+    if(!latency->count)
+      continue;
+
+    res.commands.push_back(commands[i].name);
+    res.counts.push_back(latency->count);
+    res.mean_us.push_back((float)latency->sum_us / latency->count);
+    res.p50_us.push_back(commStatsPercentile(latency, 0.50));
+    res.p90_us.push_back(commStatsPercentile(latency, 0.90));
+    res.p99_us.push_back(commStatsPercentile(latency, 0.99));
+    res.max_us.push_back(commStatsPercentile(latency, 1.0));
+  }
+
+  for(int c = 0; c < BUS_CLASSES; ++c)
+  {
+    res.classes.push_back(classes[c]);
+    res.served.push_back(queue_delay[c].count);
+    res.queue_p50_us.push_back(commStatsPercentile(&queue_delay[c], 0.50));
+    res.queue_p99_us.push_back(commStatsPercentile(&queue_delay[c], 0.99));
+    res.queue_max_us.push_back(commStatsPercentile(&queue_delay[c], 1.0));
+    res.busy_us.push_back(busy_us[c]);
+  }
+
+  const std::vector<std::string> &names = buses_.devices();
+  for(size_t i = 0; i < names.size(); ++i)
+  {
+    CubePort *port = portOf(names[i]);
+    const CubeRoute *route = buses_.route(names[i]);
+    CubeSample sample;
+    if((!req.port.empty() && req.port != route->port) ||
+       !port->poller || !port->poller->latest(route->id, &sample))
+      continue;
+    res.cube_names.push_back(names[i]);
+    res.cube_ids.push_back(route->id);
+    res.sample_rates.push_back(sample.rate);
+    res.poll_failures.push_back(sample.failures);
+  }
   return true;
 }
 
@@ -120,6 +953,8 @@ int main( int argc, char* argv[] )
 {
     ros::init(argc, argv, "turn_table_interface");
     TurnTable turn_table_node;
-    ros::spin();
+    // service callbacks only wait on bus futures, let them run concurrently
+    ros::MultiThreadedSpinner spinner;
+    spinner.spin();
     return 0;
 }
@@ -0,0 +1,361 @@
+#include <cube_bus.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/** A frame seen on the line. */
+struct Frame
+{
+  int id;
+  int command;
+  std::vector<short int> values;    ///< the payload as big-endian shorts
+};
+
+/** Runs on the bus thread until the test opens the gate, so that the
+ *  requests submitted meanwhile are all queued when it does. */
+static int blockBus(boost::promise<void> *started, boost::shared_future<void> gate,
+                    comm_settings *)
+{
+  started->set_value();
+  gate.wait();
+  return 0;
+}
+
+/** Notes tag in order on the bus thread, after keeping it busy for busy_ms. */
+static int note(std::vector<char> *order, char tag, int busy_ms, comm_settings *)
+{
+  if (busy_ms)
+    boost::this_thread::sleep(boost::posix_time::milliseconds(busy_ms));
+  order->push_back(tag);
+  return 0;
+}
+
+static int nothing(comm_settings *)
+{
+  return 0;
+}
+
+/** Submits jobs back to back until the bus turns them away. */
+static void flood(CubeBus *bus, std::vector<CubeFuture> *futures)
+{
+  for (int i = 0; i < 100000; ++i)
+  {
+    futures->push_back(bus->submitJob(nothing, (CubeBusClass)(i % BUS_CLASSES)));
+    if (futures->back().is_ready() && futures->back().get().status == -1)
+      break;
+  }
+}
+
+/** Submits jobs one at a time, each once the last is done, so that the bus
+ *  thread goes to sleep between them; counts those it never woke up for. */
+static void pingPong(CubeBus *bus, int count, int *lost)
+{
+  for (int i = 0; i < count; ++i)
+    if (!bus->submitJob(nothing).timed_wait(boost::posix_time::seconds(1)))
+      ++*lost;
+}
+
+/** A CubeBus on a pseudo-terminal, with a thread recording every frame
+ *  written to it. Nothing answers, so only writes can be checked. */
+class CubeBusLine : public testing::Test
+{
+protected:
+  CubeBusLine() : master_(-1), recording_(false) {}
+
+  virtual void SetUp()
+  {
+    master_ = posix_openpt(O_RDWR | O_NOCTTY);
+    ASSERT_GE(master_, 0);
+    ASSERT_EQ(grantpt(master_), 0);
+    ASSERT_EQ(unlockpt(master_), 0);
+    ASSERT_TRUE(bus_.open(ptsname(master_)));
+
+    recording_ = true;
+    recorder_ = boost::thread(&CubeBusLine::record, this);
+  }
+
+  virtual void TearDown()
+  {
+    bus_.close();
+    recording_ = false;
+    recorder_.join();
+    ::close(master_);
+  }
+
+  /** Holds the bus thread busy until release(). */
+  void block()
+  {
+    boost::promise<void> started;
+    gate_ = boost::promise<void>();
+    bus_.submitJob(boost::bind(blockBus, &started, gate_.get_future().share(), _1),
+                   BUS_CLASS_CONTROL);
+    started.get_future().wait();
+  }
+
+  void release() { gate_.set_value(); }
+
+  /** The frames recorded so far, once count of them came or after 1 s. */
+  std::vector<Frame> frames(size_t count)
+  {
+    for (int i = 0; i < 1000; ++i)
+    {
+      {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        if (frames_.size() >= count)
+          break;
+      }
+      boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+    }
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    return frames_;
+  }
+
+  void record()
+  {
+    std::vector<unsigned char> line;
+    while (recording_)
+    {
+      struct pollfd fd = { master_, POLLIN, 0 };
+      if (::poll(&fd, 1, 10) <= 0)
+        continue;
+      unsigned char buffer[256];
+      int n = read(master_, buffer, sizeof(buffer));
+      if (n <= 0)
+        continue;
+      line.insert(line.end(), buffer, buffer + n);
+
+      // '::', id, size, then size bytes: command, payload and checksum
+      while (line.size() >= 4 && line.size() >= 4 + (size_t)line[3])
+      {
+        Frame frame;
+        frame.id = line[2];
+        frame.command = line[4];
+        for (int i = 5; i + 1 < 4 + line[3]; i += 2)
+          frame.values.push_back((short int)(line[i] << 8 | line[i + 1]));
+        {
+          boost::lock_guard<boost::mutex> lock(mutex_);
+          frames_.push_back(frame);
+        }
+        line.erase(line.begin(), line.begin() + 4 + line[3]);
+      }
+    }
+  }
+
+  CubeBus bus_;
+  int master_;
+  boost::promise<void> gate_;
+  boost::atomic<bool> recording_;
+  boost::thread recorder_;
+  boost::mutex mutex_;
+  std::vector<Frame> frames_;
+};
+
+/** The first input of every setpoint frame on the line. */
+static std::vector<short int> setpoints(const std::vector<Frame> &frames)
+{
+  std::vector<short int> result;
+  for (size_t i = 0; i < frames.size(); ++i)
+    if (frames[i].command == CMD_SET_INPUTS && !frames[i].values.empty())
+      result.push_back(frames[i].values[0]);
+  return result;
+}
+
+TEST_F(CubeBusLine, CoalescesQueuedSetpointsToTheNewest)
+{
+  short int inputs[NUM_OF_MOTORS] = { 0, 0 };
+  std::vector<CubeFuture> futures;
+
+  block();
+  for (int i = 1; i <= 5; ++i)
+  {
+    inputs[0] = inputs[1] = (short int)(100 * i);
+    futures.push_back(bus_.setInputs(1, inputs));
+  }
+  release();
+
+  for (size_t i = 0; i < futures.size(); ++i)
+  {
+    EXPECT_EQ(futures[i].get().status, 0);
+    EXPECT_EQ(futures[i].get().coalesced, i > 0) << "setpoint " << i;
+  }
+
+  std::vector<short int> sent = setpoints(frames(1));
+  ASSERT_EQ(sent.size(), 1u);
+  EXPECT_EQ(sent[0], 500);
+  EXPECT_EQ(bus_.counters().setpoints_sent, 1u);
+  EXPECT_EQ(bus_.counters().setpoints_coalesced, 4u);
+}
+
+TEST_F(CubeBusLine, CoalescesEachCubeOnItsOwn)
+{
+  short int inputs[NUM_OF_MOTORS] = { 0, 0 };
+
+  block();
+  inputs[0] = 10;
+  bus_.setInputs(1, inputs);
+  inputs[0] = 20;
+  bus_.setInputs(2, inputs);
+  inputs[0] = 11;
+  bus_.setInputs(1, inputs);
+  inputs[0] = 21;
+  CubeFuture last = bus_.setInputs(2, inputs);
+  release();
+  last.wait();
+
+  std::vector<Frame> sent = frames(2);
+  ASSERT_EQ(sent.size(), 2u);
+  EXPECT_EQ(sent[0].id, 1);
+  EXPECT_EQ(sent[0].values[0], 11);
+  EXPECT_EQ(sent[1].id, 2);
+  EXPECT_EQ(sent[1].values[0], 21);
+}
+
+TEST_F(CubeBusLine, NeverOvertakesAnEarlierBatch)
+{
+  short int inputs[NUM_OF_MOTORS] = { 0, 0 };
+  short int batch[1][NUM_OF_MOTORS] = { { 20, 20 } };
+  int ids[1] = { 1 };
+
+  // the cube must see 10, 20 and 30 in turn and end on 30
+  block();
+  inputs[0] = inputs[1] = 10;
+  bus_.setInputs(1, inputs);
+  bus_.setInputsBatch(1, ids, batch);
+  inputs[0] = inputs[1] = 30;
+  CubeFuture last = bus_.setInputs(1, inputs);
+  release();
+  last.wait();
+
+  std::vector<short int> sent = setpoints(frames(3));
+  ASSERT_EQ(sent.size(), 3u);
+  EXPECT_EQ(sent[0], 10);
+  EXPECT_EQ(sent[1], 20);
+  EXPECT_EQ(sent[2], 30);
+}
+
+TEST_F(CubeBusLine, SendsEverySetpointWhenCoalescingIsOff)
+{
+  short int inputs[NUM_OF_MOTORS] = { 0, 0 };
+  CubeFuture last;
+
+  bus_.setCoalescing(false);
+  block();
+  for (int i = 1; i <= 3; ++i)
+  {
+    inputs[0] = inputs[1] = (short int)i;
+    last = bus_.setInputs(1, inputs);
+  }
+  release();
+  EXPECT_FALSE(last.get().coalesced);
+
+  std::vector<short int> sent = setpoints(frames(3));
+  ASSERT_EQ(sent.size(), 3u);
+  for (int i = 0; i < 3; ++i)
+    EXPECT_EQ(sent[i], i + 1);
+}
+
+TEST_F(CubeBusLine, ServesControlThenPollsThenDiagnostics)
+{
+  std::vector<char> order;
+  const char tags[] = "dpcdpc";
+  const CubeBusClass classes[] = { BUS_CLASS_DIAGNOSTIC, BUS_CLASS_POLL, BUS_CLASS_CONTROL };
+  CubeFuture last;
+
+  block();
+  for (int i = 0; i < 6; ++i)
+    last = bus_.submitJob(boost::bind(note, &order, tags[i], 0, _1), classes[i % 3]);
+  release();
+  last.wait();
+  bus_.submitJob(boost::bind(note, &order, 'e', 0, _1)).wait();
+
+  EXPECT_EQ(std::string(order.begin(), order.end()), "ccppdde");
+}
+
+TEST_F(CubeBusLine, PollsOverBudgetLeaveRoomForDiagnostics)
+{
+  std::vector<char> order;
+  CubeFuture poll, diagnostic;
+
+  // polls may take a tenth of the bus while diagnostics wait, each poll 5 ms
+  bus_.setBudget(BUS_CLASS_POLL, 0.1);
+  block();
+  for (int i = 0; i < 20; ++i)
+    poll = bus_.submitJob(boost::bind(note, &order, 'p', 5, _1), BUS_CLASS_POLL);
+  for (int i = 0; i < 2; ++i)
+    diagnostic = bus_.submitJob(boost::bind(note, &order, 'd', 0, _1));
+  release();
+  poll.wait();
+  diagnostic.wait();
+
+  std::string served(order.begin(), order.end());
+  EXPECT_EQ(served[0], 'p');
+  EXPECT_LT(served.find('d'), 10u) << served;
+}
+
+TEST_F(CubeBusLine, ClassOverBudgetKeepsAnIdleBus)
+{
+  std::vector<char> order;
+  CubeFuture last;
+
+  // nothing else waits, so the budget must not hold the polls back
+  bus_.setBudget(BUS_CLASS_POLL, 0.1);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < 20; ++i)
+    last = bus_.submitJob(boost::bind(note, &order, 'p', 5, _1), BUS_CLASS_POLL);
+  last.wait();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  EXPECT_EQ(order.size(), 20u);
+  EXPECT_LT((end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000, 500);
+}
+
+TEST_F(CubeBusLine, WakesForEveryRequest)
+{
+  int lost[2] = { 0, 0 };
+  boost::thread_group producers;
+
+  for (int i = 0; i < 2; ++i)
+    producers.create_thread(boost::bind(pingPong, &bus_, 20000, &lost[i]));
+  producers.join_all();
+
+  EXPECT_EQ(lost[0] + lost[1], 0);
+}
+
+TEST_F(CubeBusLine, AnswersEveryRequestAcrossClose)
+{
+  std::vector<CubeFuture> futures[4];
+  boost::thread_group producers;
+
+  for (int i = 0; i < 4; ++i)
+    producers.create_thread(boost::bind(flood, &bus_, &futures[i]));
+  boost::this_thread::sleep(boost::posix_time::milliseconds(5));
+  bus_.close();
+  producers.join_all();
+
+  // served before the close or failed by it, none left waiting
+  for (int i = 0; i < 4; ++i)
+  {
+    ASSERT_FALSE(futures[i].empty());
+    for (size_t j = 0; j < futures[i].size(); ++j)
+      ASSERT_TRUE(futures[i][j].timed_wait(boost::posix_time::seconds(1)))
+        << "producer " << i << " request " << j;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,93 @@
+#include <cube_registry.h>
+
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/** A registry file in a fresh directory, and a pseudo-terminal standing for
+ *  a port nothing answers on. */
+class CubeRegistryFile : public testing::Test
+{
+protected:
+  CubeRegistryFile() : master_(-1) {}
+
+  virtual void SetUp()
+  {
+    char directory[] = "/tmp/cube_registry_XXXXXX";
+    ASSERT_TRUE(mkdtemp(directory));
+    directory_ = directory;
+    path_ = directory_ + "/sub/registry";
+
+    master_ = posix_openpt(O_RDWR | O_NOCTTY);
+    ASSERT_GE(master_, 0);
+    ASSERT_EQ(grantpt(master_), 0);
+    ASSERT_EQ(unlockpt(master_), 0);
+    port_ = ptsname(master_);
+    openRS485(&comm_, port_.c_str());
+    ASSERT_NE(comm_.file_handle, INVALID_HANDLE_VALUE);
+  }
+
+  virtual void TearDown()
+  {
+    closeRS485(&comm_);
+    ::close(master_);
+    remove(path_.c_str());
+    rmdir((directory_ + "/sub").c_str());
+    rmdir(directory_.c_str());
+  }
+
+  std::string directory_;
+  std::string path_;
+  std::string port_;
+  comm_settings comm_;
+  int master_;
+};
+
+TEST_F(CubeRegistryFile, KeepsRecordsAcrossSaveAndLoad)
+{
+  CubeRegistry registry(path_);
+  CubeRecord record;
+  record.id = 3;
+  record.params[PARAM_POS_RESOLUTION] = std::vector<unsigned char>(3, 1);
+  registry.update("/dev/ttyUSB0", record);
+  record.id = 1;
+  record.params.clear();
+  registry.update("/dev/ttyUSB0", record);
+  ASSERT_TRUE(registry.save());
+
+  CubeRegistry loaded(path_);
+  ASSERT_TRUE(loaded.load());
+  std::vector<int> ids = loaded.ids("/dev/ttyUSB0");
+  ASSERT_EQ(ids.size(), 2u);
+  EXPECT_EQ(ids[0], 3);
+  EXPECT_EQ(ids[1], 1);
+  ASSERT_TRUE(loaded.find("/dev/ttyUSB0", 3));
+  EXPECT_EQ(loaded.find("/dev/ttyUSB0", 3)->params.at(PARAM_POS_RESOLUTION),
+            std::vector<unsigned char>(3, 1));
+  EXPECT_TRUE(loaded.find("/dev/ttyUSB0", 1)->params.empty());
+}
+
+TEST_F(CubeRegistryFile, EmptyPortIsScannedOnce)
+{
+  std::vector<int> expected(1, 1);
+
+  CubeRegistry registry(path_);
+  EXPECT_EQ(registry.sync(&comm_, port_, expected), 0);
+  EXPECT_EQ(registry.scans(), 1);
+
+  // the next start only pings the expected cube
+  CubeRegistry restarted(path_);
+  ASSERT_TRUE(restarted.load());
+  EXPECT_EQ(restarted.sync(&comm_, port_, expected), 0);
+  EXPECT_EQ(restarted.scans(), 0);
+  EXPECT_TRUE(restarted.ids(port_).empty());
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,118 @@
+#include <cube_controller.h>
+
+#include <gtest/gtest.h>
+
+#include <boost/thread/thread.hpp>
+
+#include <math.h>
+#include <time.h>
+
+static long long monotonicUsec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+static void sleepUntil(long long stamp_us)
+{
+  long long now = monotonicUsec();
+  if (stamp_us > now)
+    boost::this_thread::sleep(boost::posix_time::microseconds(stamp_us - now));
+}
+
+/** A controller at 1 kHz on a bus that was never opened: its setpoints fail
+ *  at once, only the reference it works out matters here. */
+class CubeStream : public testing::Test
+{
+protected:
+  CubeStream() : controller_(bus_, 1) {}
+
+  virtual void SetUp() { ASSERT_TRUE(controller_.start(1000)); }
+  virtual void TearDown() { controller_.stop(); }
+
+  CubeBus bus_;
+  CubeController controller_;
+};
+
+TEST_F(CubeStream, InterpolatesOneDelayBehind)
+{
+  controller_.setStreamTiming(0.2, 0.1, 5);
+
+  // 1 tick/ms between the points, rendered 200 ms after their stamps
+  long long t0 = monotonicUsec();
+  controller_.stream(0, t0, 0);
+  controller_.stream(100, t0 + 100000, 0);
+  controller_.stream(200, t0 + 200000, 0);
+  EXPECT_TRUE(controller_.isStreaming());
+
+  sleepUntil(t0 + 150000);
+  EXPECT_EQ(controller_.reference(), 0);
+
+  sleepUntil(t0 + 200000 + 150000);
+  EXPECT_NEAR(controller_.reference(), 150, 20);
+}
+
+TEST_F(CubeStream, LeadsInFromTheLastReference)
+{
+  controller_.setStreamTiming(0.05, 0, 5);
+  controller_.hold(300);
+
+  boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+
+  // the first point is reached from 300 one delay after its stamp
+  long long t0 = monotonicUsec();
+  controller_.stream(800, t0, 0);
+
+  sleepUntil(t0 + 25000);
+  EXPECT_NEAR(controller_.reference(), 550, 50);
+  sleepUntil(t0 + 60000);
+  EXPECT_EQ(controller_.reference(), 800);
+}
+
+TEST_F(CubeStream, CoastsPastTheLastPointAndDecays)
+{
+  controller_.setStreamTiming(0.15, 0.1, 5);
+
+  // 1000 ticks/s at the last point, which coasts another 100 ticks
+  long long t0 = monotonicUsec();
+  controller_.stream(0, t0, 0);
+  controller_.stream(100, t0 + 100000, 0);
+
+  sleepUntil(t0 + 100000 + 150000 + 800000);
+  EXPECT_TRUE(controller_.isStreaming());
+  EXPECT_NEAR(controller_.reference(), 100 + 1000 * 0.1, 1);
+}
+
+TEST_F(CubeStream, EndsAfterTimeoutOnTheLastPoint)
+{
+  controller_.setStreamTiming(0.01, 0, 0.1);
+
+  long long t0 = monotonicUsec();
+  controller_.stream(0, t0, 0);
+  controller_.stream(400, t0 + 20000, 0);
+
+  sleepUntil(t0 + 20000 + 200000);
+  EXPECT_FALSE(controller_.isStreaming());
+  EXPECT_EQ(controller_.reference(), 400);
+}
+
+TEST_F(CubeStream, IgnoresLateAndDuplicatePoints)
+{
+  controller_.setStreamTiming(0.01, 0, 5);
+
+  long long t0 = monotonicUsec();
+  controller_.stream(0, t0, 0);
+  controller_.stream(500, t0 + 50000, 0);
+  controller_.stream(9999, t0 + 50000, 0);
+  controller_.stream(-9999, t0 + 20000, 0);
+
+  sleepUntil(t0 + 50000 + 10000 + 20000);
+  EXPECT_EQ(controller_.reference(), 500);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,123 @@
+#include <cube_trajectory.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+
+#include <math.h>
+
+static const double STEP = 1e-4;          // s
+static const double SLACK = 1e-6;         // relative, for rounding
+
+/** Walks a planned trajectory and checks it against the limits and its own
+ *  derivatives. Returns the largest jerk seen, by finite differences. */
+static double checkLimits(const CubeTrajectory &trajectory, const CubeMotionLimits &limits,
+                          double max_velocity)
+{
+  double previous_acceleration = 0;
+  double max_jerk = 0;
+
+  for (double t = 0; t <= trajectory.duration() + STEP; t += STEP)
+  {
+    double position, velocity, acceleration;
+    trajectory.sample(t, &position, &velocity, &acceleration);
+    EXPECT_LE(fabs(velocity), max_velocity * (1 + SLACK) + SLACK) << "t " << t;
+    EXPECT_LE(fabs(acceleration), limits.acceleration * (1 + SLACK) + SLACK) << "t " << t;
+
+    if (t > 0)
+      max_jerk = std::max(max_jerk, fabs(acceleration - previous_acceleration) / STEP);
+    previous_acceleration = acceleration;
+  }
+  return max_jerk;
+}
+
+TEST(CubeTrajectory, RestToRestWithinLimits)
+{
+  CubeMotionLimits limits(20000, 100000, 2000000);
+  const double distances[] = { 1, 50, 500, 4000, 8192, 60000, -3000 };
+
+  for (size_t i = 0; i < sizeof(distances) / sizeof(distances[0]); ++i)
+  {
+    CubeTrajectory trajectory;
+    ASSERT_TRUE(trajectory.plan(100, 100 + distances[i], limits));
+
+    EXPECT_LE(checkLimits(trajectory, limits, limits.velocity), limits.jerk * (1 + 1e-3));
+    double position, velocity, acceleration;
+    trajectory.sample(trajectory.duration() - 1e-9, &position, &velocity, &acceleration);
+    EXPECT_NEAR(position, 100 + distances[i], 1e-3) << "distance " << distances[i];
+    EXPECT_NEAR(velocity, 0, 1e-2);
+    EXPECT_NEAR(acceleration, 0, 1);
+  }
+}
+
+TEST(CubeTrajectory, TrapezoidWithoutJerkLimit)
+{
+  CubeMotionLimits limits(20000, 100000);
+  CubeTrajectory trajectory;
+  ASSERT_TRUE(trajectory.plan(0, 10000, limits));
+
+  checkLimits(trajectory, limits, limits.velocity);
+  // 0.2 s ramps each way and the rest at 20000 ticks/s
+  EXPECT_NEAR(trajectory.duration(), 0.7, 1e-9);
+  EXPECT_EQ(trajectory.position(trajectory.duration()), 10000);
+}
+
+TEST(CubeTrajectory, InvalidLimitsStep)
+{
+  CubeTrajectory trajectory;
+  EXPECT_FALSE(trajectory.plan(0, 500, CubeMotionLimits(0, 100000, 2000000)));
+  EXPECT_EQ(trajectory.duration(), 0);
+  EXPECT_EQ(trajectory.position(0), 500);
+}
+
+/** A goal replacing a move midway picks up its state exactly and stays
+ *  within the jerk limit through the switch, whatever the phase it lands in. */
+TEST(CubeTrajectory, PreemptingGoalStaysWithinLimits)
+{
+  CubeMotionLimits limits(20000, 100000, 2000000);
+  CubeTrajectory first;
+  ASSERT_TRUE(first.plan(0, 20000, limits));
+
+  const double targets[] = { -5000, 0, 3000, 20000, 40000 };
+  for (double fraction = 0.05; fraction < 1; fraction += 0.1)
+  {
+    for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); ++i)
+    {
+      double t0 = fraction * first.duration();
+      double position, velocity, acceleration;
+      first.sample(t0, &position, &velocity, &acceleration);
+
+      CubeTrajectory second;
+      ASSERT_TRUE(second.plan(position, velocity, acceleration, targets[i], limits));
+
+      double p, v, a;
+      second.sample(0, &p, &v, &a);
+      EXPECT_NEAR(p, position, 1e-9);
+      EXPECT_NEAR(v, velocity, 1e-9);
+      EXPECT_NEAR(a, acceleration, 1e-9);
+
+      EXPECT_LE(checkLimits(second, limits, limits.velocity), limits.jerk * (1 + 1e-3))
+        << "preempted at " << t0 << " s for " << targets[i];
+      second.sample(second.duration() - 1e-9, &p, &v, &a);
+      EXPECT_NEAR(p, targets[i], 1e-3);
+      EXPECT_NEAR(v, 0, 1e-2);
+    }
+  }
+}
+
+TEST(CubeTrajectory, BrakesOvershootingDeceleration)
+{
+  // slow and decelerating hard: easing off at once would still reverse
+  CubeMotionLimits limits(20000, 100000, 2000000);
+  CubeTrajectory trajectory;
+  ASSERT_TRUE(trajectory.plan(0, 100, -100000, 0, limits));
+
+  EXPECT_LE(checkLimits(trajectory, limits, limits.velocity), limits.jerk * (1 + 1e-3));
+  EXPECT_NEAR(trajectory.position(trajectory.duration() - 1e-9), 0, 1e-3);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,91 @@
+#include <cube_velocity_monitor.h>
+
+#include <gtest/gtest.h>
+
+#include <math.h>
+
+/** Feeds samples of a reading turning at velocity ticks/s, every period_us
+ *  from start_us, as the 16 bit value the cube reports. */
+static long long feed(CubeVelocityMonitor &monitor, double velocity, long long start_us,
+                      double seconds, long period_us = 2000, double offset = 0)
+{
+  long long stamp_us = start_us;
+  for (; stamp_us < start_us + (long long)(seconds * 1e6); stamp_us += period_us)
+  {
+    double position = offset + velocity * (stamp_us - start_us) / 1e6;
+    monitor.add(stamp_us, (short int)(unsigned short int)(long long)floor(position));
+  }
+  return stamp_us;
+}
+
+TEST(CubeVelocityMonitor, InactiveUntilReset)
+{
+  CubeVelocityMonitor monitor(0.2, 10);
+  feed(monitor, 1000, 0, 1);
+  EXPECT_FALSE(monitor.stats().active);
+  EXPECT_EQ(monitor.stats().samples, 0u);
+}
+
+TEST(CubeVelocityMonitor, MeasuresSlopeAndLocks)
+{
+  CubeVelocityMonitor monitor(0.2, 10);
+  monitor.reset(8192);
+
+  // not a whole window yet
+  feed(monitor, 8192, 0, 0.1);
+  EXPECT_FALSE(monitor.stats().locked);
+
+  feed(monitor, 8192, 0, 1);
+  CubeVelocityStats stats = monitor.stats();
+  EXPECT_TRUE(stats.active);
+  EXPECT_TRUE(stats.locked);
+  EXPECT_NEAR(stats.measured, 8192, 10);
+  EXPECT_LE(stats.max_error, 10);
+  EXPECT_GT(stats.samples, 0u);
+}
+
+TEST(CubeVelocityMonitor, UnwrapsEndlessRotation)
+{
+  // 20 turns of the 16 bit reading either way, well past what a short holds
+  const double velocities[] = { 65536 * 4.0, -65536 * 4.0 };
+  for (size_t i = 0; i < 2; ++i)
+  {
+    CubeVelocityMonitor monitor(0.2, 50);
+    monitor.reset(velocities[i]);
+    feed(monitor, velocities[i], 1000000, 5, 2000, 30000);
+
+    CubeVelocityStats stats = monitor.stats();
+    EXPECT_TRUE(stats.locked) << velocities[i];
+    EXPECT_NEAR(stats.measured, velocities[i], 50);
+    EXPECT_LE(stats.max_error, 50);
+  }
+}
+
+TEST(CubeVelocityMonitor, LateStampBarelyMovesTheSlope)
+{
+  CubeVelocityMonitor monitor(0.2, 20);
+  monitor.reset(5000);
+  long long stamp_us = feed(monitor, 5000, 0, 1);
+
+  // one sample stamped 3 ms late, as after a slow transaction
+  double position = 5000 * (stamp_us / 1e6);
+  monitor.add(stamp_us + 3000, (short int)(long long)floor(position));
+  EXPECT_NEAR(monitor.stats().measured, 5000, 200);
+}
+
+TEST(CubeVelocityMonitor, ReportsTheErrorOffCommand)
+{
+  CubeVelocityMonitor monitor(0.2, 10);
+  monitor.reset(5000);
+  feed(monitor, 4000, 0, 1);
+
+  CubeVelocityStats stats = monitor.stats();
+  EXPECT_FALSE(stats.locked);
+  EXPECT_NEAR(stats.error, -1000, 10);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,164 @@
+#include <qb_cube_codec.h>
+#include <qb_cube_lib.h>
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/** qbcubelib on a pseudo-terminal nothing answers on; the test reads back
+ *  what was written to the line. */
+class QbCubeLine : public testing::Test
+{
+protected:
+  QbCubeLine() : master_(-1) {}
+
+  virtual void SetUp()
+  {
+    master_ = posix_openpt(O_RDWR | O_NOCTTY);
+    ASSERT_GE(master_, 0);
+    ASSERT_EQ(grantpt(master_), 0);
+    ASSERT_EQ(unlockpt(master_), 0);
+    openRS485(&comm_, ptsname(master_));
+    ASSERT_NE(comm_.file_handle, INVALID_HANDLE_VALUE);
+  }
+
+  virtual void TearDown()
+  {
+    closeRS485(&comm_);
+    ::close(master_);
+  }
+
+  /** Everything written to the line so far. */
+  std::string line()
+  {
+    std::string result;
+    struct pollfd fd = { master_, POLLIN, 0 };
+    while (::poll(&fd, 1, 50) > 0)
+    {
+      char buffer[256];
+      int n = read(master_, buffer, sizeof(buffer));
+      if (n <= 0)
+        break;
+      result.append(buffer, n);
+    }
+    return result;
+  }
+
+  comm_settings comm_;
+  int master_;
+};
+
+TEST_F(QbCubeLine, PipelineSkipsOversizedTransactions)
+{
+  comm_transaction transactions[4];
+  const int sizes[] = { 0, COMM_PAYLOAD_SIZE + 1, -1, 100000 };
+
+  memset(transactions, 0, sizeof(transactions));
+  for (int i = 0; i < 4; ++i)
+  {
+    transactions[i].id = i + 1;
+    transactions[i].command = CMD_GET_MEASUREMENTS;
+    transactions[i].payload_size = sizes[i];
+  }
+
+  EXPECT_EQ(commPipeline(&comm_, transactions, 4, 4), 0);
+  for (int i = 0; i < 4; ++i)
+    EXPECT_EQ(transactions[i].package_in_size, -1) << "transaction " << i;
+
+  // only the first request reached the line, as a whole frame
+  std::string sent = line();
+  ASSERT_EQ(sent.size(), 6u);
+  EXPECT_EQ(sent[2], 1);
+  EXPECT_EQ(sent[4], (char)CMD_GET_MEASUREMENTS);
+}
+
+TEST_F(QbCubeLine, PipelineSendsAFullPayload)
+{
+  comm_transaction transaction;
+
+  memset(&transaction, 0, sizeof(transaction));
+  transaction.id = 1;
+  transaction.command = CMD_SET_INPUTS;
+  transaction.payload_size = COMM_PAYLOAD_SIZE;
+
+  commPipeline(&comm_, &transaction, 1, 1);
+  EXPECT_EQ(line().size(), 6u + COMM_PAYLOAD_SIZE);
+}
+
+/** Keeps the counters growing and resets them after each step, until told
+ *  to stop. */
+static void *countAndReset(void *arg)
+{
+  comm_settings *comm = static_cast<comm_settings *>(arg);
+  while (!__atomic_load_n(&comm->stats_command, __ATOMIC_RELAXED))
+  {
+    __atomic_fetch_add(&comm->stats.timeouts, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&comm->stats.syscalls, 3, __ATOMIC_RELAXED);
+    commStatsReset(comm);
+    sched_yield();
+  }
+  return NULL;
+}
+
+TEST_F(QbCubeLine, SnapshotNeverMixesBaselines)
+{
+  pthread_t resetters[2];
+  comm_stats snapshot;
+  int wrapped = 0;
+
+  // stats_command doubles as the stop flag, nothing is timed here
+  comm_.stats_command = 0;
+  for (int i = 0; i < 2; ++i)
+    ASSERT_EQ(pthread_create(&resetters[i], NULL, countAndReset, &comm_), 0);
+  for (int i = 0; i < 20000; ++i)
+  {
+    // a baseline newer than the counters read against it wraps them
+    commStatsSnapshot(&comm_, &snapshot);
+    if (snapshot.timeouts > ULONG_MAX / 2 || snapshot.syscalls > ULONG_MAX / 2)
+      ++wrapped;
+  }
+  __atomic_store_n(&comm_.stats_command, 1, __ATOMIC_RELAXED);
+  for (int i = 0; i < 2; ++i)
+    pthread_join(resetters[i], NULL);
+  comm_.stats_command = -1;
+  EXPECT_EQ(wrapped, 0);
+
+  commStatsReset(&comm_);
+  commStatsSnapshot(&comm_, &snapshot);
+  EXPECT_EQ(snapshot.timeouts, 0ul);
+  EXPECT_EQ(snapshot.syscalls, 0ul);
+}
+
+TEST(QbCubeCodec, DecodesBigEndianShorts)
+{
+  const char package[] = { (char)CMD_GET_MEASUREMENTS, 0x12, 0x34, (char)0xff, (char)0xfe,
+                           (char)0x80, 0x00, 0 };
+  qbcodec::GetMeasurements::Reply reply;
+
+  ASSERT_TRUE(qbcodec::decode<qbcodec::GetMeasurements>(package, sizeof(package), reply));
+  EXPECT_EQ(reply.values[0], 0x1234);
+  EXPECT_EQ(reply.values[1], -2);
+  EXPECT_EQ(reply.values[2], -32768);
+  EXPECT_FALSE(qbcodec::decode<qbcodec::GetMeasurements>(package, sizeof(package) - 1, reply));
+
+  char frame[2];
+  for (int value = -32768; value < 32768; value += 257)
+  {
+    qbcodec::putShort(frame, (short int)value);
+    EXPECT_EQ(qbcodec::getShort(frame), value);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}